@@ -0,0 +1,91 @@
+#include "AsyncFrameReader.h"
+
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <algorithm>
+#include <stdexcept>
+#include <utility>
+
+namespace nuisken {
+namespace io {
+
+AsyncFrameReader::AsyncFrameReader(const std::string& videoFilePath, int capacity)
+        : capture_(videoFilePath),
+          capacity_(std::max(1, capacity)),
+          fps_(capture_.get(cv::CAP_PROP_FPS)),
+          isEnded_(false),
+          isStopping_(false) {
+    if (!capture_.isOpened()) {
+        throw std::runtime_error("failed to open " + videoFilePath);
+    }
+    decodeThread_ = std::thread([this]() { decode(); });
+}
+
+AsyncFrameReader::~AsyncFrameReader() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        isStopping_ = true;
+    }
+    framesRemoved_.notify_all();
+    decodeThread_.join();
+}
+
+bool AsyncFrameReader::read(cv::Mat1b& frame) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    framesAdded_.wait(lock, [this]() { return !frames_.empty() || isEnded_; });
+    if (frames_.empty()) {
+        return false;
+    }
+
+    std::swap(frame, frames_.front());
+    if (!frames_.front().empty()) {
+        freeFrames_.push_back(std::move(frames_.front()));
+    }
+    frames_.pop_front();
+    lock.unlock();
+    framesRemoved_.notify_one();
+    return true;
+}
+
+void AsyncFrameReader::decode() {
+    cv::Mat decodedFrame;
+    while (true) {
+        cv::Mat1b frame;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            framesRemoved_.wait(lock, [this]() {
+                return static_cast<int>(frames_.size()) < capacity_ || isStopping_;
+            });
+            if (isStopping_) {
+                break;
+            }
+            if (!freeFrames_.empty()) {
+                frame = std::move(freeFrames_.back());
+                freeFrames_.pop_back();
+            }
+        }
+
+        if (!capture_.read(decodedFrame) || decodedFrame.empty()) {
+            break;
+        }
+        if (decodedFrame.channels() == 1) {
+            decodedFrame.copyTo(frame);
+        } else {
+            cv::cvtColor(decodedFrame, frame, cv::COLOR_BGR2GRAY);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            frames_.push_back(std::move(frame));
+        }
+        framesAdded_.notify_one();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        isEnded_ = true;
+    }
+    framesAdded_.notify_all();
+}
+}
+}
@@ -0,0 +1,58 @@
+#ifndef ASYNC_FRAME_READER
+#define ASYNC_FRAME_READER
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/videoio.hpp>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace nuisken {
+namespace io {
+
+/**
+ * 動画を別スレッドで先読みし，グレースケールのフレームを順に渡す
+ * 検出でカラーの映像を入力したときと同じ値になるように，変換は常に読み込み側のスレッドで
+ * cvtColor(COLOR_BGR2GRAY)で行う（バックエンドのグレースケール出力は使わない）
+ * 先読みはcapacityフレームまでで，フレームの領域は使い回す
+ */
+class AsyncFrameReader {
+   private:
+    cv::VideoCapture capture_;
+    int capacity_;
+    double fps_;
+
+    std::deque<cv::Mat1b> frames_;
+    std::vector<cv::Mat1b> freeFrames_;
+    bool isEnded_;
+    bool isStopping_;
+    std::mutex mutex_;
+    std::condition_variable framesAdded_;
+    std::condition_variable framesRemoved_;
+    std::thread decodeThread_;
+
+   public:
+    AsyncFrameReader(const std::string& videoFilePath, int capacity = 16);
+    AsyncFrameReader(const AsyncFrameReader&) = delete;
+    AsyncFrameReader& operator=(const AsyncFrameReader&) = delete;
+    ~AsyncFrameReader();
+
+    /**
+     * 次のフレームをframeに書き込む（終端ならfalse）
+     * frameの領域とは入れ替えるので，frameが持っていた領域は後のフレームに再利用される
+     */
+    bool read(cv::Mat1b& frame);
+
+    double getFps() const { return fps_; }
+
+   private:
+    void decode();
+};
+}
+}
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef BINARY_CODING
+#define BINARY_CODING
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+namespace nuisken {
+namespace coding {
+
+/**
+ * 可変長整数（LEB128）とzigzag符号化
+ * 決定木のバイナリ形式で使用する
+ */
+inline std::uint64_t encodeZigzag(std::int64_t value) {
+    return (static_cast<std::uint64_t>(value) << 1) ^ static_cast<std::uint64_t>(value >> 63);
+}
+
+inline std::int64_t decodeZigzag(std::uint64_t value) {
+    return static_cast<std::int64_t>(value >> 1) ^ -static_cast<std::int64_t>(value & 1);
+}
+
+inline void writeVarint(std::string& buffer, std::uint64_t value) {
+    while (value >= 0x80) {
+        buffer.push_back(static_cast<char>((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    buffer.push_back(static_cast<char>(value));
+}
+
+inline void writeSignedVarint(std::string& buffer, std::int64_t value) {
+    writeVarint(buffer, encodeZigzag(value));
+}
+
+inline void writeDouble(std::string& buffer, double value) {
+    char bytes[sizeof(double)];
+    std::memcpy(bytes, &value, sizeof(double));
+    buffer.append(bytes, sizeof(double));
+}
+
+inline std::uint64_t readVarint(const char*& cursor, const char* end) {
+    std::uint64_t value = 0;
+    int shift = 0;
+    while (cursor != end) {
+        auto byte = static_cast<unsigned char>(*cursor++);
+        value |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            return value;
+        }
+        shift += 7;
+    }
+    throw std::runtime_error("truncated varint");
+}
+
+inline std::int64_t readSignedVarint(const char*& cursor, const char* end) {
+    return decodeZigzag(readVarint(cursor, end));
+}
+
+inline double readDouble(const char*& cursor, const char* end) {
+    if (end - cursor < static_cast<std::ptrdiff_t>(sizeof(double))) {
+        throw std::runtime_error("truncated double");
+    }
+    double value;
+    std::memcpy(&value, cursor, sizeof(double));
+    cursor += sizeof(double);
+    return value;
+}
+
+/**
+ * FNV-1aハッシュ（64bit）
+ * hashに前回の値を渡すと続けて計算する
+ */
+inline std::uint64_t hashFNV1a(const char* data, std::size_t size,
+                               std::uint64_t hash = 14695981039346656037ULL) {
+    for (std::size_t i = 0; i < size; ++i) {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+}
+}
+
+#endif
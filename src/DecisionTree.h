@@ -9,6 +9,8 @@
 #include <fstream>
 #include <map>
 #include <memory>
+#include <string>
+#include <vector>
 
 namespace nuisken {
 namespace randomforests {
@@ -47,6 +49,8 @@ class DecisionTree {
 
     int getNumberOfLeaves() const;
 
+    int getDepth() const;
+
     void setType(const Type& type) { this->type = type; }
 
     void grow(const std::vector<FeatureRawPtr>& features);
@@ -54,7 +58,23 @@ class DecisionTree {
     void mapLeafIndices();
 
     void save(std::ofstream& treeStream) const;
-    void load(std::ifstream& treeStream);
+    void load(std::ifstream& treeStream, bool isLazy = false);
+
+    /**
+     * バイナリ形式（isCompressedならzlibで圧縮）
+     * 読み込んだ葉のデータは最初にマッチした時に解析する
+     */
+    void saveBinary(std::ofstream& treeStream, bool isCompressed) const;
+    void loadBinary(std::ifstream& treeStream);
+
+    void collectLeaves(std::vector<const TreeNode<Type>*>& leaves) const {
+        root->collectLeaves(leaves);
+    }
+
+    void collectSplitParameters(
+            std::vector<typename Type::SplitParametersType>& splitParameters) const {
+        root->collectSplitParameters(splitParameters);
+    }
 
    private:
     void trainNode(std::unique_ptr<TreeNode<Type>>& node,
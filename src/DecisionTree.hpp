@@ -3,6 +3,16 @@
 
 #include "DecisionTree.h"
 
+#include <boost/iostreams/copy.hpp>
+#include <boost/iostreams/device/array.hpp>
+#include <boost/iostreams/device/back_inserter.hpp>
+#include <boost/iostreams/filter/zlib.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+
+#include <algorithm>
+#include <iterator>
+#include <stdexcept>
+
 namespace nuisken {
 namespace randomforests {
 
@@ -58,6 +68,18 @@ int DecisionTree<Type>::getNumberOfLeaves(const std::unique_ptr<TreeNode<Type>>&
     }
 }
 
+template <class Type>
+int DecisionTree<Type>::getDepth() const {
+    std::vector<const TreeNode<Type>*> leaves;
+    collectLeaves(leaves);
+
+    int depth = 0;
+    for (const auto& leaf : leaves) {
+        depth = std::max(depth, leaf->getDepth());
+    }
+    return depth;
+}
+
 template <class Type>
 void DecisionTree<Type>::numberNodes() {
     auto nodeIndex = 0;
@@ -100,12 +122,61 @@ void DecisionTree<Type>::save(std::ofstream& treeStream) const {
 }
 
 template <class Type>
-void DecisionTree<Type>::load(std::ifstream& treeStream) {
+void DecisionTree<Type>::load(std::ifstream& treeStream, bool isLazy) {
+    root = std::make_unique<TreeNode<Type>>();
+    root->setType(type);
+    root->load(treeStream, isLazy);
+}
+
+template <class Type>
+void DecisionTree<Type>::saveBinary(std::ofstream& treeStream, bool isCompressed) const {
+    std::string buffer;
+    root->encode(buffer);
+
+    if (isCompressed) {
+        std::string compressedBuffer;
+        {
+            boost::iostreams::filtering_ostream compressor;
+            compressor.push(boost::iostreams::zlib_compressor());
+            compressor.push(boost::iostreams::back_inserter(compressedBuffer));
+            compressor.write(buffer.data(), buffer.size());
+        }
+        buffer.swap(compressedBuffer);
+    }
+
+    const char header[] = {'H', 'F', 'T', 'B', 1, static_cast<char>(isCompressed)};
+    treeStream.write(header, sizeof(header));
+    treeStream.write(buffer.data(), buffer.size());
+}
+
+template <class Type>
+void DecisionTree<Type>::loadBinary(std::ifstream& treeStream) {
+    std::string buffer((std::istreambuf_iterator<char>(treeStream)),
+                       std::istreambuf_iterator<char>());
+    const std::size_t headerSize = 6;
+    if (buffer.size() < headerSize || buffer.compare(0, 4, "HFTB") != 0 || buffer[4] != 1) {
+        throw std::runtime_error("invalid binary tree file");
+    }
+    bool isCompressed = buffer[5] != 0;
+
+    if (isCompressed) {
+        std::string decompressedBuffer;
+        boost::iostreams::filtering_istream decompressor;
+        decompressor.push(boost::iostreams::zlib_decompressor());
+        decompressor.push(boost::iostreams::array_source(buffer.data() + headerSize,
+                                                         buffer.size() - headerSize));
+        boost::iostreams::copy(decompressor, boost::iostreams::back_inserter(decompressedBuffer));
+        buffer.swap(decompressedBuffer);
+    } else {
+        buffer.erase(0, headerSize);
+    }
+
     root = std::make_unique<TreeNode<Type>>();
     root->setType(type);
-    root->load(treeStream);
+    const char* cursor = buffer.data();
+    root->decode(cursor, buffer.data() + buffer.size());
 }
 }
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,84 @@
+#ifndef DESCRIPTOR_BATCH
+#define DESCRIPTOR_BATCH
+
+#include <opencv2/core/core.hpp>
+
+#include <memory>
+#include <vector>
+
+namespace nuisken {
+namespace storage {
+class FeatureValueSource;
+}
+
+namespace houghforests {
+
+/**
+ * 1スケール分の局所特徴（中心座標と記述子）
+ * 記述子は[点の数 x 次元数]の連続した配列に持ち，再利用すれば確保し直さない
+ * 各記述子はnChannels個のチャネルを同じ次元数ずつ順に並べたもの
+ */
+class DescriptorBatch {
+   private:
+    std::vector<cv::Vec3i> points_;
+    std::shared_ptr<std::vector<float>> descriptors_;
+    int nDimensions_;
+    int nChannels_;
+    std::shared_ptr<const storage::FeatureValueSource> valueSource_;
+
+   public:
+    DescriptorBatch()
+            : descriptors_(std::make_shared<std::vector<float>>()),
+              nDimensions_(0),
+              nChannels_(1){};
+    DescriptorBatch(const DescriptorBatch&) = delete;
+    DescriptorBatch& operator=(const DescriptorBatch&) = delete;
+    DescriptorBatch(DescriptorBatch&&) = default;
+    DescriptorBatch& operator=(DescriptorBatch&&) = default;
+
+    void resize(int nPoints, int nDimensions, int nChannels) {
+        points_.resize(nPoints);
+        descriptors_->resize(static_cast<std::size_t>(nPoints) * nDimensions);
+        nDimensions_ = nDimensions;
+        nChannels_ = nChannels;
+    }
+
+    int size() const { return points_.size(); }
+    bool empty() const { return points_.empty(); }
+    int getNumberOfDimensions() const { return nDimensions_; }
+    int getNumberOfChannels() const { return nChannels_; }
+
+    const std::vector<cv::Vec3i>& getPoints() const { return points_; }
+    cv::Vec3i& getPoint(int index) { return points_[index]; }
+    const cv::Vec3i& getPoint(int index) const { return points_[index]; }
+
+    float* getDescriptor(int index) {
+        return descriptors_->data() + static_cast<std::size_t>(index) * nDimensions_;
+    }
+    const float* getDescriptor(int index) const {
+        return descriptors_->data() + static_cast<std::size_t>(index) * nDimensions_;
+    }
+
+    /**
+     * 遅延評価する場合の記述子の計算元（未計算の値はNaN，点の番号が計算元での番号になる）
+     * nullptrなら全て計算済み
+     */
+    const std::shared_ptr<const storage::FeatureValueSource>& getValueSource() const {
+        return valueSource_;
+    }
+    void setValueSource(const std::shared_ptr<const storage::FeatureValueSource>& valueSource) {
+        valueSource_ = valueSource;
+    }
+
+    /**
+     * 記述子を指すshared_ptr（バッチと所有権を共有する）
+     * 次にresizeするまで有効
+     */
+    std::shared_ptr<const float> getSharedDescriptor(int index) const {
+        return std::shared_ptr<const float>(descriptors_, getDescriptor(index));
+    }
+};
+}
+}
+
+#endif
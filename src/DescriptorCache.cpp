@@ -0,0 +1,168 @@
+#include "DescriptorCache.h"
+#include "BinaryCoding.h"
+
+#include <cstdio>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+
+namespace nuisken {
+namespace houghforests {
+
+namespace {
+
+template <typename T>
+void writeValue(std::ofstream& outputStream, T value) {
+    outputStream.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template <typename T>
+T readValue(const char*& cursor, const char* end) {
+    if (end - cursor < static_cast<std::ptrdiff_t>(sizeof(T))) {
+        throw std::runtime_error("truncated descriptor cache");
+    }
+    T value;
+    std::memcpy(&value, cursor, sizeof(T));
+    cursor += sizeof(T);
+    return value;
+}
+}
+
+const char DescriptorCache::MAGIC_[4] = {'H', 'F', 'D', 'C'};
+const std::uint32_t DescriptorCache::VERSION_ = 2;
+
+DescriptorCache::~DescriptorCache() {
+    if (isWriting()) {
+        // close()されなかった記録は破棄する
+        outputStream_.close();
+        std::remove(temporaryFilePath_.c_str());
+    }
+}
+
+std::string DescriptorCache::getFilePath(const std::string& cacheDirectoryPath,
+                                         const std::string& videoFilePath,
+                                         const std::string& parameterKey) {
+    {
+        std::ifstream inputStream(videoFilePath, std::ios::binary | std::ios::ate);
+        if (!inputStream.is_open() || inputStream.tellg() <= 0) {
+            return "";
+        }
+    }
+
+    boost::iostreams::mapped_file_source videoFile(videoFilePath);
+    std::uint64_t hash = coding::hashFNV1a(videoFile.data(), videoFile.size());
+    hash = coding::hashFNV1a(parameterKey.data(), parameterKey.size(), hash);
+
+    std::ostringstream fileName;
+    fileName << std::hex << std::setw(16) << std::setfill('0') << hash;
+    return cacheDirectoryPath + fileName.str() + ".desc";
+}
+
+bool DescriptorCache::open(const std::string& filePath) {
+    {
+        std::ifstream inputStream(filePath, std::ios::binary | std::ios::ate);
+        if (!inputStream.is_open() || inputStream.tellg() <= 0) {
+            return false;
+        }
+    }
+
+    mappedFile_.open(filePath);
+    cursor_ = mappedFile_.data();
+    end_ = cursor_ + mappedFile_.size();
+    if (end_ - cursor_ < 8 || std::memcmp(cursor_, MAGIC_, sizeof(MAGIC_)) != 0) {
+        mappedFile_.close();
+        return false;
+    }
+    cursor_ += sizeof(MAGIC_);
+    if (readValue<std::uint32_t>(cursor_, end_) != VERSION_) {
+        mappedFile_.close();
+        return false;
+    }
+    return true;
+}
+
+bool DescriptorCache::readCycle(std::size_t& storedFeatureBeginT,
+                                std::vector<DescriptorBatch>& scaleBatches) {
+    if (cursor_ == end_) {
+        return false;
+    }
+
+    storedFeatureBeginT = readValue<std::uint64_t>(cursor_, end_);
+    std::uint32_t nScales = readValue<std::uint32_t>(cursor_, end_);
+    scaleBatches.resize(nScales);
+    for (std::uint32_t scaleIndex = 0; scaleIndex < nScales; ++scaleIndex) {
+        std::uint32_t nPoints = readValue<std::uint32_t>(cursor_, end_);
+        std::uint32_t nDimensions = readValue<std::uint32_t>(cursor_, end_);
+        std::uint32_t nChannels = readValue<std::uint32_t>(cursor_, end_);
+        std::size_t pointBytes = static_cast<std::size_t>(nPoints) * 3 * sizeof(std::int32_t);
+        std::size_t descriptorBytes =
+                static_cast<std::size_t>(nPoints) * nDimensions * sizeof(float);
+        if (static_cast<std::size_t>(end_ - cursor_) < pointBytes + descriptorBytes) {
+            throw std::runtime_error("truncated descriptor cache");
+        }
+
+        auto& batch = scaleBatches.at(scaleIndex);
+        batch.resize(nPoints, nDimensions, nChannels);
+        batch.setValueSource(nullptr);
+        for (std::uint32_t i = 0; i < nPoints; ++i) {
+            std::memcpy(batch.getPoint(i).val, cursor_, 3 * sizeof(std::int32_t));
+            cursor_ += 3 * sizeof(std::int32_t);
+        }
+        if (nPoints != 0) {
+            std::memcpy(batch.getDescriptor(0), cursor_, descriptorBytes);
+        }
+        cursor_ += descriptorBytes;
+    }
+    return true;
+}
+
+void DescriptorCache::create(const std::string& filePath) {
+    filePath_ = filePath;
+    temporaryFilePath_ = filePath + ".tmp";
+    outputStream_.open(temporaryFilePath_, std::ios::binary);
+    outputStream_.write(MAGIC_, sizeof(MAGIC_));
+    writeValue<std::uint32_t>(outputStream_, VERSION_);
+}
+
+void DescriptorCache::writeCycle(std::size_t storedFeatureBeginT,
+                                 const std::vector<DescriptorBatch>& scaleBatches) {
+    writeValue<std::uint64_t>(outputStream_, storedFeatureBeginT);
+    writeValue<std::uint32_t>(outputStream_, scaleBatches.size());
+    for (const auto& batch : scaleBatches) {
+        std::uint32_t nDimensions = batch.empty() ? 0 : batch.getNumberOfDimensions();
+        writeValue<std::uint32_t>(outputStream_, batch.size());
+        writeValue<std::uint32_t>(outputStream_, nDimensions);
+        writeValue<std::uint32_t>(outputStream_, batch.getNumberOfChannels());
+        for (const auto& point : batch.getPoints()) {
+            outputStream_.write(reinterpret_cast<const char*>(point.val),
+                                3 * sizeof(std::int32_t));
+        }
+        if (!batch.empty()) {
+            outputStream_.write(reinterpret_cast<const char*>(batch.getDescriptor(0)),
+                                static_cast<std::size_t>(batch.size()) * nDimensions *
+                                        sizeof(float));
+        }
+    }
+}
+
+void DescriptorCache::close() {
+    if (isReading()) {
+        mappedFile_.close();
+        cursor_ = nullptr;
+        end_ = nullptr;
+    }
+    if (isWriting()) {
+        bool isSucceeded = outputStream_.good();
+        outputStream_.close();
+        if (isSucceeded) {
+            std::remove(filePath_.c_str());
+            isSucceeded = std::rename(temporaryFilePath_.c_str(), filePath_.c_str()) == 0;
+        }
+        if (!isSucceeded) {
+            std::remove(temporaryFilePath_.c_str());
+        }
+    }
+}
+}
+}
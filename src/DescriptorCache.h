@@ -0,0 +1,68 @@
+#ifndef DESCRIPTOR_CACHE
+#define DESCRIPTOR_CACHE
+
+#include "DescriptorBatch.h"
+
+#include <opencv2/core/core.hpp>
+
+#include <boost/iostreams/device/mapped_file.hpp>
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace nuisken {
+namespace houghforests {
+
+/**
+ * LocalFeatureExtractorが抽出した局所特徴のキャッシュ
+ * 抽出1回分（各スケールの点と記述子）を順に記録し，検出時に再生する
+ */
+class DescriptorCache {
+   private:
+    static const char MAGIC_[4];
+    static const std::uint32_t VERSION_;
+
+    boost::iostreams::mapped_file_source mappedFile_;
+    const char* cursor_;
+    const char* end_;
+
+    std::ofstream outputStream_;
+    std::string filePath_;
+    std::string temporaryFilePath_;
+
+   public:
+    DescriptorCache() : cursor_(nullptr), end_(nullptr){};
+    ~DescriptorCache();
+
+    /**
+     * 動画の内容と特徴抽出のパラメータから決まるキャッシュのファイルパス
+     */
+    static std::string getFilePath(const std::string& cacheDirectoryPath,
+                                   const std::string& videoFilePath,
+                                   const std::string& parameterKey);
+
+    /**
+     * 完成したキャッシュを開く
+     * 存在しないか不正な場合はfalse
+     */
+    bool open(const std::string& filePath);
+    bool readCycle(std::size_t& storedFeatureBeginT, std::vector<DescriptorBatch>& scaleBatches);
+
+    /**
+     * 記録を開始する
+     * close()するまでは一時ファイルに書き込むので，途中で終了したキャッシュは使われない
+     */
+    void create(const std::string& filePath);
+    void writeCycle(std::size_t storedFeatureBeginT,
+                    const std::vector<DescriptorBatch>& scaleBatches);
+    void close();
+
+    bool isReading() const { return mappedFile_.is_open(); }
+    bool isWriting() const { return outputStream_.is_open(); }
+};
+}
+}
+
+#endif
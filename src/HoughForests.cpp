@@ -24,6 +24,19 @@
 namespace nuisken {
 namespace houghforests {
 
+namespace {
+
+void updateMinMaxT(int t, std::pair<std::size_t, std::size_t>& minMaxRange) {
+    t = std::max(t, 0);
+    if (t < minMaxRange.first) {
+        minMaxRange.first = t;
+    }
+    if (t > minMaxRange.second) {
+        minMaxRange.second = t;
+    }
+}
+}
+
 void HoughForests::train(const std::vector<FeaturePtr>& features) {
     randomForests_.train(features, nThreads_);
 }
@@ -34,14 +47,19 @@ void HoughForests::detect(const std::vector<std::string>& featureFilePaths,
     scaleFeatures.reserve(featureFilePaths.size());
     int minT = std::numeric_limits<int>::max();
     int maxT = 0;
+    std::shared_ptr<const std::vector<int>> channelOffsets = std::make_shared<std::vector<int>>(
+            std::vector<int>{0, io::N_STIP_HOG_DIMENSIONS, io::N_STIP_DIMENSIONS});
     for (const auto& featureFilePath : featureFilePaths) {
-        std::vector<std::vector<Eigen::MatrixXf>> features;
+        auto descriptors = std::make_shared<std::vector<float>>();
         std::vector<cv::Vec3i> points;
-        io::readSTIPFeatures(featureFilePath, features, points);
-        std::unordered_map<int, std::vector<FeaturePtr>> featuresMap(features.size());
-        for (int i = 0; i < features.size(); ++i) {
+        io::readSTIPFeatures(featureFilePath, points, *descriptors, nThreads_);
+        std::unordered_map<int, std::vector<FeaturePtr>> featuresMap(points.size());
+        for (int i = 0; i < points.size(); ++i) {
+            std::shared_ptr<const float> featureValues(
+                    descriptors, descriptors->data() + i * io::N_STIP_DIMENSIONS);
             auto feature = std::make_shared<randomforests::STIPNode::FeatureType>(
-                    features.at(i), points.at(i), cv::Vec3i(), std::make_pair(0.0, 0.0), 0);
+                    featureValues, channelOffsets, points.at(i), cv::Vec3i(),
+                    std::make_pair(0.0, 0.0), 0);
             if (featuresMap.count(points.at(i)(T)) == 0) {
                 featuresMap.insert(
                         std::make_pair(points.at(i)(T), std::vector<FeaturePtr>{feature}));
@@ -133,6 +151,7 @@ void HoughForests::detect(LocalFeatureExtractor& extractor, cv::VideoCapture& ca
     std::vector<std::vector<Cuboid>> fixedDetectionCuboids(
             parameters_.getNumberOfPositiveClasses());
     std::vector<std::vector<Cuboid>> detectionCuboids(parameters_.getNumberOfPositiveClasses());
+    std::vector<DescriptorBatch> scaleBatches;
     std::vector<std::unordered_map<int, std::vector<Cuboid>>> visualizationDetectionCuboids(
             parameters_.getNumberOfPositiveClasses());
     bool isEnded = false;
@@ -173,21 +192,16 @@ void HoughForests::detect(LocalFeatureExtractor& extractor, cv::VideoCapture& ca
         //<< std::chrono::duration_cast<std::chrono::milliseconds>(readEnd - begin).count()
         //<< std::endl;
 
-        std::vector<std::vector<cv::Vec3i>> scalePoints;
-        std::vector<std::vector<std::vector<float>>> scaleDescriptors;
-        extractor.extractLocalFeatures(inputVideo, scalePoints, scaleDescriptors);
+        extractor.extractLocalFeatures(inputVideo, scaleBatches);
         auto featEnd = std::chrono::system_clock::now();
-        std::cout
-                << "extract features: "
-                << std::chrono::duration_cast<std::chrono::milliseconds>(featEnd - readEnd).count()
-                << std::endl;
+        printExtractionReport(
+                extractor,
+                std::chrono::duration_cast<std::chrono::milliseconds>(featEnd - readEnd).count());
 
         std::vector<std::vector<FeaturePtr>> scaleFeatures;
-        scaleFeatures.reserve(scalePoints.size());
-        for (int scaleIndex = 0; scaleIndex < scalePoints.size(); ++scaleIndex) {
-            scaleFeatures.push_back(convertFeatureFormats(scalePoints.at(scaleIndex),
-                                                          scaleDescriptors.at(scaleIndex),
-                                                          extractor.N_CHANNELS_));
+        scaleFeatures.reserve(scaleBatches.size());
+        for (const auto& batch : scaleBatches) {
+            scaleFeatures.push_back(convertFeatureFormats(batch));
         }
 
         auto voteBegin = std::chrono::system_clock::now();
@@ -223,6 +237,9 @@ void HoughForests::detect(LocalFeatureExtractor& extractor, cv::VideoCapture& ca
                                    fixedDetectionCuboids.at(classLabel),
                                    extractor.getStoredFeatureBeginT());
         }
+        if (voteCache_ != nullptr) {
+            voteCache_->endCycle(extractor.getStoredFeatureBeginT());
+        }
 
         // auto end = std::chrono::system_clock::now();
         // std::cout << "one cycle: "
@@ -233,6 +250,180 @@ void HoughForests::detect(LocalFeatureExtractor& extractor, cv::VideoCapture& ca
     videoHandlerThread.join();
 
     std::cout << "output process" << std::endl;
+    outputDetectionResults(detectionCuboids, fixedDetectionCuboids, detectionResults);
+}
+
+void HoughForests::detect(LocalFeatureExtractor& extractor,
+                          std::vector<std::vector<DetectionResult>>& detectionResults) {
+    std::cout << "initialize" << std::endl;
+    initialize();
+
+    std::vector<std::vector<Cuboid>> fixedDetectionCuboids(
+            parameters_.getNumberOfPositiveClasses());
+    std::vector<std::vector<Cuboid>> detectionCuboids(parameters_.getNumberOfPositiveClasses());
+    std::vector<DescriptorBatch> scaleBatches;
+    while (true) {
+        std::cout << "t feature: " << extractor.getStoredFeatureBeginT() << std::endl;
+        auto featBegin = std::chrono::system_clock::now();
+        extractor.extractLocalFeatures(scaleBatches);
+        if (extractor.isEnded()) {
+            break;
+        }
+        auto featEnd = std::chrono::system_clock::now();
+        printExtractionReport(
+                extractor,
+                std::chrono::duration_cast<std::chrono::milliseconds>(featEnd - featBegin).count());
+
+        std::vector<std::vector<FeaturePtr>> scaleFeatures;
+        scaleFeatures.reserve(scaleBatches.size());
+        for (const auto& batch : scaleBatches) {
+            scaleFeatures.push_back(convertFeatureFormats(batch));
+        }
+
+        std::vector<std::pair<std::size_t, std::size_t>> minMaxRanges;
+        votingProcess(scaleFeatures, minMaxRanges);
+        updateDetectionCuboids(minMaxRanges, detectionCuboids);
+
+        for (int classLabel = 0; classLabel < votingSpaces_.size(); ++classLabel) {
+            deleteOldVotes(classLabel, minMaxRanges.at(classLabel).second);
+            fixOldDetectionCuboids(detectionCuboids.at(classLabel),
+                                   fixedDetectionCuboids.at(classLabel),
+                                   extractor.getStoredFeatureBeginT());
+        }
+        if (voteCache_ != nullptr) {
+            voteCache_->endCycle(extractor.getStoredFeatureBeginT());
+        }
+    }
+
+    std::cout << "output process" << std::endl;
+    outputDetectionResults(detectionCuboids, fixedDetectionCuboids, detectionResults);
+}
+
+void HoughForests::printExtractionReport(const LocalFeatureExtractor& extractor,
+                                         long long elapsedTime) const {
+    std::cout << "extract features: " << elapsedTime << std::endl;
+    for (const auto& groupTime : extractor.getChannelGroupTimes()) {
+        std::cout << "  " << groupTime.first << ": " << groupTime.second << std::endl;
+    }
+    if (extractor.getMotionThreshold() > 0.0) {
+        std::cout << "skipped samples: " << extractor.getSkippedSampleRatio() << std::endl;
+    }
+}
+
+void HoughForests::detect(DescriptorCache& descriptorCache,
+                          std::vector<std::vector<DetectionResult>>& detectionResults) {
+    std::cout << "initialize" << std::endl;
+    initialize();
+
+    std::vector<std::vector<Cuboid>> fixedDetectionCuboids(
+            parameters_.getNumberOfPositiveClasses());
+    std::vector<std::vector<Cuboid>> detectionCuboids(parameters_.getNumberOfPositiveClasses());
+    std::size_t storedFeatureBeginT;
+    std::vector<DescriptorBatch> scaleBatches;
+    while (descriptorCache.readCycle(storedFeatureBeginT, scaleBatches)) {
+        std::cout << "t feature: " << storedFeatureBeginT << std::endl;
+
+        std::vector<std::vector<FeaturePtr>> scaleFeatures;
+        scaleFeatures.reserve(scaleBatches.size());
+        for (const auto& batch : scaleBatches) {
+            scaleFeatures.push_back(convertFeatureFormats(batch));
+        }
+
+        std::vector<std::pair<std::size_t, std::size_t>> minMaxRanges;
+        votingProcess(scaleFeatures, minMaxRanges);
+        updateDetectionCuboids(minMaxRanges, detectionCuboids);
+
+        for (int classLabel = 0; classLabel < votingSpaces_.size(); ++classLabel) {
+            deleteOldVotes(classLabel, minMaxRanges.at(classLabel).second);
+            fixOldDetectionCuboids(detectionCuboids.at(classLabel),
+                                   fixedDetectionCuboids.at(classLabel), storedFeatureBeginT);
+        }
+        if (voteCache_ != nullptr) {
+            voteCache_->endCycle(storedFeatureBeginT);
+        }
+    }
+
+    std::cout << "output process" << std::endl;
+    outputDetectionResults(detectionCuboids, fixedDetectionCuboids, detectionResults);
+}
+
+void HoughForests::sweep(
+        VoteCache& voteCache, const std::vector<HoughForestsParameters>& parameterSets,
+        std::vector<std::vector<std::vector<DetectionResult>>>& detectionResults) {
+    std::cout << "initialize" << std::endl;
+    initialize();
+
+    int nClasses = parameters_.getNumberOfPositiveClasses();
+    std::vector<std::vector<std::vector<Cuboid>>> fixedDetectionCuboids(
+            parameterSets.size(), std::vector<std::vector<Cuboid>>(nClasses));
+    std::vector<std::vector<std::vector<Cuboid>>> detectionCuboids(
+            parameterSets.size(), std::vector<std::vector<Cuboid>>(nClasses));
+    std::vector<std::vector<cv::Vec4f>> gridPoints(nClasses);
+    for (int classLabel = 0; classLabel < nClasses; ++classLabel) {
+        gridPoints.at(classLabel) = votingSpaces_.at(classLabel).getOriginalGridPoints();
+    }
+
+    std::size_t storedFeatureBeginT;
+    std::vector<std::vector<VoteInfo>> votesInfo(1);
+    while (voteCache.readCycle(storedFeatureBeginT, votesInfo.front())) {
+        std::cout << "t feature: " << storedFeatureBeginT << std::endl;
+
+        std::vector<std::pair<std::size_t, std::size_t>> minMaxRanges(nClasses);
+        for (auto& oneClassRange : minMaxRanges) {
+            int minT = std::numeric_limits<std::size_t>::max();
+            int maxT = 0;
+            oneClassRange = std::make_pair(minT, maxT);
+        }
+        inputInVotingSpace(votesInfo);
+        getMinMaxVotingT(votesInfo, minMaxRanges);
+
+        // 投票空間のスコアはパラメータの組み合わせによらないので1度だけ求める
+        using Task = std::function<void()>;
+        std::vector<std::vector<float>> votingScores(nClasses);
+        std::queue<Task> scoreTasks;
+        for (int classLabel = 0; classLabel < nClasses; ++classLabel) {
+            scoreTasks.push([this, classLabel, &votingScores, &minMaxRanges]() {
+                votingScores.at(classLabel) =
+                        getGridVotingScores(classLabel, minMaxRanges.at(classLabel));
+            });
+        }
+        thread::threadProcess(scoreTasks, nThreads_);
+
+        std::queue<Task> tasks;
+        for (int setIndex = 0; setIndex < parameterSets.size(); ++setIndex) {
+            for (int classLabel = 0; classLabel < nClasses; ++classLabel) {
+                tasks.push([this, setIndex, classLabel, &parameterSets, &gridPoints, &votingScores,
+                            &detectionCuboids]() {
+                    updateDetectionCuboids(parameterSets.at(setIndex), classLabel,
+                                           gridPoints.at(classLabel), votingScores.at(classLabel),
+                                           detectionCuboids.at(setIndex).at(classLabel));
+                });
+            }
+        }
+        thread::threadProcess(tasks, nThreads_);
+
+        for (int classLabel = 0; classLabel < nClasses; ++classLabel) {
+            deleteOldVotes(classLabel, minMaxRanges.at(classLabel).second);
+            for (int setIndex = 0; setIndex < parameterSets.size(); ++setIndex) {
+                fixOldDetectionCuboids(detectionCuboids.at(setIndex).at(classLabel),
+                                       fixedDetectionCuboids.at(setIndex).at(classLabel),
+                                       storedFeatureBeginT);
+            }
+        }
+    }
+
+    std::cout << "output process" << std::endl;
+    detectionResults.resize(parameterSets.size());
+    for (int setIndex = 0; setIndex < parameterSets.size(); ++setIndex) {
+        outputDetectionResults(detectionCuboids.at(setIndex), fixedDetectionCuboids.at(setIndex),
+                               detectionResults.at(setIndex));
+    }
+}
+
+void HoughForests::outputDetectionResults(
+        std::vector<std::vector<Cuboid>>& detectionCuboids,
+        std::vector<std::vector<Cuboid>>& fixedDetectionCuboids,
+        std::vector<std::vector<DetectionResult>>& detectionResults) const {
     detectionResults.resize(detectionCuboids.size());
     for (int classLabel = 0; classLabel < detectionResults.size(); ++classLabel) {
         std::copy(std::begin(detectionCuboids.at(classLabel)),
@@ -281,30 +472,34 @@ void HoughForests::initialize() {
                                    scales, steps, parameters_.getBinSizes(), parameters_.getSigma(),
                                    parameters_.getTau(), parameters_.getScaleBandwidth(),
                                    parameters_.getVotesDeleteStep(),
-                                   parameters_.getVotesBufferLength());
+                                   parameters_.getVotesBufferLength(), votingSpaceStorage_);
     }
 }
 
 std::vector<HoughForests::FeaturePtr> HoughForests::convertFeatureFormats(
-        const std::vector<cv::Vec3i>& points, const std::vector<std::vector<float>>& descriptors,
-        int nChannels) const {
-    std::vector<FeaturePtr> features;
-    features.reserve(points.size());
-    for (int i = 0; i < points.size(); ++i) {
-        cv::Vec3i point = points.at(i);
-        std::vector<Eigen::MatrixXf> channelFeatures(nChannels);
-        int nChannelFeatures = descriptors.at(i).size() / nChannels;
-        for (int channelIndex = 0; channelIndex < channelFeatures.size(); ++channelIndex) {
-            Eigen::MatrixXf feature(1, nChannelFeatures);
-            for (int featureIndex = 0; featureIndex < nChannelFeatures; ++featureIndex) {
-                int index = channelIndex * nChannelFeatures + featureIndex;
-                feature.coeffRef(0, featureIndex) = descriptors[i][index];
-            }
-            channelFeatures.at(channelIndex) = feature;
+        const DescriptorBatch& batch) const {
+    // 記述子はコピーせずにbatchを参照し，STIPFeatureも1つの配列にまとめて確保する
+    int nChannels = batch.getNumberOfChannels();
+    int nChannelFeatures = batch.getNumberOfDimensions() / nChannels;
+    auto channelOffsets = std::make_shared<std::vector<int>>(nChannels + 1);
+    for (int channelIndex = 0; channelIndex <= nChannels; ++channelIndex) {
+        channelOffsets->at(channelIndex) = channelIndex * nChannelFeatures;
+    }
+
+    auto featureStorage = std::make_shared<std::vector<randomforests::STIPNode::FeatureType>>();
+    featureStorage->reserve(batch.size());
+    for (int i = 0; i < batch.size(); ++i) {
+        featureStorage->emplace_back(batch.getSharedDescriptor(i), channelOffsets,
+                                     batch.getPoint(i), cv::Vec3i(), std::make_pair(0.0, 0.0), 0);
+        if (batch.getValueSource()) {
+            featureStorage->back().setValueSource(batch.getValueSource(), i);
         }
-        auto feature = std::make_shared<randomforests::STIPNode::FeatureType>(
-                channelFeatures, point, cv::Vec3i(), std::make_pair(0.0, 0.0), 0);
-        features.push_back(feature);
+    }
+
+    std::vector<FeaturePtr> features;
+    features.reserve(featureStorage->size());
+    for (auto& feature : *featureStorage) {
+        features.emplace_back(featureStorage, &feature);
     }
     return features;
 }
@@ -321,9 +516,15 @@ void HoughForests::votingProcess(const std::vector<std::vector<FeaturePtr>>& sca
         if (scaleFeatures.at(scaleIndex).empty()) {
             continue;
         }
+        if (voteCache_ == nullptr) {
+            matchAndVote(scaleFeatures.at(scaleIndex), scaleIndex, minMaxRanges);
+            continue;
+        }
+
         auto s1 = std::chrono::system_clock::now();
         std::vector<std::vector<VoteInfo>> votesInfo(scaleFeatures.at(scaleIndex).size());
         calculateVotes(scaleFeatures.at(scaleIndex), scaleIndex, votesInfo);
+        voteCache_->writeVotes(votesInfo);
         auto s2 = std::chrono::system_clock::now();
 
         inputInVotingSpace(votesInfo);
@@ -349,11 +550,12 @@ void HoughForests::calculateVotes(const std::vector<FeaturePtr>& features, int s
     thread::threadProcess(tasks, nThreads_);
 }
 
-void HoughForests::calculateVotes(const FeaturePtr& feature, int scaleIndex,
-                                  const std::vector<LeafPtr>& leavesData,
-                                  std::vector<VoteInfo>& votesInfo) const {
+template <class VoteFunction>
+void HoughForests::forEachVote(const FeaturePtr& feature, int scaleIndex,
+                               const std::vector<LeafPtr>& leavesData,
+                               VoteFunction voteFunction) const {
     for (const auto& leafData : leavesData) {
-        auto featuresInfo = leafData->getFeatureInfo();
+        const auto& featuresInfo = leafData->getFeatureInfo();
         if (featuresInfo.size() > parameters_.getInvalidLeafSizeThreshold()) {
             continue;
         }
@@ -364,13 +566,90 @@ void HoughForests::calculateVotes(const FeaturePtr& feature, int scaleIndex,
             if (classLabel != parameters_.getNegativeLabel()) {
                 cv::Vec3i votingPoint = calculateVotingPoint(
                         feature, parameters_.getScale(scaleIndex), featureInfo);
-                votesInfo.emplace_back(votingPoint, weight, classLabel, scaleIndex);
+                voteFunction(votingPoint, weight, classLabel);
             }
         }
     }
+}
+
+void HoughForests::calculateVotes(const FeaturePtr& feature, int scaleIndex,
+                                  const std::vector<LeafPtr>& leavesData,
+                                  std::vector<VoteInfo>& votesInfo) const {
+    forEachVote(feature, scaleIndex, leavesData,
+                [scaleIndex, &votesInfo](const cv::Vec3i& votingPoint, double weight,
+                                         int classLabel) {
+                    votesInfo.emplace_back(votingPoint, weight, classLabel, scaleIndex);
+                });
     // std::cout << "n_votes: " << votesInfo.size() << std::endl;
 }
 
+void HoughForests::matchAndVote(const std::vector<FeaturePtr>& features, int scaleIndex,
+                                std::vector<std::pair<std::size_t, std::size_t>>& minMaxRanges) {
+    if (nThreads_ <= 1 || votingSpaces_.empty()) {
+        std::vector<LeafPtr> leavesData;
+        for (const auto& feature : features) {
+            leavesData.clear();
+            randomForests_.match(feature, leavesData);
+            forEachVote(feature, scaleIndex, leavesData,
+                        [this, scaleIndex, &minMaxRanges](const cv::Vec3i& votingPoint,
+                                                          double weight, int classLabel) {
+                            updateMinMaxT(votingPoint(T), minMaxRanges.at(classLabel));
+                            votingSpaces_.at(classLabel)
+                                    .inputVote(votingPoint, scaleIndex, weight);
+                        });
+        }
+        return;
+    }
+
+    // 特徴を順に区切り，区切りごとに照合して投票先のビンを(クラス, t)ごとにまとめる
+    // 区切りは照合の負荷が偏っても分担できるようにスレッド数より多くする
+    int nTBins = votingSpaces_.front().getNumberOfTBins();
+    int nBuckets = votingSpaces_.size() * nTBins;
+    int nChunks = std::min<std::size_t>(nThreads_ * 4, features.size());
+    std::vector<BinnedVoteBuckets> chunkBuckets(nChunks, BinnedVoteBuckets(nBuckets));
+    std::vector<std::vector<std::pair<std::size_t, std::size_t>>> chunkMinMaxRanges(
+            nChunks, minMaxRanges);
+
+    using Task = std::function<void()>;
+    std::queue<Task> tasks;
+    for (int chunkIndex = 0; chunkIndex < nChunks; ++chunkIndex) {
+        tasks.push([this, chunkIndex, nChunks, nTBins, scaleIndex, &features, &chunkBuckets,
+                    &chunkMinMaxRanges]() {
+            std::size_t beginIndex = features.size() * chunkIndex / nChunks;
+            std::size_t endIndex = features.size() * (chunkIndex + 1) / nChunks;
+            auto& buckets = chunkBuckets.at(chunkIndex);
+            auto& ranges = chunkMinMaxRanges.at(chunkIndex);
+            std::vector<LeafPtr> leavesData;
+            for (std::size_t featureIndex = beginIndex; featureIndex < endIndex; ++featureIndex) {
+                leavesData.clear();
+                randomForests_.match(features.at(featureIndex), leavesData);
+                forEachVote(features.at(featureIndex), scaleIndex, leavesData,
+                            [this, nTBins, scaleIndex, &buckets, &ranges](
+                                    const cv::Vec3i& votingPoint, double weight, int classLabel) {
+                                updateMinMaxT(votingPoint(T), ranges.at(classLabel));
+                                cv::Vec4i binnedPoint;
+                                if (votingSpaces_.at(classLabel)
+                                            .binVote(votingPoint, scaleIndex, binnedPoint)) {
+                                    buckets.at(classLabel * nTBins + binnedPoint(T))
+                                            .push_back({binnedPoint, static_cast<float>(weight)});
+                                }
+                            });
+            }
+        });
+    }
+    thread::threadProcess(tasks, nThreads_);
+
+    for (const auto& ranges : chunkMinMaxRanges) {
+        for (int classLabel = 0; classLabel < minMaxRanges.size(); ++classLabel) {
+            minMaxRanges.at(classLabel).first =
+                    std::min(minMaxRanges.at(classLabel).first, ranges.at(classLabel).first);
+            minMaxRanges.at(classLabel).second =
+                    std::max(minMaxRanges.at(classLabel).second, ranges.at(classLabel).second);
+        }
+    }
+    inputBinnedVotes(chunkBuckets);
+}
+
 cv::Vec3i HoughForests::calculateVotingPoint(
         const FeaturePtr& feature, double scale,
         const randomforests::STIPLeaf::FeatureInfo& featureInfo) const {
@@ -382,13 +661,98 @@ cv::Vec3i HoughForests::calculateVotingPoint(
 }
 
 void HoughForests::inputInVotingSpace(const std::vector<std::vector<VoteInfo>>& votesInfo) {
-    for (const auto& oneFeatureVotesInfo : votesInfo) {
-        for (const auto& voteInfo : oneFeatureVotesInfo) {
-            votingSpaces_.at(voteInfo.getClassLabel())
-                    .inputVote(voteInfo.getVotingPoint(), voteInfo.getIndex(),
-                               voteInfo.getWeight());
+    std::vector<std::size_t> offsets(votesInfo.size() + 1, 0);
+    for (int i = 0; i < votesInfo.size(); ++i) {
+        offsets.at(i + 1) = offsets.at(i) + votesInfo.at(i).size();
+    }
+    std::size_t nVotes = offsets.back();
+    if (nThreads_ <= 1 || votingSpaces_.empty() || nVotes == 0) {
+        for (const auto& oneFeatureVotesInfo : votesInfo) {
+            for (const auto& voteInfo : oneFeatureVotesInfo) {
+                votingSpaces_.at(voteInfo.getClassLabel())
+                        .inputVote(voteInfo.getVotingPoint(), voteInfo.getIndex(),
+                                   voteInfo.getWeight());
+            }
         }
+        return;
+    }
+
+    // 投票を通し番号で等分し，区切りごとに(クラス, t)へ振り分ける
+    int nTBins = votingSpaces_.front().getNumberOfTBins();
+    int nBuckets = votingSpaces_.size() * nTBins;
+    int nChunks = std::min<std::size_t>(nThreads_, nVotes);
+    std::vector<BinnedVoteBuckets> chunkBuckets(nChunks, BinnedVoteBuckets(nBuckets));
+
+    using Task = std::function<void()>;
+    std::queue<Task> tasks;
+    for (int chunkIndex = 0; chunkIndex < nChunks; ++chunkIndex) {
+        tasks.push([this, chunkIndex, nChunks, nVotes, nTBins, &votesInfo, &offsets,
+                    &chunkBuckets]() {
+            std::size_t beginIndex = nVotes * chunkIndex / nChunks;
+            std::size_t endIndex = nVotes * (chunkIndex + 1) / nChunks;
+            int featureIndex =
+                    std::upper_bound(std::begin(offsets), std::end(offsets), beginIndex) -
+                    std::begin(offsets) - 1;
+            auto& buckets = chunkBuckets.at(chunkIndex);
+            for (std::size_t index = beginIndex; index < endIndex; ++index) {
+                while (index >= offsets.at(featureIndex + 1)) {
+                    ++featureIndex;
+                }
+                const auto& voteInfo =
+                        votesInfo.at(featureIndex).at(index - offsets.at(featureIndex));
+                int classLabel = voteInfo.getClassLabel();
+                cv::Vec4i binnedPoint;
+                if (votingSpaces_.at(classLabel)
+                            .binVote(voteInfo.getVotingPoint(), voteInfo.getIndex(),
+                                     binnedPoint)) {
+                    buckets.at(classLabel * nTBins + binnedPoint(T))
+                            .push_back({binnedPoint, static_cast<float>(voteInfo.getWeight())});
+                }
+            }
+        });
+    }
+    thread::threadProcess(tasks, nThreads_);
+
+    inputBinnedVotes(chunkBuckets);
+}
+
+void HoughForests::inputBinnedVotes(const std::vector<BinnedVoteBuckets>& chunkBuckets) {
+    if (chunkBuckets.empty()) {
+        return;
+    }
+
+    // 1つの(クラス, t)には1つのスレッドだけが加算する
+    int nTBins = votingSpaces_.front().getNumberOfTBins();
+    int nBuckets = chunkBuckets.front().size();
+    std::vector<std::pair<std::size_t, int>> bucketSizes;
+    for (int bucketIndex = 0; bucketIndex < nBuckets; ++bucketIndex) {
+        std::size_t bucketSize = 0;
+        for (const auto& buckets : chunkBuckets) {
+            bucketSize += buckets.at(bucketIndex).size();
+        }
+        if (bucketSize != 0) {
+            bucketSizes.emplace_back(bucketSize, bucketIndex);
+        }
+    }
+    // 投票の多い(クラス, t)から割り当てる
+    std::stable_sort(std::begin(bucketSizes), std::end(bucketSizes),
+                     [](const std::pair<std::size_t, int>& a,
+                        const std::pair<std::size_t, int>& b) { return a.first > b.first; });
+
+    using Task = std::function<void()>;
+    std::queue<Task> tasks;
+    for (const auto& bucketSize : bucketSizes) {
+        int bucketIndex = bucketSize.second;
+        tasks.push([this, bucketIndex, nTBins, &chunkBuckets]() {
+            auto& votingSpace = votingSpaces_.at(bucketIndex / nTBins);
+            for (const auto& buckets : chunkBuckets) {
+                for (const auto& vote : buckets.at(bucketIndex)) {
+                    votingSpace.addVote(vote.binnedPoint, vote.weight);
+                }
+            }
+        });
     }
+    thread::threadProcess(tasks, nThreads_);
 }
 
 void HoughForests::getMinMaxVotingT(
@@ -396,15 +760,8 @@ void HoughForests::getMinMaxVotingT(
         std::vector<std::pair<std::size_t, std::size_t>>& minMaxRanges) const {
     for (const auto& oneFeatureVotesInfo : votesInfo) {
         for (const auto& voteInfo : oneFeatureVotesInfo) {
-            int t = voteInfo.getVotingPoint()(T);
-            t = std::max(t, 0);
-            int classLabel = voteInfo.getClassLabel();
-            if (t < minMaxRanges.at(classLabel).first) {
-                minMaxRanges.at(classLabel).first = t;
-            }
-            if (t > minMaxRanges.at(classLabel).second) {
-                minMaxRanges.at(classLabel).second = t;
-            }
+            updateMinMaxT(voteInfo.getVotingPoint()(T),
+                          minMaxRanges.at(voteInfo.getClassLabel()));
         }
     }
 }
@@ -426,11 +783,25 @@ void HoughForests::updateDetectionCuboids(
 void HoughForests::updateDetectionCuboids(int classLabel,
                                           const std::pair<std::size_t, std::size_t>& minMaxRanges,
                                           std::vector<Cuboid>& detectionCuboids) const {
-    auto s1 = std::chrono::system_clock::now();
     auto gridPoints = votingSpaces_.at(classLabel).getOriginalGridPoints();
-    auto votingScores = votingSpaces_.at(classLabel).getGridVotingScores();
-    auto s2 = std::chrono::system_clock::now();
-    double threshold = parameters_.getScoreThreshold(classLabel);
+    auto votingScores = getGridVotingScores(classLabel, minMaxRanges);
+    updateDetectionCuboids(parameters_, classLabel, gridPoints, votingScores, detectionCuboids);
+}
+
+std::vector<float> HoughForests::getGridVotingScores(
+        int classLabel, const std::pair<std::size_t, std::size_t>& minMaxRange) const {
+    if (isVotingSpaceSmoothed_) {
+        return votingSpaces_.at(classLabel)
+                .getSmoothedGridVotingScores(minMaxRange.first, minMaxRange.second);
+    }
+    return votingSpaces_.at(classLabel).getGridVotingScores();
+}
+
+void HoughForests::updateDetectionCuboids(const HoughForestsParameters& parameters,
+                                          int classLabel, const std::vector<cv::Vec4f>& gridPoints,
+                                          const std::vector<float>& votingScores,
+                                          std::vector<Cuboid>& detectionCuboids) const {
+    double threshold = parameters.getScoreThreshold(classLabel);
     LocalMaxima overThresholdPoints;
     for (int pointIndex = 0; pointIndex < gridPoints.size(); ++pointIndex) {
         if (votingScores.at(pointIndex) > threshold) {
@@ -438,26 +809,16 @@ void HoughForests::updateDetectionCuboids(int classLabel,
                     LocalMaximum(gridPoints.at(pointIndex), votingScores.at(pointIndex)));
         }
     }
-    auto s3 = std::chrono::system_clock::now();
     std::vector<Cuboid> cuboids =
-            calculateCuboids(overThresholdPoints, parameters_.getAverageAspectRatio(classLabel),
-                             parameters_.getAverageDuration(classLabel));
+            calculateCuboids(overThresholdPoints, parameters.getAverageAspectRatio(classLabel),
+                             parameters.getAverageDuration(classLabel));
     std::copy(std::begin(cuboids), std::end(cuboids), std::back_inserter(detectionCuboids));
     std::sort(std::begin(detectionCuboids), std::end(detectionCuboids),
               [](const Cuboid& a, const Cuboid& b) {
                   return a.getLocalMaximum().getValue() < b.getLocalMaximum().getValue();
               });
-    auto s4 = std::chrono::system_clock::now();
-    detectionCuboids = performNonMaximumSuppression(detectionCuboids);
-    auto s5 = std::chrono::system_clock::now();
-    // std::cout << "get grids: " << std::chrono::duration_cast<std::chrono::milliseconds>(s2 -
-    // s1).count() << std::endl;
-    // std::cout << "thresholding: " << std::chrono::duration_cast<std::chrono::milliseconds>(s3
-    // - s2).count() << std::endl;
-    // std::cout << "calc cuboids: " << std::chrono::duration_cast<std::chrono::milliseconds>(s4
-    // - s3).count() << std::endl;
-    // std::cout << "nms: " << std::chrono::duration_cast<std::chrono::milliseconds>(s5 -
-    // s4).count() << std::endl;
+    detectionCuboids =
+            performNonMaximumSuppression(detectionCuboids, parameters.getIoUThreshold());
 }
 
 void HoughForests::fixOldDetectionCuboids(std::vector<Cuboid>& detectionCuboids,
@@ -492,10 +853,9 @@ std::vector<HoughForests::Cuboid> HoughForests::calculateCuboids(const LocalMaxi
 }
 
 std::vector<HoughForests::Cuboid> HoughForests::performNonMaximumSuppression(
-        const std::vector<Cuboid>& cuboids) const {
+        const std::vector<Cuboid>& cuboids, double threshold) const {
     std::vector<int> indices(cuboids.size());
     std::iota(std::begin(indices), std::end(indices), 0);
-    double threshold = parameters_.getIoUThreshold();
     std::vector<Cuboid> afterCuboids;
     while (!indices.empty()) {
         int index = indices.back();
@@ -700,15 +1060,37 @@ void HoughForests::visualize(const std::vector<std::vector<float>>& votingSpaces
     }
 }
 
-void HoughForests::save(const std::string& directoryPath) const {
-    randomForests_.save(directoryPath);
+void HoughForests::save(const std::string& directoryPath, TreeFileFormat format) const {
+    randomForests_.save(directoryPath, format);
 }
 
-void HoughForests::load(const std::string& directoryPath) {
+void HoughForests::load(const std::string& directoryPath, bool isLazyLoading) {
     stipNode_.setNumberOfClasses(parameters_.getNumberOfClasses());
     randomForests_.initForests();
     randomForests_.setType(stipNode_);
-    randomForests_.load(directoryPath);
+    randomForests_.load(directoryPath, nThreads_, isLazyLoading);
+}
+
+std::vector<std::vector<int>> HoughForests::getUsedFeatureIndices() const {
+    std::vector<randomforests::STIPSplitParameters> splitParameters;
+    for (int treeIndex = 0; treeIndex < randomForests_.getNumberOfTrees(); ++treeIndex) {
+        randomForests_.getTree(treeIndex).collectSplitParameters(splitParameters);
+    }
+
+    std::vector<std::vector<int>> usedFeatureIndices;
+    for (const auto& splitParameter : splitParameters) {
+        int featureChannel = splitParameter.getFeatureChannel();
+        if (featureChannel >= usedFeatureIndices.size()) {
+            usedFeatureIndices.resize(featureChannel + 1);
+        }
+        usedFeatureIndices.at(featureChannel).push_back(splitParameter.getIndex1());
+        usedFeatureIndices.at(featureChannel).push_back(splitParameter.getIndex2());
+    }
+    for (auto& indices : usedFeatureIndices) {
+        std::sort(std::begin(indices), std::end(indices));
+        indices.erase(std::unique(std::begin(indices), std::end(indices)), std::end(indices));
+    }
+    return usedFeatureIndices;
 }
 }
 }
\ No newline at end of file
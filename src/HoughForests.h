@@ -1,6 +1,8 @@
 #ifndef HOUGH_FORESTS
 #define HOUGH_FORESTS
 
+#include "DescriptorBatch.h"
+#include "DescriptorCache.h"
 #include "HoughForestsParameters.h"
 #include "LocalFeatureExtractor.h"
 #include "RandomForests.hpp"
@@ -8,6 +10,7 @@
 #include "Storage.h"
 #include "TreeParameters.h"
 #include "Utils.h"
+#include "VoteCache.h"
 #include "VotingSpace.h"
 
 #include <opencv2/core/core.hpp>
@@ -18,6 +21,7 @@
 #include <map>
 #include <memory>
 #include <tuple>
+#include <unordered_map>
 #include <utility>
 
 namespace nuisken {
@@ -33,12 +37,30 @@ class HoughForests {
     using DetectionResult = storage::DetectionResult<4>;
     using Cuboid = storage::SpaceTimeCuboid;
 
+    /**
+     * 投票空間の範囲内に入った投票（ビンと重み）
+     */
+    struct BinnedVote {
+        cv::Vec4i binnedPoint;
+        float weight;
+    };
+    /**
+     * クラス x tのビンごとの投票
+     */
+    using BinnedVoteBuckets = std::vector<std::vector<BinnedVote>>;
+
+   public:
+    using TreeFileFormat = randomforests::RandomForests<randomforests::STIPNode>::TreeFileFormat;
+
+   private:
     const int S = 3;
 
    private:
     randomforests::RandomForests<randomforests::STIPNode> randomForests_;
 
     std::vector<VotingSpace> votingSpaces_;
+    VotingSpace::Storage votingSpaceStorage_;
+    bool isVotingSpaceSmoothed_;
 
     HoughForestsParameters parameters_;
 
@@ -46,6 +68,8 @@ class HoughForests {
 
     int nThreads_;
 
+    VoteCache* voteCache_;
+
     std::mutex videoLock_;
     std::mutex detectionLock_;
 
@@ -53,13 +77,20 @@ class HoughForests {
     randomforests::STIPNode stipNode_;
 
    public:
-    HoughForests(int nThreads = 1) : nThreads_(nThreads){};
+    HoughForests(int nThreads = 1)
+            : votingSpaceStorage_(VotingSpace::Storage::DENSE),
+              isVotingSpaceSmoothed_(false),
+              nThreads_(nThreads),
+              voteCache_(nullptr){};
     HoughForests(const randomforests::STIPNode& stipNode, const HoughForestsParameters& parameters,
                  int nThreads = 1)
             : stipNode_(stipNode),
               randomForests_(stipNode, parameters.getTreeParameters()),
+              votingSpaceStorage_(VotingSpace::Storage::DENSE),
+              isVotingSpaceSmoothed_(false),
               parameters_(parameters),
-              nThreads_(nThreads){};
+              nThreads_(nThreads),
+              voteCache_(nullptr){};
     virtual ~HoughForests(){};
 
     void HoughForests::train(const std::vector<FeaturePtr>& features);
@@ -68,8 +99,42 @@ class HoughForests {
                 std::vector<std::vector<DetectionResult>>& detectionResults,
                 bool isVisualizationEnabled = false, const cv::Size& visualizationSize = cv::Size(),
                 const std::vector<cv::Vec3i>& visualizationColors = std::vector<cv::Vec3i>());
+
+    /**
+     * extractorが自分で読み込む動画（openVideoで開いたもの）から検出する
+     * 表示やfpsに合わせた待機をしないので，生フレームファイルなら復号を待たずに処理できる
+     */
+    void detect(LocalFeatureExtractor& extractor,
+                std::vector<std::vector<DetectionResult>>& detectionResults);
     void detect(const std::vector<std::string>& featureFilePaths,
                 std::vector<std::vector<DetectionResult>>& detectionResults);
+    void detect(DescriptorCache& descriptorCache,
+                std::vector<std::vector<DetectionResult>>& detectionResults);
+
+    /**
+     * 記録した投票を再生し，後処理のパラメータ（スコアの閾値，IoUの閾値，平均の長さとアスペクト比）
+     * の組み合わせごとに検出結果を求める
+     * 投票空間の設定は現在のパラメータを使う
+     */
+    void sweep(VoteCache& voteCache, const std::vector<HoughForestsParameters>& parameterSets,
+               std::vector<std::vector<std::vector<DetectionResult>>>& detectionResults);
+
+    /**
+     * 検出中の投票をvoteCacheに記録する（nullptrで記録しない）
+     */
+    void setVoteCache(VoteCache* voteCache) { voteCache_ = voteCache; }
+
+    /**
+     * 投票空間の持ち方（大きなフレームや長いバッファではSPARSEの方が省メモリ）
+     * 次の検出から使われる
+     */
+    void setVotingSpaceStorage(VotingSpace::Storage storage) { votingSpaceStorage_ = storage; }
+
+    /**
+     * 検出に投票数そのものではなく平滑化した密度（sigma, tau, scaleBandwidth）を使う
+     * スコアの大きさが変わるので，スコアの閾値も合わせて設定する
+     */
+    void setVotingSpaceSmoothingEnabled(bool isSmoothed) { isVotingSpaceSmoothed_ = isSmoothed; }
 
     HoughForestsParameters getHoughForestsParameters() const { return parameters_; }
 
@@ -85,14 +150,18 @@ class HoughForests {
         parameters_ = parameters;
     }
 
-    void save(const std::string& directoryPath) const;
-    void load(const std::string& directoryPath);
+    void save(const std::string& directoryPath, TreeFileFormat format = TreeFileFormat::CSV) const;
+    void load(const std::string& directoryPath, bool isLazyLoading = false);
+
+    /**
+     * 読み込んだ森の分岐で参照される特徴の次元（チャネルごと，昇順）
+     * LocalFeatureExtractor::setUsedFeatureIndicesに渡せば参照されない次元の計算を省ける
+     */
+    std::vector<std::vector<int>> getUsedFeatureIndices() const;
 
    private:
     void initialize();
-    std::vector<FeaturePtr> convertFeatureFormats(
-            const std::vector<cv::Vec3i>& points,
-            const std::vector<std::vector<float>>& descriptors, int nChannels) const;
+    std::vector<FeaturePtr> convertFeatureFormats(const DescriptorBatch& batch) const;
     void votingProcess(const std::vector<std::vector<FeaturePtr>>& scaleFeatures,
                        std::vector<std::pair<std::size_t, std::size_t>>& minMaxRanges);
     void calculateVotes(const std::vector<FeaturePtr>& features, int scaleIndex,
@@ -100,9 +169,31 @@ class HoughForests {
     void calculateVotes(const FeaturePtr& feature, int scaleIndex,
                         const std::vector<LeafPtr>& leavesData,
                         std::vector<VoteInfo>& votesInfo) const;
+    template <class VoteFunction>
+    void forEachVote(const FeaturePtr& feature, int scaleIndex,
+                     const std::vector<LeafPtr>& leavesData, VoteFunction voteFunction) const;
+
+    /**
+     * 照合した葉から投票空間に直接投票する（VoteInfoを作らない）
+     * クラスごとの投票先のtの範囲もminMaxRangesに反映する
+     */
+    void matchAndVote(const std::vector<FeaturePtr>& features, int scaleIndex,
+                      std::vector<std::pair<std::size_t, std::size_t>>& minMaxRanges);
     cv::Vec3i calculateVotingPoint(const FeaturePtr& feature, double scale,
                                    const randomforests::STIPLeaf::FeatureInfo& featureInfo) const;
     void inputInVotingSpace(const std::vector<std::vector<VoteInfo>>& votesInfo);
+
+    /**
+     * 1回の抽出の計算時間（ミリ秒），チャネルの組ごとの内訳，動きで省いたサンプルの割合を表示する
+     */
+    void printExtractionReport(const LocalFeatureExtractor& extractor,
+                               long long elapsedTime) const;
+
+    /**
+     * 区切りごとにまとめた投票を(クラス, t)ごとに並列に加算する
+     * 各ビンへの加算は区切りの順に行うので，逐次に入れた場合と結果が一致する
+     */
+    void inputBinnedVotes(const std::vector<BinnedVoteBuckets>& chunkBuckets);
     void getMinMaxVotingT(const std::vector<std::vector<VoteInfo>>& votesInfo,
                           std::vector<std::pair<std::size_t, std::size_t>>& minMaxRanges) const;
     void updateDetectionCuboids(
@@ -111,12 +202,26 @@ class HoughForests {
     void updateDetectionCuboids(int classLabel,
                                 const std::pair<std::size_t, std::size_t>& minMaxRanges,
                                 std::vector<Cuboid>& detectionCuboids) const;
+
+    /**
+     * 格子点でのスコア（平滑化する場合はminMaxRangeに投票した後のもの）
+     */
+    std::vector<float> getGridVotingScores(
+            int classLabel, const std::pair<std::size_t, std::size_t>& minMaxRange) const;
+    void updateDetectionCuboids(const HoughForestsParameters& parameters, int classLabel,
+                                const std::vector<cv::Vec4f>& gridPoints,
+                                const std::vector<float>& votingScores,
+                                std::vector<Cuboid>& detectionCuboids) const;
     void fixOldDetectionCuboids(std::vector<Cuboid>& detectionCuboids,
                                 std::vector<Cuboid>& fixedDetectionCuboids,
                                 std::size_t videoBeginT) const;
+    void outputDetectionResults(std::vector<std::vector<Cuboid>>& detectionCuboids,
+                                std::vector<std::vector<Cuboid>>& fixedDetectionCuboids,
+                                std::vector<std::vector<DetectionResult>>& detectionResults) const;
     std::vector<Cuboid> calculateCuboids(const LocalMaxima& localMaxima, double averageAspectRatio,
                                          int averageDuration) const;
-    std::vector<Cuboid> performNonMaximumSuppression(const std::vector<Cuboid>& cuboids) const;
+    std::vector<Cuboid> performNonMaximumSuppression(const std::vector<Cuboid>& cuboids,
+                                                     double threshold) const;
     void deleteOldVotes(int classLabel, std::size_t voteMaxT);
     std::vector<float> getVotingSpace(int classLabel) const;
     bool waitReading(const std::deque<cv::Mat3b>& video, const bool& isEnded, int nFrames);
@@ -1,18 +1,148 @@
 #include "LocalFeatureExtractor.h"
+#include "BinaryCoding.h"
+#include "STIPFeature.h"
 #include "ThreadProcess.h"
 
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
-#include <opencv2/superres/optical_flow.hpp>
 
+#include <algorithm>
 #include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <iomanip>
 #include <iostream>
+#include <limits>
 #include <numeric>
+#include <queue>
+#include <sstream>
+#include <stdexcept>
+#include <tuple>
 
 namespace nuisken {
 namespace houghforests {
 
+namespace {
+
+int reflect101(int index, int size) {
+    if (size == 1) {
+        return 0;
+    }
+    if (index < 0) {
+        return -index;
+    }
+    if (index >= size) {
+        return 2 * size - 2 - index;
+    }
+    return index;
+}
+
+/**
+ * 1行分の横方向の差分[-1 0 1]と平滑化[1 2 1]（境界はBORDER_REFLECT_101）
+ */
+void filterRow(const uchar* row, int width, int* xDiff, int* xSmooth) {
+    if (width == 1) {
+        xDiff[0] = 0;
+        xSmooth[0] = 4 * row[0];
+        return;
+    }
+
+    xDiff[0] = 0;
+    xSmooth[0] = 2 * row[0] + 2 * row[1];
+    for (int x = 1; x < width - 1; ++x) {
+        xDiff[x] = row[x + 1] - row[x - 1];
+        xSmooth[x] = row[x - 1] + 2 * row[x] + row[x + 1];
+    }
+    xDiff[width - 1] = 0;
+    xSmooth[width - 1] = 2 * row[width - 2] + 2 * row[width - 1];
+}
+
+/**
+ * 積分画像の差を符号付きの値に戻す
+ * uint32の面は桁あふれを許して累積しているので，差がint32に収まれば正確な値になる
+ */
+double toSum(std::uint32_t difference) { return static_cast<std::int32_t>(difference); }
+double toSum(double difference) { return difference; }
+
+template <typename T>
+double sumCuboid(const cv::Mat& beginPlane, const cv::Mat& endPlane, int yBegin, int yEnd,
+                 int xBegin, int xEnd) {
+    const T* beginUpperRow = beginPlane.ptr<T>(yBegin);
+    const T* beginLowerRow = beginPlane.ptr<T>(yEnd);
+    const T* endUpperRow = endPlane.ptr<T>(yBegin);
+    const T* endLowerRow = endPlane.ptr<T>(yEnd);
+    T sum = (endLowerRow[xEnd] - endUpperRow[xEnd] - endLowerRow[xBegin] + endUpperRow[xBegin]) -
+            (beginLowerRow[xEnd] - beginUpperRow[xEnd] - beginLowerRow[xBegin] +
+             beginUpperRow[xBegin]);
+    return toSum(sum);
+}
+
+/**
+ * 時空間の積分画像の2枚の面から直方体の和を求める（CV_32SかCV_64Fの面）
+ */
+double sumCuboid(const cv::Mat& beginPlane, const cv::Mat& endPlane, int yBegin, int yEnd,
+                 int xBegin, int xEnd) {
+    if (beginPlane.type() == CV_32S) {
+        return sumCuboid<std::uint32_t>(beginPlane, endPlane, yBegin, yEnd, xBegin, xEnd);
+    }
+    return sumCuboid<double>(beginPlane, endPlane, yBegin, yEnd, xBegin, xEnd);
+}
+
+/**
+ * yBegin行目からyEnd行目までの直方体の和をx方向にnXOrigins個求め，nElementsで割る
+ * 整数の面では差を整数のまま求め，最後にだけ実数にする
+ */
+template <typename T>
+void averageCuboidRow(const cv::Mat& beginPlane, const cv::Mat& endPlane, int yBegin, int yEnd,
+                      int xSize, int nXOrigins, double nElements, float* averages) {
+    const T* beginUpperRow = beginPlane.ptr<T>(yBegin);
+    const T* beginLowerRow = beginPlane.ptr<T>(yEnd);
+    const T* endUpperRow = endPlane.ptr<T>(yBegin);
+    const T* endLowerRow = endPlane.ptr<T>(yEnd);
+    for (int xBegin = 0; xBegin < nXOrigins; ++xBegin) {
+        int xEnd = xBegin + xSize;
+        T sum = (endLowerRow[xEnd] - endUpperRow[xEnd] - endLowerRow[xBegin] +
+                 endUpperRow[xBegin]) -
+                (beginLowerRow[xEnd] - beginUpperRow[xEnd] - beginLowerRow[xBegin] +
+                 beginUpperRow[xBegin]);
+        averages[xBegin] = toSum(sum) / nElements;
+    }
+}
+
+void averageCuboidRow(const cv::Mat& beginPlane, const cv::Mat& endPlane, int yBegin, int yEnd,
+                      int xSize, int nXOrigins, double nElements, float* averages) {
+    if (beginPlane.type() == CV_32S) {
+        averageCuboidRow<std::uint32_t>(beginPlane, endPlane, yBegin, yEnd, xSize, nXOrigins,
+                                        nElements, averages);
+    } else {
+        averageCuboidRow<double>(beginPlane, endPlane, yBegin, yEnd, xSize, nXOrigins,
+                                 nElements, averages);
+    }
+}
+}
+
 const int LocalFeatureExtractor::N_CHANNELS_ = 4;
+const int LocalFeatureExtractor::N_FLOW_CHANNELS_ = 2;
+
+class LocalFeatureExtractor::LazyDescriptorSource : public storage::FeatureValueSource {
+   private:
+    const LocalFeatureExtractor& extractor_;
+    int scaleIndex_;
+    int nXPoints_;
+
+   public:
+    LazyDescriptorSource(const LocalFeatureExtractor& extractor, int scaleIndex, int nXPoints)
+            : extractor_(extractor), scaleIndex_(scaleIndex), nXPoints_(nXPoints){};
+
+    float computeFeatureValue(int sourceIndex, int featureChannel, int index) const {
+        int gridIndex = extractor_.scaleSampleIndices_[scaleIndex_][sourceIndex];
+        int y = (gridIndex / nXPoints_) * extractor_.yStep_;
+        int x = (gridIndex % nXPoints_) * extractor_.xStep_;
+        return extractor_.computePooledElement(scaleIndex_, featureChannel, index, y, x);
+    }
+};
 
 void LocalFeatureExtractor::makeLocalSizeOdd(int& size) const {
     if ((size % 2) == 0) {
@@ -20,338 +150,793 @@ void LocalFeatureExtractor::makeLocalSizeOdd(int& size) const {
     }
 }
 
-void LocalFeatureExtractor::extractLocalFeatures(
-        std::vector<std::vector<cv::Vec3i>>& scalePoints,
-        std::vector<std::vector<Descriptor>>& scaleDescriptors) {
+void LocalFeatureExtractor::allocateBuffers() {
+    // costは輝度と微分の4チャネルを1とした1画素あたりの計算量の目安
+    channelGroups_.clear();
+    registerChannelGroup("gradient", N_CHANNELS_, CV_32S, 1.0,
+                         &LocalFeatureExtractor::computeGradientChannels);
+    if (isFlowEnabled_) {
+        registerChannelGroup("flow", N_FLOW_CHANNELS_, CV_64F, 20.0 * flowScale_ * flowScale_,
+                             &LocalFeatureExtractor::computeFlowChannels);
+    }
+
+    // 保持するのは最大で前フレーム1枚＋localDuration_かtStep_フレーム
+    int capacity = std::max(localDuration_, tStep_) + 1;
+    scaleVideos_.assign(scales_.size(), Video(capacity));
+    scaleChannelVolumes_.assign(
+            scales_.size(), MultiChannelVolume(getNumberOfChannels(), IntegralVolume(capacity)));
+    scaleMotionVolumes_.assign(scales_.size(), IntegralVolume(capacity));
+    scaleChannelBuffers_.resize(scales_.size());
+    scaleFlowBuffers_.assign(scales_.size(), FlowBuffers());
+    scaleChannelGroupTimes_.assign(scales_.size(), std::vector<double>(channelGroups_.size()));
+    scaleBlockYOrigins_.resize(scales_.size());
+    scaleBlockSumMaps_.resize(scales_.size());
+    scaleSampleIndices_.resize(scales_.size());
+    setUsedFeatureIndices(std::vector<std::vector<int>>());
+}
+
+void LocalFeatureExtractor::registerChannelGroup(const std::string& name, int nChannels,
+                                                 int volumeType, double cost,
+                                                 ChannelFunction compute) {
+    int firstChannel = getNumberOfChannels();
+    channelGroups_.push_back({name, firstChannel, nChannels, volumeType, cost, compute});
+}
+
+int LocalFeatureExtractor::getNumberOfChannels() const {
+    if (channelGroups_.empty()) {
+        return 0;
+    }
+    return channelGroups_.back().firstChannel + channelGroups_.back().nChannels;
+}
+
+void LocalFeatureExtractor::setFlowEnabled(bool isFlowEnabled, double flowScale) {
+    if (flowScale <= 0.0 || flowScale > 1.0) {
+        throw std::invalid_argument("flow scale must be in (0, 1]");
+    }
+    isFlowEnabled_ = isFlowEnabled;
+    flowScale_ = flowScale;
+    allocateBuffers();
+}
+
+std::vector<std::pair<std::string, double>> LocalFeatureExtractor::getChannelGroupTimes() const {
+    std::vector<std::pair<std::string, double>> groupTimes;
+    for (int groupIndex = 0; groupIndex < channelGroups_.size(); ++groupIndex) {
+        double time = 0.0;
+        for (const auto& channelGroupTimes : scaleChannelGroupTimes_) {
+            time += channelGroupTimes[groupIndex];
+        }
+        groupTimes.emplace_back(channelGroups_[groupIndex].name, time);
+    }
+    return groupTimes;
+}
+
+void LocalFeatureExtractor::setUsedFeatureIndices(
+        const std::vector<std::vector<int>>& usedFeatureIndices) {
+    int nXBlocks = localWidth_ / xBlockSize_;
+    int nYBlocks = localHeight_ / yBlockSize_;
+    int nTBlocks = localDuration_ / tBlockSize_;
+    int nPooledElements = nXBlocks * nYBlocks * nTBlocks;
+
+    int nChannels = getNumberOfChannels();
+    usedFeatureIndices_ = usedFeatureIndices;
+    std::vector<bool> isUsed(nChannels * nPooledElements, usedFeatureIndices.empty());
+    for (int channelIndex = 0; channelIndex < usedFeatureIndices.size(); ++channelIndex) {
+        for (int elementIndex : usedFeatureIndices[channelIndex]) {
+            if (channelIndex >= nChannels || elementIndex < 0 ||
+                elementIndex >= nPooledElements) {
+                throw std::invalid_argument("feature index out of range");
+            }
+            isUsed[channelIndex * nPooledElements + elementIndex] = true;
+        }
+    }
+
+    usedChannels_.assign(nChannels, false);
+    usedBlockSumMaps_.assign(nChannels * nTBlocks, false);
+    usedPooledElements_.clear();
+    for (int descriptorIndex = 0; descriptorIndex < isUsed.size(); ++descriptorIndex) {
+        if (!isUsed[descriptorIndex]) {
+            continue;
+        }
+        int channelIndex = descriptorIndex / nPooledElements;
+        int elementIndex = descriptorIndex % nPooledElements;
+        int tBlockIndex = elementIndex / (nXBlocks * nYBlocks);
+        int yBlockIndex = (elementIndex / nXBlocks) % nYBlocks;
+        int xBlockIndex = elementIndex % nXBlocks;
+        int blockSumMapIndex = channelIndex * nTBlocks + tBlockIndex;
+        usedChannels_[channelIndex] = true;
+        usedBlockSumMaps_[blockSumMapIndex] = true;
+        usedPooledElements_.push_back({descriptorIndex, blockSumMapIndex,
+                                       yBlockSize_ * yBlockIndex, xBlockSize_ * xBlockIndex});
+    }
+}
+
+void LocalFeatureExtractor::extractLocalFeatures(std::vector<DescriptorBatch>& scaleBatches) {
+    if (isDeletionPending_) {
+        deleteOldData();
+        isDeletionPending_ = false;
+    }
     readOriginalScaleVideo();
-    extraction(scalePoints, scaleDescriptors);
+    extraction(scaleBatches);
+    if (descriptorCache_ != nullptr) {
+        descriptorCache_->writeCycle(storedFeatureBeginT_, scaleBatches);
+    }
 }
 
-void LocalFeatureExtractor::extractLocalFeatures(
-        const ColorVideo& video, std::vector<std::vector<cv::Vec3i>>& scalePoints,
-        std::vector<std::vector<Descriptor>>& scaleDescriptors) {
+void LocalFeatureExtractor::extractLocalFeatures(const ColorVideo& video,
+                                                 std::vector<DescriptorBatch>& scaleBatches) {
+    if (isDeletionPending_) {
+        deleteOldData();
+        isDeletionPending_ = false;
+    }
     inputNewScaleVideo(video);
-    extraction(scalePoints, scaleDescriptors);
+    extraction(scaleBatches);
+    if (descriptorCache_ != nullptr) {
+        descriptorCache_->writeCycle(storedFeatureBeginT_, scaleBatches);
+    }
 }
 
-void LocalFeatureExtractor::readOriginalScaleVideo() {
-    int nFrames = tStep_;
-    if (scaleVideos_.front().empty()) {
-        cv::Mat firstFrame;
-        videoCapture_ >> firstFrame;
-        cv::cvtColor(firstFrame, firstFrame, cv::COLOR_BGR2GRAY);
-        scaleVideos_.front().push_back(
-                firstFrame);  // add dummy frame for t_derivative and optical flow
-        scaleVideos_.front().push_back(firstFrame);
+std::string LocalFeatureExtractor::getParameterKey() const {
+    std::ostringstream key;
+    key << "v3," << getNumberOfChannels() << "," << localWidth_ << "," << localHeight_ << ","
+        << localDuration_ << "," << xBlockSize_ << "," << yBlockSize_ << "," << tBlockSize_ << ","
+        << xStep_ << "," << yStep_ << "," << tStep_;
+    if (isPyramidEnabled_) {
+        key << ",pyramid";
+    }
+    key << std::setprecision(17);
+    for (double scale : scales_) {
+        key << "," << scale;
+    }
+    if (isFlowEnabled_) {
+        key << ",flow" << flowScale_;
+    }
+    if (motionThreshold_ > 0.0) {
+        key << ",motion" << motionThreshold_;
+    }
+    return key.str();
+}
 
-        nFrames = localDuration_ - 1;
+std::string LocalFeatureExtractor::getDescriptorKey() const {
+    if (usedFeatureIndices_.empty()) {
+        return getParameterKey();
+    }
 
-        width_ = firstFrame.cols;
-        height_ = firstFrame.rows;
+    // 計算しない要素は0になるので，どの要素を計算したかもキーに含める
+    std::vector<std::int32_t> descriptorIndices;
+    for (const auto& element : usedPooledElements_) {
+        descriptorIndices.push_back(element.descriptorIndex);
     }
+    std::uint64_t hash =
+            coding::hashFNV1a(reinterpret_cast<const char*>(descriptorIndices.data()),
+                              descriptorIndices.size() * sizeof(std::int32_t));
+    std::ostringstream key;
+    key << getParameterKey() << ",used" << usedPooledElements_.size() << ":" << std::hex << hash;
+    return key.str();
+}
 
-    for (int i = 0; i < nFrames; ++i) {
-        cv::Mat frame;
-        videoCapture_ >> frame;
-        if (frame.empty()) {
-            isEnded_ = true;
-            break;
+void LocalFeatureExtractor::openVideo(const std::string& videoFilePath) {
+    frameReader_.reset();
+    rawFrameFile_.reset();
+    nextFrameIndex_ = 0;
+    if (io::RawFrameFile::isRawFrameFile(videoFilePath)) {
+        auto rawFrameFile = std::make_shared<io::RawFrameFile>();
+        if (!rawFrameFile->open(videoFilePath)) {
+            throw std::runtime_error("invalid raw frame file: " + videoFilePath);
         }
-        cv::cvtColor(frame, frame, cv::COLOR_BGR2GRAY);
-        scaleVideos_.front().push_back(frame);
+        rawFrameFile_ = rawFrameFile;
+    } else {
+        frameReader_ = std::make_shared<io::AsyncFrameReader>(videoFilePath);
     }
 }
 
-void LocalFeatureExtractor::inputNewScaleVideo(const ColorVideo& video) {
-    for (const auto& frame : video) {
-        cv::Mat grayFrame;
-        cv::cvtColor(frame, grayFrame, cv::COLOR_BGR2GRAY);
-        scaleVideos_.front().push_back(grayFrame);
+bool LocalFeatureExtractor::readFrame(cv::Mat1b& frame) {
+    if (rawFrameFile_) {
+        if (nextFrameIndex_ >= rawFrameFile_->getNumberOfFrames()) {
+            return false;
+        }
+        // ファイルを直接参照する（フレームには書き込まない）
+        frame = rawFrameFile_->getFrame(nextFrameIndex_++);
+        return true;
     }
+    return frameReader_->read(frame);
 }
 
-void LocalFeatureExtractor::extraction(std::vector<std::vector<cv::Vec3i>>& scalePoints,
-                                       std::vector<std::vector<Descriptor>>& scaleDescriptors) {
-    generateScaledVideos();
-    for (int scaleIndex = 0; scaleIndex < scales_.size(); ++scaleIndex) {
-        int beginFrame = 1;
-        int endFrame = scaleVideos_[scaleIndex].size();
-        extractFeatures(scaleIndex, beginFrame, endFrame);
-        if (scaleIndex == 0) {
-            nStoredFeatureFrames_ += endFrame - beginFrame;
-        }
-        if (nStoredFeatureFrames_ < localDuration_) {
+void LocalFeatureExtractor::readOriginalScaleVideo() {
+    auto& video = scaleVideos_.front();
+    int nFrames = tStep_;
+    if (video.empty()) {
+        if (!readFrame(video.pushBack())) {
+            video.clear();
             isEnded_ = true;
             return;
         }
+        // add dummy frame for t_derivative and optical flow
+        cv::Mat1b& dummyFrame = video.pushBack();
+        if (rawFrameFile_) {
+            dummyFrame = video[0];
+        } else {
+            video[0].copyTo(dummyFrame);
+        }
+
+        nFrames = localDuration_ - 1;
 
-        std::vector<cv::Vec3i> points;
-        std::vector<std::vector<float>> descriptors;
-        denseSampling(scaleIndex, points, descriptors);
-        scalePoints.push_back(points);
-        scaleDescriptors.push_back(descriptors);
+        width_ = video.back().cols;
+        height_ = video.back().rows;
     }
 
-    deleteOldData();
+    // 復号と変換はframeReader_のスレッドで済ませてある（生フレームファイルはそのまま参照する）
+    for (int i = 0; i < nFrames; ++i) {
+        cv::Mat1b& frame = video.pushBack();
+        if (!readFrame(frame)) {
+            video.popBack();
+            isEnded_ = true;
+            break;
+        }
+    }
 }
 
-void LocalFeatureExtractor::generateScaledVideos() {
-    for (int scaleIndex = 1; scaleIndex < scales_.size(); ++scaleIndex) {
-        int begin = scaleVideos_[scaleIndex].size();
-        for (int i = begin; i < scaleVideos_.front().size(); ++i) {
-            cv::Mat scaledFrame;
-            cv::resize(scaleVideos_.front()[i], scaledFrame, cv::Size(), scales_[scaleIndex],
-                       scales_[scaleIndex], cv::INTER_CUBIC);
-            scaleVideos_[scaleIndex].push_back(scaledFrame);
-        }
-    }
-}
-
-void LocalFeatureExtractor::extractFeatures(int scaleIndex, int beginFrame, int endFrame) {
-    extractIntensityFeature(scaleChannelFeatures_[scaleIndex][0],
-                            scaleChannelIntegrals_[scaleIndex][0], scaleIndex, beginFrame,
-                            endFrame);
-    extractXDerivativeFeature(scaleChannelFeatures_[scaleIndex][1],
-                              scaleChannelIntegrals_[scaleIndex][1], scaleIndex, beginFrame,
-                              endFrame);
-    extractYDerivativeFeature(scaleChannelFeatures_[scaleIndex][2],
-                              scaleChannelIntegrals_[scaleIndex][2], scaleIndex, beginFrame,
-                              endFrame);
-    extractTDerivativeFeature(scaleChannelFeatures_[scaleIndex][3],
-                              scaleChannelIntegrals_[scaleIndex][3], scaleIndex, beginFrame,
-                              endFrame);
-    // extractFlowFeature(scaleChannelFeatures_[scaleIndex][4],
-    //					scaleChannelFeatures_[scaleIndex][5],
-    //					scaleIndex, beginFrame, endFrame);
+void LocalFeatureExtractor::inputNewScaleVideo(const ColorVideo& video) {
+    for (const auto& frame : video) {
+        cv::cvtColor(frame, scaleVideos_.front().pushBack(), cv::COLOR_BGR2GRAY);
+    }
 }
 
-void LocalFeatureExtractor::deleteOldData() {
-    if (localDuration_ <= tStep_) {
-        scaleVideos_ = std::vector<Video>(scales_.size());
-        scaleChannelFeatures_ =
-                std::vector<MultiChannelFeature>(scales_.size(), MultiChannelFeature(N_CHANNELS_));
-        storedFeatureBeginT_ += tStep_;
-        nStoredFeatureFrames_ = 0;
-
+void LocalFeatureExtractor::extraction(std::vector<DescriptorBatch>& scaleBatches) {
+    int beginFrame = 1;
+    int endFrame = scaleVideos_.front().size();
+    nStoredFeatureFrames_ += endFrame - beginFrame;
+    if (nStoredFeatureFrames_ < localDuration_) {
+        isEnded_ = true;
+        scaleBatches.clear();
         return;
     }
 
-    for (auto& video : scaleVideos_) {
-        video = {video.back()};
+    generateScaledVideos();
+
+    // スケールとチャネルの組ごとに並列に計算する
+    // threadProcessは積んだ順に処理するので，計算量の大きいものから積む
+    std::vector<std::tuple<double, int, int>> channelTasks;
+    for (int scaleIndex = 0; scaleIndex < scales_.size(); ++scaleIndex) {
+        double nPixels = scaleVideos_[scaleIndex][beginFrame].total();
+        for (int groupIndex = 0; groupIndex < channelGroups_.size(); ++groupIndex) {
+            scaleChannelGroupTimes_[scaleIndex][groupIndex] = 0.0;
+            const auto& group = channelGroups_[groupIndex];
+            bool isUsed = groupIndex == 0 && motionThreshold_ > 0.0;
+            for (int i = 0; i < group.nChannels; ++i) {
+                isUsed = isUsed || usedChannels_[group.firstChannel + i];
+            }
+            if (isUsed) {
+                channelTasks.emplace_back(group.cost * nPixels, scaleIndex, groupIndex);
+            }
+        }
+    }
+    std::sort(std::begin(channelTasks), std::end(channelTasks),
+              [](const std::tuple<double, int, int>& a, const std::tuple<double, int, int>& b) {
+                  return std::get<0>(a) > std::get<0>(b);
+              });
+    std::queue<std::function<void()>> tasks;
+    for (const auto& channelTask : channelTasks) {
+        int scaleIndex = std::get<1>(channelTask);
+        int groupIndex = std::get<2>(channelTask);
+        tasks.push([this, scaleIndex, groupIndex, beginFrame, endFrame]() {
+            extractFeatures(scaleIndex, groupIndex, beginFrame, endFrame);
+        });
     }
+    thread::threadProcess(tasks, nThreads_);
 
     for (int scaleIndex = 0; scaleIndex < scales_.size(); ++scaleIndex) {
-        int width = width_ * scales_[scaleIndex];
-        int height = height_ * scales_[scaleIndex];
+        tasks.push([this, scaleIndex]() { selectSamples(scaleIndex); });
+    }
+    thread::threadProcess(tasks, nThreads_);
+    int nGridPoints = 0;
+    int nSamples = 0;
+    for (int scaleIndex = 0; scaleIndex < scales_.size(); ++scaleIndex) {
+        int nXPoints;
+        int nYPoints;
+        getSamplingGridSize(scaleIndex, nXPoints, nYPoints);
+        nGridPoints += nXPoints * nYPoints;
+        nSamples += scaleSampleIndices_[scaleIndex].size();
+    }
+    skippedSampleRatio_ =
+            (nGridPoints == 0) ? 0.0 : (1.0 - static_cast<double>(nSamples) / nGridPoints);
+
+    // 隣り合うサンプルで共有されるブロックの和を1回だけ求めておく
+    // 遅延評価では森が参照した要素だけをその都度求めるので作らない
+    bool isLazy = isLazyEvaluationEnabled_ && descriptorCache_ == nullptr;
+    for (int scaleIndex = 0; scaleIndex < scales_.size() && !isLazy; ++scaleIndex) {
+        int nXOrigins;
+        prepareBlockSumMaps(scaleIndex, nXOrigins);
+        int nYOrigins = scaleBlockYOrigins_[scaleIndex].size();
+        int nBandOrigins = std::max(1, (nYOrigins + nThreads_ * 2 - 1) / (nThreads_ * 2));
+        for (int originBegin = 0; originBegin < nYOrigins; originBegin += nBandOrigins) {
+            int originEnd = std::min(originBegin + nBandOrigins, nYOrigins);
+            tasks.push([this, scaleIndex, originBegin, originEnd, nXOrigins]() {
+                computeBlockSums(scaleIndex, originBegin, originEnd, nXOrigins);
+            });
+        }
+    }
+    thread::threadProcess(tasks, nThreads_);
 
-        for (int channelIndex = 0; channelIndex < N_CHANNELS_; ++channelIndex) {
-            auto beginIt = std::begin(scaleChannelFeatures_[scaleIndex][channelIndex]);
-            auto deleteEndIt = beginIt + tStep_;
-            scaleChannelFeatures_[scaleIndex][channelIndex].erase(beginIt, deleteEndIt);
+    int nPooledElements = (localWidth_ / xBlockSize_) * (localHeight_ / yBlockSize_) *
+                          (localDuration_ / tBlockSize_);
+    scaleBatches.resize(scales_.size());
+    for (int scaleIndex = 0; scaleIndex < scales_.size(); ++scaleIndex) {
+        int nXPoints;
+        int nYPoints;
+        getSamplingGridSize(scaleIndex, nXPoints, nYPoints);
+        int nScaleSamples = scaleSampleIndices_[scaleIndex].size();
+        auto& batch = scaleBatches[scaleIndex];
+        batch.resize(nScaleSamples, nPooledElements * getNumberOfChannels(),
+                     getNumberOfChannels());
+        if (isLazy) {
+            batch.setValueSource(std::make_shared<LazyDescriptorSource>(*this, scaleIndex,
+                                                                        nXPoints));
+        } else {
+            batch.setValueSource(nullptr);
+        }
 
-            auto integralBeginIt = std::begin(scaleChannelIntegrals_[scaleIndex][channelIndex]);
-            auto integralDeleteEndIt = integralBeginIt + tStep_;
-            scaleChannelIntegrals_[scaleIndex][channelIndex].erase(integralBeginIt,
-                                                                   integralDeleteEndIt);
+        int nBandSamples = std::max(1, (nScaleSamples + nThreads_ * 2 - 1) / (nThreads_ * 2));
+        for (int sampleBegin = 0; sampleBegin < nScaleSamples; sampleBegin += nBandSamples) {
+            int sampleEnd = std::min(sampleBegin + nBandSamples, nScaleSamples);
+            tasks.push([this, scaleIndex, sampleBegin, sampleEnd, &batch]() {
+                denseSampling(scaleIndex, sampleBegin, sampleEnd, batch);
+            });
         }
     }
-    storedFeatureBeginT_ += tStep_;
-    nStoredFeatureFrames_ -= tStep_;
-}
-
-void LocalFeatureExtractor::extractIntensityFeature(Feature& features, Feature& integrals,
-                                                    int scaleIndex, int beginFrame, int endFrame) {
-    features.reserve(features.size() + (endFrame - beginFrame));
-    integrals.reserve(integrals.size() + (endFrame - beginFrame));
-    for (int t = beginFrame; t < endFrame; ++t) {
-        cv::Mat1f oneFrameFeature;
-        extractIntensityFeature(scaleVideos_[scaleIndex][t], oneFrameFeature);
-        features.push_back(oneFrameFeature);
+    thread::threadProcess(tasks, nThreads_);
 
-        cv::Mat oneFrameIntegral;
-        cv::integral(cv::Mat(oneFrameFeature), oneFrameIntegral, CV_32F);
-        integrals.push_back(oneFrameIntegral);
+    storedFeatureBeginT_ += tStep_;
+    nStoredFeatureFrames_ = (localDuration_ <= tStep_) ? 0 : (nStoredFeatureFrames_ - tStep_);
+    if (isLazy) {
+        // 森が記述子を参照し終わるまで積分画像を残し，次の抽出の前に捨てる
+        isDeletionPending_ = true;
+    } else {
+        deleteOldData();
     }
 }
 
-void LocalFeatureExtractor::extractXDerivativeFeature(Feature& features, Feature& integrals,
-                                                      int scaleIndex, int beginFrame,
-                                                      int endFrame) {
-    features.reserve(features.size() + (endFrame - beginFrame));
-    integrals.reserve(integrals.size() + (endFrame - beginFrame));
-    for (int t = beginFrame; t < endFrame; ++t) {
-        cv::Mat1f oneFrameFeature;
-        extractXDerivativeFeature(scaleVideos_[scaleIndex][t], oneFrameFeature);
-        features.push_back(oneFrameFeature);
-
-        cv::Mat oneFrameIntegral;
-        cv::integral(cv::Mat(oneFrameFeature), oneFrameIntegral, CV_32F);
-        integrals.push_back(oneFrameIntegral);
+void LocalFeatureExtractor::generateScaledVideos() {
+    if (scales_.size() < 2) {
+        return;
     }
-}
 
-void LocalFeatureExtractor::extractYDerivativeFeature(Feature& features, Feature& integrals,
-                                                      int scaleIndex, int beginFrame,
-                                                      int endFrame) {
-    features.reserve(features.size() + (endFrame - beginFrame));
-    integrals.reserve(integrals.size() + (endFrame - beginFrame));
-    for (int t = beginFrame; t < endFrame; ++t) {
-        cv::Mat1f oneFrameFeature;
-        extractYDerivativeFeature(scaleVideos_[scaleIndex][t], oneFrameFeature);
-        features.push_back(oneFrameFeature);
+    const auto& originalVideo = scaleVideos_.front();
+    int begin = scaleVideos_[1].size();
+    int end = originalVideo.size();
+    // 各タスクが別々のフレームに書き込めるように先に場所を確保しておく
+    for (int scaleIndex = 1; scaleIndex < scales_.size(); ++scaleIndex) {
+        for (int i = begin; i < end; ++i) {
+            scaleVideos_[scaleIndex].pushBack();
+        }
+    }
 
-        cv::Mat oneFrameIntegral;
-        cv::integral(cv::Mat(oneFrameFeature), oneFrameIntegral, CV_32F);
-        integrals.push_back(oneFrameIntegral);
+    std::queue<std::function<void()>> tasks;
+    for (int i = begin; i < end; ++i) {
+        tasks.push([this, i]() {
+            const cv::Mat1b& originalFrame = scaleVideos_.front()[i];
+            for (int scaleIndex = 1; scaleIndex < scales_.size(); ++scaleIndex) {
+                double scale = scales_[scaleIndex];
+                if (isPyramidEnabled_) {
+                    // 大きさは元の解像度から縮小したときと揃える
+                    cv::Size size(cv::saturate_cast<int>(originalFrame.cols * scale),
+                                  cv::saturate_cast<int>(originalFrame.rows * scale));
+                    cv::resize(scaleVideos_[scaleIndex - 1][i], scaleVideos_[scaleIndex][i], size,
+                               0.0, 0.0, cv::INTER_CUBIC);
+                } else {
+                    cv::resize(originalFrame, scaleVideos_[scaleIndex][i], cv::Size(), scale,
+                               scale, cv::INTER_CUBIC);
+                }
+            }
+        });
     }
+    thread::threadProcess(tasks, nThreads_);
 }
 
-void LocalFeatureExtractor::extractTDerivativeFeature(Feature& features, Feature& integrals,
-                                                      int scaleIndex, int beginFrame,
-                                                      int endFrame) {
-    features.reserve(features.size() + (endFrame - beginFrame));
-    integrals.reserve(integrals.size() + (endFrame - beginFrame));
+void LocalFeatureExtractor::extractFeatures(int scaleIndex, int groupIndex, int beginFrame,
+                                            int endFrame) {
+    auto startTime = std::chrono::steady_clock::now();
+    const auto& video = scaleVideos_[scaleIndex];
+    const auto& group = channelGroups_[groupIndex];
+    // 動きで点を選ぶときは既定のチャネルの組の最後にt微分の絶対値の積分画像も求める
+    std::vector<IntegralVolume*> channelVolumes;
+    for (int i = 0; i < group.nChannels; ++i) {
+        channelVolumes.push_back(&scaleChannelVolumes_[scaleIndex][group.firstChannel + i]);
+    }
+    if (groupIndex == 0 && motionThreshold_ > 0.0) {
+        channelVolumes.push_back(&scaleMotionVolumes_[scaleIndex]);
+    }
+    int rows = video[beginFrame].rows + 1;
+    int cols = video[beginFrame].cols + 1;
+    if (channelVolumes.front()->empty()) {
+        for (auto volume : channelVolumes) {
+            cv::Mat& basePlane = volume->pushBack();
+            basePlane.create(rows, cols, group.volumeType);
+            basePlane.setTo(0);
+        }
+    }
 
-    cv::Mat prev = scaleVideos_[scaleIndex][beginFrame - 1];
+    // 森が参照しないチャネルは面を確保せず空のままにする
+    std::vector<cv::Mat> previousVolumes(channelVolumes.size());
+    std::vector<cv::Mat> volumes(channelVolumes.size());
     for (int t = beginFrame; t < endFrame; ++t) {
-        cv::Mat next = scaleVideos_[scaleIndex][t];
-
-        cv::Mat1f oneFrameFeature;
-        extractTDerivativeFeature(prev, next, oneFrameFeature);
-        features.push_back(oneFrameFeature);
+        for (int channelIndex = 0; channelIndex < channelVolumes.size(); ++channelIndex) {
+            auto& volume = *channelVolumes[channelIndex];
+            cv::Mat& plane = volume.pushBack();
+            if (channelIndex >= group.nChannels ||
+                usedChannels_[group.firstChannel + channelIndex]) {
+                plane.create(rows, cols, group.volumeType);
+            } else {
+                plane.release();
+            }
+            previousVolumes[channelIndex] = volume[volume.size() - 2];
+            volumes[channelIndex] = plane;
+        }
+        (this->*group.compute)(scaleIndex, video[t - 1], video[t], previousVolumes, volumes);
+    }
 
-        cv::Mat oneFrameIntegral;
-        cv::integral(cv::Mat(oneFrameFeature), oneFrameIntegral, CV_32F);
-        integrals.push_back(oneFrameIntegral);
+    std::chrono::duration<double, std::milli> elapsedTime =
+            std::chrono::steady_clock::now() - startTime;
+    scaleChannelGroupTimes_[scaleIndex][groupIndex] = elapsedTime.count();
+}
 
-        prev = next;
-    }
+void LocalFeatureExtractor::computeGradientChannels(int scaleIndex, const cv::Mat1b& prev,
+                                                    const cv::Mat1b& next,
+                                                    const std::vector<cv::Mat>& previousVolumes,
+                                                    std::vector<cv::Mat>& volumes) {
+    extractChannelIntegrals(prev, next, previousVolumes, volumes,
+                            scaleChannelBuffers_[scaleIndex]);
 }
 
-void LocalFeatureExtractor::extractFlowFeature(Feature& xFeatures, Feature& yFeatures,
-                                               Feature& xIntegrals, Feature& yIntegrals,
-                                               int scaleIndex, int beginFrame, int endFrame) {
-    xFeatures.reserve(xFeatures.size() + (endFrame - beginFrame));
-    yFeatures.reserve(yFeatures.size() + (endFrame - beginFrame));
-    xIntegrals.reserve(xIntegrals.size() + (endFrame - beginFrame));
-    yIntegrals.reserve(yIntegrals.size() + (endFrame - beginFrame));
+void LocalFeatureExtractor::computeFlowChannels(int scaleIndex, const cv::Mat1b& prev,
+                                                const cv::Mat1b& next,
+                                                const std::vector<cv::Mat>& previousVolumes,
+                                                std::vector<cv::Mat>& volumes) {
+    auto& buffers = scaleFlowBuffers_[scaleIndex];
+    if (!buffers.estimator) {
+        buffers.estimator = cv::superres::createOptFlow_Farneback();
+    }
 
-    cv::Mat prev = scaleVideos_[scaleIndex][beginFrame - 1];
-    for (int t = beginFrame; t < endFrame; ++t) {
-        cv::Mat next = scaleVideos_[scaleIndex][t];
-        std::vector<cv::Mat1f> features;
-        extractFlowFeature(prev, next, features);
-        xFeatures.push_back(features.at(0));
-        yFeatures.push_back(features.at(1));
+    int width = next.cols;
+    int height = next.rows;
+    cv::Size reducedSize(std::max(1, cvRound(width * flowScale_)),
+                         std::max(1, cvRound(height * flowScale_)));
+    if (reducedSize == next.size()) {
+        buffers.estimator->calc(prev, next, buffers.flowX, buffers.flowY);
+    } else {
+        cv::resize(prev, buffers.prev, reducedSize, 0.0, 0.0, cv::INTER_AREA);
+        cv::resize(next, buffers.next, reducedSize, 0.0, 0.0, cv::INTER_AREA);
+        buffers.estimator->calc(buffers.prev, buffers.next, buffers.reducedFlowX,
+                                buffers.reducedFlowY);
+        // 移動量は縮小した映像での画素数なので元の大きさに合わせる
+        cv::resize(buffers.reducedFlowX, buffers.flowX, next.size(), 0.0, 0.0, cv::INTER_LINEAR);
+        cv::resize(buffers.reducedFlowY, buffers.flowY, next.size(), 0.0, 0.0, cv::INTER_LINEAR);
+        buffers.flowX *= static_cast<double>(width) / reducedSize.width;
+        buffers.flowY *= static_cast<double>(height) / reducedSize.height;
+    }
 
-        cv::Mat xIntegral;
-        cv::integral(cv::Mat(features.at(0)), xIntegral, CV_32F);
-        cv::Mat yIntegral;
-        cv::integral(cv::Mat(features.at(1)), yIntegral, CV_32F);
-        xIntegrals.push_back(xIntegral);
-        yIntegrals.push_back(yIntegral);
+    const cv::Mat1f* flows[] = {&buffers.flowX, &buffers.flowY};
+    buffers.integralRows.resize(volumes.size());
+    for (int i = 0; i < volumes.size(); ++i) {
+        int channelIndex = N_CHANNELS_ + i;
+        if (!usedChannels_[channelIndex]) {
+            continue;
+        }
+        volumes[i].create(height + 1, width + 1, CV_64F);
+        std::fill_n(volumes[i].ptr<double>(0), width + 1, 0.0);
+
+        // 解像度が大きいとfloatでは桁落ちするので，面と同じdoubleで積分する
+        auto& integralRow = buffers.integralRows[i];
+        integralRow.assign(width + 1, 0.0);
+        for (int y = 0; y < height; ++y) {
+            const float* flowRow = flows[i]->ptr<float>(y);
+            double sum = 0.0;
+            for (int x = 0; x < width; ++x) {
+                sum += flowRow[x];
+                integralRow[x + 1] += sum;
+            }
 
-        prev = next;
+            const double* previousVolumeRow = previousVolumes[i].ptr<double>(y + 1);
+            double* volumeRow = volumes[i].ptr<double>(y + 1);
+            for (int x = 0; x <= width; ++x) {
+                volumeRow[x] = previousVolumeRow[x] + integralRow[x];
+            }
+        }
     }
 }
 
-void LocalFeatureExtractor::extractIntensityFeature(const cv::Mat1b& frame,
-                                                    cv::Mat1f& feature) const {
-    frame.convertTo(feature, CV_32F);
-}
-
-void LocalFeatureExtractor::extractXDerivativeFeature(const cv::Mat1b& frame,
-                                                      cv::Mat1f& feature) const {
-    cv::Sobel(frame, feature, CV_32F, 1, 0);
-}
+void LocalFeatureExtractor::deleteOldData() {
+    if (localDuration_ <= tStep_) {
+        for (int scaleIndex = 0; scaleIndex < scales_.size(); ++scaleIndex) {
+            scaleVideos_[scaleIndex].clear();
+            for (auto& volume : scaleChannelVolumes_[scaleIndex]) {
+                volume.clear();
+            }
+            scaleMotionVolumes_[scaleIndex].clear();
+        }
+        return;
+    }
 
-void LocalFeatureExtractor::extractYDerivativeFeature(const cv::Mat1b& frame,
-                                                      cv::Mat1f& feature) const {
-    cv::Sobel(frame, feature, CV_32F, 0, 1);
+    for (int scaleIndex = 0; scaleIndex < scales_.size(); ++scaleIndex) {
+        scaleVideos_[scaleIndex].keepBack(1);
+        // 先頭の面も基準として差を取るだけなので，累積をやり直す必要はない
+        // 森が参照しないチャネルの組は計算していない
+        for (auto& volume : scaleChannelVolumes_[scaleIndex]) {
+            if (!volume.empty()) {
+                volume.popFront(tStep_);
+            }
+        }
+        if (!scaleMotionVolumes_[scaleIndex].empty()) {
+            scaleMotionVolumes_[scaleIndex].popFront(tStep_);
+        }
+    }
 }
 
-void LocalFeatureExtractor::extractTDerivativeFeature(const cv::Mat1b& prev, const cv::Mat1b& next,
-                                                      cv::Mat1f& feature) const {
-    cv::Mat floatPrev;
-    cv::Mat floatNext;
-    prev.convertTo(floatPrev, CV_32F);
-    next.convertTo(floatNext, CV_32F);
+void LocalFeatureExtractor::extractChannelIntegrals(const cv::Mat1b& prev, const cv::Mat1b& next,
+                                                    const std::vector<cv::Mat>& previousVolumes,
+                                                    std::vector<cv::Mat>& volumes,
+                                                    ChannelBuffers& buffers) const {
+    int width = next.cols;
+    int height = next.rows;
+    int nVolumes = volumes.size();
+    bool isMotionIncluded = nVolumes > N_CHANNELS_;
+
+    auto& xDiffRows = buffers.xDiffRows;
+    auto& xSmoothRows = buffers.xSmoothRows;
+    for (int i = 0; i < 3; ++i) {
+        xDiffRows[i].resize(width);
+        xSmoothRows[i].resize(width);
+    }
+    buffers.channelRows.resize(N_CHANNELS_);
+    for (auto& channelRow : buffers.channelRows) {
+        channelRow.resize(width);
+    }
+    buffers.integralRows.resize(nVolumes);
+    for (auto& integralRow : buffers.integralRows) {
+        integralRow.assign(width + 1, 0);
+    }
+    for (int channelIndex = 0; channelIndex < nVolumes; ++channelIndex) {
+        if (channelIndex < N_CHANNELS_ && !usedChannels_[channelIndex]) {
+            continue;
+        }
+        volumes[channelIndex].create(height + 1, width + 1, CV_32S);
+        std::fill_n(volumes[channelIndex].ptr<std::uint32_t>(0), width + 1, 0);
+    }
 
-    feature = floatNext - floatPrev;
-}
+    // 0: y-1行目, 1: y行目, 2: y+1行目
+    filterRow(next.ptr<uchar>(0), width, xDiffRows[1].data(), xSmoothRows[1].data());
+    filterRow(next.ptr<uchar>(reflect101(1, height)), width, xDiffRows[2].data(),
+              xSmoothRows[2].data());
+    xDiffRows[0] = xDiffRows[2];
+    xSmoothRows[0] = xSmoothRows[2];
+
+    int* intensityRow = buffers.channelRows[0].data();
+    int* xDerivativeRow = buffers.channelRows[1].data();
+    int* yDerivativeRow = buffers.channelRows[2].data();
+    int* tDerivativeRow = buffers.channelRows[3].data();
+    for (int y = 0; y < height; ++y) {
+        const uchar* prevRow = prev.ptr<uchar>(y);
+        const uchar* nextRow = next.ptr<uchar>(y);
+        const int* upperDiff = xDiffRows[0].data();
+        const int* centerDiff = xDiffRows[1].data();
+        const int* lowerDiff = xDiffRows[2].data();
+        const int* upperSmooth = xSmoothRows[0].data();
+        const int* lowerSmooth = xSmoothRows[2].data();
+        for (int x = 0; x < width; ++x) {
+            intensityRow[x] = nextRow[x];
+            xDerivativeRow[x] = upperDiff[x] + 2 * centerDiff[x] + lowerDiff[x];
+            yDerivativeRow[x] = lowerSmooth[x] - upperSmooth[x];
+            tDerivativeRow[x] = nextRow[x] - prevRow[x];
+        }
 
-void LocalFeatureExtractor::extractFlowFeature(const cv::Mat1b& prev, const cv::Mat1b& next,
-                                               std::vector<cv::Mat1f>& features) const {
-    auto flow = cv::superres::createOptFlow_Farneback();
+        // 値は全て整数なので，uint32で桁あふれを許して積分する
+        // ブロックの和は面の差で求めるので，桁あふれは打ち消され解像度によらず正確になる
+        std::uint32_t* intensitySums = buffers.integralRows[0].data();
+        std::uint32_t* xDerivativeSums = buffers.integralRows[1].data();
+        std::uint32_t* yDerivativeSums = buffers.integralRows[2].data();
+        std::uint32_t* tDerivativeSums = buffers.integralRows[3].data();
+        std::uint32_t intensitySum = 0;
+        std::uint32_t xDerivativeSum = 0;
+        std::uint32_t yDerivativeSum = 0;
+        std::uint32_t tDerivativeSum = 0;
+        for (int x = 0; x < width; ++x) {
+            intensitySum += intensityRow[x];
+            xDerivativeSum += xDerivativeRow[x];
+            yDerivativeSum += yDerivativeRow[x];
+            tDerivativeSum += tDerivativeRow[x];
+            intensitySums[x + 1] += intensitySum;
+            xDerivativeSums[x + 1] += xDerivativeSum;
+            yDerivativeSums[x + 1] += yDerivativeSum;
+            tDerivativeSums[x + 1] += tDerivativeSum;
+        }
+        if (isMotionIncluded) {
+            std::uint32_t* motionSums = buffers.integralRows[N_CHANNELS_].data();
+            std::uint32_t motionSum = 0;
+            for (int x = 0; x < width; ++x) {
+                motionSum += std::abs(tDerivativeRow[x]);
+                motionSums[x + 1] += motionSum;
+            }
+        }
 
-    cv::Mat1f flowX;
-    cv::Mat1f flowY;
-    flow->calc(prev, next, flowX, flowY);
+        // 時間方向の累積も同じくuint32で行う
+        // 森が参照しないチャネルは累積しない
+        for (int channelIndex = 0; channelIndex < nVolumes; ++channelIndex) {
+            if (channelIndex < N_CHANNELS_ && !usedChannels_[channelIndex]) {
+                continue;
+            }
+            const std::uint32_t* integralRow = buffers.integralRows[channelIndex].data();
+            const std::uint32_t* previousVolumeRow =
+                    previousVolumes[channelIndex].ptr<std::uint32_t>(y + 1);
+            std::uint32_t* volumeRow = volumes[channelIndex].ptr<std::uint32_t>(y + 1);
+            for (int x = 0; x <= width; ++x) {
+                volumeRow[x] = previousVolumeRow[x] + integralRow[x];
+            }
+        }
 
-    features.push_back(flowX);
-    features.push_back(flowY);
+        if (y + 1 < height) {
+            std::swap(xDiffRows[0], xDiffRows[1]);
+            std::swap(xDiffRows[1], xDiffRows[2]);
+            std::swap(xSmoothRows[0], xSmoothRows[1]);
+            std::swap(xSmoothRows[1], xSmoothRows[2]);
+            filterRow(next.ptr<uchar>(reflect101(y + 2, height)), width, xDiffRows[2].data(),
+                      xSmoothRows[2].data());
+        }
+    }
 }
 
-void LocalFeatureExtractor::denseSampling(int scaleIndex, std::vector<cv::Vec3i>& points,
-                                          std::vector<Descriptor>& descriptors) const {
+void LocalFeatureExtractor::getSamplingGridSize(int scaleIndex, int& nXPoints,
+                                                int& nYPoints) const {
     int width = width_ * scales_[scaleIndex];
-    int xEnd = width - localWidth_;
     int height = height_ * scales_[scaleIndex];
+    int xEnd = width - localWidth_;
     int yEnd = height - localHeight_;
+    nXPoints = (xEnd < 0) ? 0 : (xEnd / xStep_ + 1);
+    nYPoints = (yEnd < 0) ? 0 : (yEnd / yStep_ + 1);
+}
 
-    for (int y = 0; y <= yEnd; y += yStep_) {
-        for (int x = 0; x <= xEnd; x += xStep_) {
-            points.emplace_back(storedFeatureBeginT_ + (localDuration_ / 2), y + (localHeight_ / 2),
-                                x + (localWidth_ / 2));
+void LocalFeatureExtractor::selectSamples(int scaleIndex) {
+    int nXPoints;
+    int nYPoints;
+    getSamplingGridSize(scaleIndex, nXPoints, nYPoints);
+    auto& sampleIndices = scaleSampleIndices_[scaleIndex];
+    sampleIndices.clear();
+    if (motionThreshold_ <= 0.0) {
+        sampleIndices.resize(nXPoints * nYPoints);
+        std::iota(std::begin(sampleIndices), std::end(sampleIndices), 0);
+        return;
+    }
 
-            Descriptor neighborhoodFeatures;
-            getDescriptor(scaleIndex, cv::Vec3i(0, y, x), width, height, neighborhoodFeatures);
-            descriptors.push_back(neighborhoodFeatures);
+    // 局所領域全体のt微分の絶対値の和は時空間の積分画像からO(1)で求まる
+    const auto& volume = scaleMotionVolumes_[scaleIndex];
+    const cv::Mat& beginPlane = volume[0];
+    const cv::Mat& endPlane = volume[localDuration_];
+    double minMotionSum = motionThreshold_ * localWidth_ * localHeight_ * localDuration_;
+    for (int row = 0; row < nYPoints; ++row) {
+        int yBegin = row * yStep_;
+        int yEnd = yBegin + localHeight_;
+        for (int column = 0; column < nXPoints; ++column) {
+            int xBegin = column * xStep_;
+            int xEnd = xBegin + localWidth_;
+            double motionSum = sumCuboid(beginPlane, endPlane, yBegin, yEnd, xBegin, xEnd);
+            if (motionSum >= minMotionSum) {
+                sampleIndices.push_back(row * nXPoints + column);
+            }
         }
     }
 }
 
-void LocalFeatureExtractor::getDescriptor(int scaleIndex, const cv::Vec3i& topLeftPoint, int width,
-                                          int height, Descriptor& descriptor) const {
-    int nBlockElements = xBlockSize_ * yBlockSize_ * tBlockSize_;
+void LocalFeatureExtractor::prepareBlockSumMaps(int scaleIndex, int& nXOrigins) {
     int nXBlocks = localWidth_ / xBlockSize_;
     int nYBlocks = localHeight_ / yBlockSize_;
     int nTBlocks = localDuration_ / tBlockSize_;
-    int nPooledElements = nXBlocks * nYBlocks * nTBlocks;
-    descriptor.resize(nPooledElements * N_CHANNELS_);
-    int blockIndex = 0;
-    for (int tBlockIndex = 0; tBlockIndex < nTBlocks; ++tBlockIndex) {
-        int tBegin = topLeftPoint(T) + tBlockSize_ * tBlockIndex;
-        int tEnd = tBegin + tBlockSize_;
+    int nXPoints;
+    int nYPoints;
+    getSamplingGridSize(scaleIndex, nXPoints, nYPoints);
+
+    // 選ばれた点を含む行のブロックだけを求める
+    auto& yOrigins = scaleBlockYOrigins_[scaleIndex];
+    yOrigins.clear();
+    int previousRow = -1;
+    for (int sampleIndex : scaleSampleIndices_[scaleIndex]) {
+        int row = sampleIndex / nXPoints;
+        if (row == previousRow) {
+            continue;
+        }
+        previousRow = row;
         for (int yBlockIndex = 0; yBlockIndex < nYBlocks; ++yBlockIndex) {
-            int yBegin = topLeftPoint(Y) + yBlockSize_ * yBlockIndex;
-            int yEnd = yBegin + yBlockSize_;
-            for (int xBlockIndex = 0; xBlockIndex < nXBlocks; ++xBlockIndex) {
-                int xBegin = topLeftPoint(X) + xBlockSize_ * xBlockIndex;
-                int xEnd = xBegin + xBlockSize_;
-
-                pooling(scaleIndex, blockIndex, nPooledElements, nBlockElements, xBegin, xEnd,
-                        yBegin, yEnd, tBegin, tEnd, descriptor);
-                blockIndex++;
+            yOrigins.push_back(row * yStep_ + yBlockIndex * yBlockSize_);
+        }
+    }
+    std::sort(std::begin(yOrigins), std::end(yOrigins));
+    yOrigins.erase(std::unique(std::begin(yOrigins), std::end(yOrigins)), std::end(yOrigins));
+
+    nXOrigins = (nXPoints == 0) ? 0 : ((nXPoints - 1) * xStep_ + (nXBlocks - 1) * xBlockSize_ + 1);
+    int nYRows = yOrigins.empty() ? 0 : (yOrigins.back() + 1);
+    auto& blockSumMaps = scaleBlockSumMaps_[scaleIndex];
+    blockSumMaps.resize(getNumberOfChannels() * nTBlocks);
+    for (int mapIndex = 0; mapIndex < blockSumMaps.size(); ++mapIndex) {
+        if (usedBlockSumMaps_[mapIndex]) {
+            blockSumMaps[mapIndex].create(nYRows, nXOrigins);
+        }
+    }
+}
+
+void LocalFeatureExtractor::computeBlockSums(int scaleIndex, int originBegin, int originEnd,
+                                             int nXOrigins) {
+    int nTBlocks = localDuration_ / tBlockSize_;
+    double nBlockElements = xBlockSize_ * yBlockSize_ * tBlockSize_;
+    const auto& yOrigins = scaleBlockYOrigins_[scaleIndex];
+    for (int channelIndex = 0; channelIndex < getNumberOfChannels(); ++channelIndex) {
+        const auto& volume = scaleChannelVolumes_[scaleIndex][channelIndex];
+        for (int tBlockIndex = 0; tBlockIndex < nTBlocks; ++tBlockIndex) {
+            if (!usedBlockSumMaps_[channelIndex * nTBlocks + tBlockIndex]) {
+                continue;
+            }
+            int tBegin = tBlockSize_ * tBlockIndex;
+            int tEnd = tBegin + tBlockSize_;
+            cv::Mat1f& blockSumMap =
+                    scaleBlockSumMaps_[scaleIndex][channelIndex * nTBlocks + tBlockIndex];
+            for (int i = originBegin; i < originEnd; ++i) {
+                int yBegin = yOrigins[i];
+                averageCuboidRow(volume[tBegin], volume[tEnd], yBegin, yBegin + yBlockSize_,
+                                 xBlockSize_, nXOrigins, nBlockElements,
+                                 blockSumMap.ptr<float>(yBegin));
             }
         }
     }
 }
 
-void LocalFeatureExtractor::pooling(int scaleIndex, int blockIndex, int nPooledElements,
-                                    int nBlockElements, int xBegin, int xEnd, int yBegin, int yEnd,
-                                    int tBegin, int tEnd, Descriptor& pooledDescriptor) const {
-    for (int channelIndex = 0; channelIndex < N_CHANNELS_; ++channelIndex) {
-        double sumPooling = 0.0;
-        for (int t = tBegin; t < tEnd; ++t) {
-            cv::Mat1f integralMat = scaleChannelIntegrals_[scaleIndex][channelIndex][t];
-            sumPooling += integralMat(yEnd, xEnd) - integralMat(yBegin, xEnd) -
-                          integralMat(yEnd, xBegin) + integralMat(yBegin, xBegin);
+void LocalFeatureExtractor::denseSampling(int scaleIndex, int sampleBegin, int sampleEnd,
+                                          DescriptorBatch& batch) const {
+    int nDimensions = batch.getNumberOfDimensions();
+    bool isAllUsed = static_cast<int>(usedPooledElements_.size()) == nDimensions;
+    int nXPoints;
+    int nYPoints;
+    getSamplingGridSize(scaleIndex, nXPoints, nYPoints);
+    const auto& blockSumMaps = scaleBlockSumMaps_[scaleIndex];
+    const auto& sampleIndices = scaleSampleIndices_[scaleIndex];
+
+    for (int index = sampleBegin; index < sampleEnd; ++index) {
+        int y = (sampleIndices[index] / nXPoints) * yStep_;
+        int x = (sampleIndices[index] % nXPoints) * xStep_;
+        batch.getPoint(index) = cv::Vec3i(storedFeatureBeginT_ + (localDuration_ / 2),
+                                          y + (localHeight_ / 2), x + (localWidth_ / 2));
+
+        float* pooledElements = batch.getDescriptor(index);
+        if (batch.getValueSource()) {
+            std::fill_n(pooledElements, nDimensions, std::numeric_limits<float>::quiet_NaN());
+            continue;
+        }
+        if (!isAllUsed) {
+            std::fill_n(pooledElements, nDimensions, 0.0f);
+        }
+        // 要素は(チャネル, t, y, x)の順に並んでいる
+        for (const auto& element : usedPooledElements_) {
+            const cv::Mat1f& blockSumMap = blockSumMaps[element.blockSumMapIndex];
+            pooledElements[element.descriptorIndex] =
+                    blockSumMap.ptr<float>(y + element.yOffset)[x + element.xOffset];
         }
-        pooledDescriptor[channelIndex * nPooledElements + blockIndex] = sumPooling / nBlockElements;
     }
 }
 
+float LocalFeatureExtractor::computePooledElement(int scaleIndex, int channelIndex,
+                                                  int elementIndex, int y, int x) const {
+    int nXBlocks = localWidth_ / xBlockSize_;
+    int nYBlocks = localHeight_ / yBlockSize_;
+    int tBlockIndex = elementIndex / (nXBlocks * nYBlocks);
+    int yBlockIndex = (elementIndex / nXBlocks) % nYBlocks;
+    int xBlockIndex = elementIndex % nXBlocks;
+
+    const auto& volume = scaleChannelVolumes_[scaleIndex][channelIndex];
+    int yBegin = y + yBlockSize_ * yBlockIndex;
+    int xBegin = x + xBlockSize_ * xBlockIndex;
+    // computeBlockSumsと同じ順序で計算する
+    double nBlockElements = xBlockSize_ * yBlockSize_ * tBlockSize_;
+    double sumPooling = sumCuboid(volume[tBlockSize_ * tBlockIndex],
+                                  volume[tBlockSize_ * (tBlockIndex + 1)], yBegin,
+                                  yBegin + yBlockSize_, xBegin, xBegin + xBlockSize_);
+    return static_cast<float>(sumPooling / nBlockElements);
+}
+
 void LocalFeatureExtractor::visualizeDenseFeature(const std::vector<cv::Vec3i>& points,
                                                   const std::vector<Descriptor>& features,
                                                   int width, int height, int duration) const {
@@ -1,9 +1,21 @@
 #ifndef LOCAL_FEATURE_EXTRACTOR
 #define LOCAL_FEATURE_EXTRACTOR
 
+#include "AsyncFrameReader.h"
+#include "DescriptorBatch.h"
+#include "DescriptorCache.h"
+#include "RawFrameFile.h"
+#include "RingBuffer.h"
+
 #include <opencv2/core/core.hpp>
 #include <opencv2/highgui.hpp>
+#include <opencv2/superres/optical_flow.hpp>
 
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
 #include <vector>
 
 namespace nuisken {
@@ -12,19 +24,113 @@ namespace houghforests {
 class LocalFeatureExtractor {
    public:
     enum Axis { X = 2, Y = 1, T = 0 };
+
+    /**
+     * 既定のチャネル（輝度，x微分，y微分，t微分）の数
+     */
     static const int N_CHANNELS_;
 
+    /**
+     * オプティカルフローのチャネル（x成分，y成分）の数
+     */
+    static const int N_FLOW_CHANNELS_;
+
    private:
     using Descriptor = std::vector<float>;
-    using Feature = std::vector<cv::Mat1f>;
-    using MultiChannelFeature = std::vector<Feature>;
-    using Video = std::vector<cv::Mat1b>;
+    /**
+     * 時間方向にも累積した積分画像
+     * volume[k](y, x)は先頭からk-1フレーム目までの積分画像の和なので，
+     * 時空間ブロックの和は2枚の差の4隅（8回の参照）で求まる
+     * 整数のチャネルの面はCV_32S（uint32として桁あふれを許して累積する），
+     * 実数のチャネルの面はCV_64F
+     * 各面は循環バッファで使い回す
+     */
+    using IntegralVolume = RingBuffer<cv::Mat>;
+    using MultiChannelVolume = std::vector<IntegralVolume>;
+    using Video = RingBuffer<cv::Mat1b>;
     using ColorVideo = std::vector<cv::Mat3b>;
 
-    cv::VideoCapture videoCapture_;
+    /**
+     * 1フレーム分のチャネルを計算するときの作業用バッファ
+     * xDiffRows, xSmoothRowsはy-1, y, y+1行目の横方向の差分[-1 0 1]と平滑化[1 2 1]
+     * integralRowsは現在の行までのフレーム内の積分画像の1行
+     */
+    struct ChannelBuffers {
+        std::array<std::vector<int>, 3> xDiffRows;
+        std::array<std::vector<int>, 3> xSmoothRows;
+        std::vector<std::vector<int>> channelRows;
+        std::vector<std::vector<std::uint32_t>> integralRows;
+    };
+
+    /**
+     * 1組のチャネルについて，前後のフレームから各チャネルの積分画像を求め，
+     * previousVolumesに足したものをvolumesに書き込む
+     */
+    using ChannelFunction = void (LocalFeatureExtractor::*)(
+            int scaleIndex, const cv::Mat1b& prev, const cv::Mat1b& next,
+            const std::vector<cv::Mat>& previousVolumes, std::vector<cv::Mat>& volumes);
+
+    /**
+     * まとめて計算するチャネルの組（記述子ではfirstChannelからnChannels個のチャネル）
+     * volumeTypeは積分画像の面の型（CV_32SかCV_64F）
+     * costは1画素あたりの相対的な計算量で，重い組から並列に処理し始めるのに使う
+     */
+    struct ChannelGroup {
+        std::string name;
+        int firstChannel;
+        int nChannels;
+        int volumeType;
+        double cost;
+        ChannelFunction compute;
+    };
+
+    /**
+     * オプティカルフローの計算器と作業用バッファ（スケールごとに使い回す）
+     * reducedFlowX, reducedFlowYは縮小した映像でのフロー，flowX, flowYは元の大きさに戻したもの
+     */
+    struct FlowBuffers {
+        cv::Ptr<cv::superres::DenseOpticalFlowExt> estimator;
+        cv::Mat1b prev;
+        cv::Mat1b next;
+        cv::Mat1f reducedFlowX;
+        cv::Mat1f reducedFlowY;
+        cv::Mat1f flowX;
+        cv::Mat1f flowY;
+        std::vector<std::vector<double>> integralRows;
+    };
+
+    /**
+     * 記述子の1要素とその値を持つブロック和のマップ，マップ上での位置のずれ
+     */
+    struct PooledElement {
+        int descriptorIndex;
+        int blockSumMapIndex;
+        int yOffset;
+        int xOffset;
+    };
+
+    /**
+     * 森が参照した記述子の要素だけを積分画像から求める
+     */
+    class LazyDescriptorSource;
+
+    std::shared_ptr<io::AsyncFrameReader> frameReader_;
+    std::shared_ptr<io::RawFrameFile> rawFrameFile_;
+    int nextFrameIndex_;
     std::vector<Video> scaleVideos_;
-    std::vector<MultiChannelFeature> scaleChannelFeatures_;
-    std::vector<MultiChannelFeature> scaleChannelIntegrals_;
+    std::vector<MultiChannelVolume> scaleChannelVolumes_;
+    std::vector<IntegralVolume> scaleMotionVolumes_;
+    std::vector<ChannelBuffers> scaleChannelBuffers_;
+    std::vector<FlowBuffers> scaleFlowBuffers_;
+    std::vector<ChannelGroup> channelGroups_;
+    std::vector<std::vector<double>> scaleChannelGroupTimes_;
+    std::vector<std::vector<int>> scaleBlockYOrigins_;
+    std::vector<std::vector<cv::Mat1f>> scaleBlockSumMaps_;
+    std::vector<std::vector<int>> scaleSampleIndices_;
+    std::vector<std::vector<int>> usedFeatureIndices_;
+    std::vector<bool> usedChannels_;
+    std::vector<bool> usedBlockSumMaps_;
+    std::vector<PooledElement> usedPooledElements_;
     std::vector<double> scales_;
     int localWidth_;
     int localHeight_;
@@ -40,6 +146,15 @@ class LocalFeatureExtractor {
     std::size_t storedFeatureBeginT_;
     int nStoredFeatureFrames_;
     bool isEnded_;
+    int nThreads_;
+    bool isPyramidEnabled_;
+    bool isLazyEvaluationEnabled_;
+    bool isDeletionPending_;
+    double motionThreshold_;
+    double skippedSampleRatio_;
+    bool isFlowEnabled_;
+    double flowScale_;
+    DescriptorCache* descriptorCache_;
 
    public:
     LocalFeatureExtractor(){};
@@ -47,10 +162,7 @@ class LocalFeatureExtractor {
     LocalFeatureExtractor(const std::string& videoFilePath, const std::vector<double>& scales,
                           int localWidth, int localHeight, int localDuration, int xBlockSize,
                           int yBlockSize, int tBlockSize, int xStep, int yStep, int tStep)
-            : videoCapture_(videoFilePath),
-              scaleVideos_(scales.size()),
-              scaleChannelFeatures_(scales.size(), MultiChannelFeature(N_CHANNELS_)),
-              scaleChannelIntegrals_(scales.size(), MultiChannelFeature(N_CHANNELS_)),
+            : nextFrameIndex_(0),
               scales_(scales),
               localWidth_(localWidth),
               localHeight_(localHeight),
@@ -63,18 +175,27 @@ class LocalFeatureExtractor {
               tStep_(tStep),
               storedFeatureBeginT_(0),
               nStoredFeatureFrames_(0),
-              isEnded_(false) {
+              isEnded_(false),
+              nThreads_(1),
+              isPyramidEnabled_(false),
+              isLazyEvaluationEnabled_(false),
+              isDeletionPending_(false),
+              motionThreshold_(0.0),
+              skippedSampleRatio_(0.0),
+              isFlowEnabled_(false),
+              flowScale_(1.0),
+              descriptorCache_(nullptr) {
         makeLocalSizeOdd(localWidth_);
         makeLocalSizeOdd(localHeight_);
         makeLocalSizeOdd(localDuration_);
+        allocateBuffers();
+        openVideo(videoFilePath);
     }
 
     LocalFeatureExtractor(const std::vector<double>& scales, int localWidth, int localHeight,
                           int localDuration, int xBlockSize, int yBlockSize, int tBlockSize,
                           int xStep, int yStep, int tStep)
-            : scaleVideos_(scales.size()),
-              scaleChannelFeatures_(scales.size(), MultiChannelFeature(N_CHANNELS_)),
-              scaleChannelIntegrals_(scales.size(), MultiChannelFeature(N_CHANNELS_)),
+            : nextFrameIndex_(0),
               scales_(scales),
               localWidth_(localWidth),
               localHeight_(localHeight),
@@ -87,17 +208,33 @@ class LocalFeatureExtractor {
               tStep_(tStep),
               storedFeatureBeginT_(0),
               nStoredFeatureFrames_(0),
-              isEnded_(false) {
+              isEnded_(false),
+              nThreads_(1),
+              isPyramidEnabled_(false),
+              isLazyEvaluationEnabled_(false),
+              isDeletionPending_(false),
+              motionThreshold_(0.0),
+              skippedSampleRatio_(0.0),
+              isFlowEnabled_(false),
+              flowScale_(1.0),
+              descriptorCache_(nullptr) {
         makeLocalSizeOdd(localWidth_);
         makeLocalSizeOdd(localHeight_);
         makeLocalSizeOdd(localDuration_);
+        allocateBuffers();
     }
 
-    void extractLocalFeatures(std::vector<std::vector<cv::Vec3i>>& scalePoints,
-                              std::vector<std::vector<Descriptor>>& scaleDescriptors);
-    void extractLocalFeatures(const ColorVideo& video,
-                              std::vector<std::vector<cv::Vec3i>>& scalePoints,
-                              std::vector<std::vector<Descriptor>>& scaleDescriptors);
+    /**
+     * videoFilePathから読み込んで抽出するようにする（extractLocalFeatures(scaleBatches)で使う）
+     * RawFrameFileならメモリマップしてそのまま使い，それ以外の動画は別スレッドで復号しながら読む
+     */
+    void openVideo(const std::string& videoFilePath);
+
+    /**
+     * スケールごとの特徴をscaleBatchesに書き込む（前回のバッチを渡せば領域を再利用する）
+     */
+    void extractLocalFeatures(std::vector<DescriptorBatch>& scaleBatches);
+    void extractLocalFeatures(const ColorVideo& video, std::vector<DescriptorBatch>& scaleBatches);
 
     bool isEnded() const { return isEnded_; }
     std::size_t getStoredFeatureBeginT() const { return storedFeatureBeginT_; }
@@ -106,6 +243,80 @@ class LocalFeatureExtractor {
     void setWidth(std::size_t width) { width_ = width; }
     void setHeight(std::size_t height) { height_ = height; }
 
+    /**
+     * スケールごとの処理と密なサンプリングの行ブロックを並列に処理するスレッド数
+     */
+    void setNumberOfThreads(int nThreads) { nThreads_ = nThreads; }
+
+    /**
+     * 各スケールの映像を元の解像度ではなく1つ前のスケールから縮小して作る
+     */
+    void setPyramidEnabled(bool isPyramidEnabled) { isPyramidEnabled_ = isPyramidEnabled; }
+
+    /**
+     * 記述子のチャネル数（登録されたチャネルの組の合計）
+     */
+    int getNumberOfChannels() const;
+
+    /**
+     * オプティカルフローのx成分，y成分の2チャネルを既定のチャネルの後に加える
+     * フローは映像をflowScale倍に縮小して求め，元の大きさに戻して使う
+     * 抽出を始める前（setUsedFeatureIndicesより前）に設定する
+     */
+    void setFlowEnabled(bool isFlowEnabled, double flowScale = 0.5);
+
+    /**
+     * 直前の抽出でのチャネルの組ごとの計算時間（名前とミリ秒，全スケールの合計）
+     */
+    std::vector<std::pair<std::string, double>> getChannelGroupTimes() const;
+
+    /**
+     * 記述子の要素のうち森の分岐で参照されるもの（チャネルごとの次元）だけを計算する
+     * 参照されない要素は0になる（空なら全て計算する）
+     * 抽出を始める前に設定する
+     */
+    void setUsedFeatureIndices(const std::vector<std::vector<int>>& usedFeatureIndices);
+
+    /**
+     * 記述子を抽出時にまとめて計算せず，森が参照したときに積分画像から求める
+     * 未計算の要素はNaNで，求めた値は記述子に書き込まれる
+     * 記述子は次に抽出するまで有効（descriptorCacheに記録する場合は無効）
+     */
+    void setLazyEvaluationEnabled(bool isLazyEvaluationEnabled) {
+        isLazyEvaluationEnabled_ = isLazyEvaluationEnabled;
+    }
+
+    /**
+     * 局所領域内のt微分の絶対値の平均がmotionThreshold未満の点はサンプリングしない
+     * 0以下なら全ての点をサンプリングする
+     * 抽出を始める前に設定する
+     */
+    void setMotionThreshold(double motionThreshold) { motionThreshold_ = motionThreshold; }
+    double getMotionThreshold() const { return motionThreshold_; }
+
+    /**
+     * 直前の抽出で動きが小さいためにサンプリングしなかった点の割合
+     */
+    double getSkippedSampleRatio() const { return skippedSampleRatio_; }
+
+    /**
+     * 抽出した特徴をdescriptorCacheに記録する（nullptrで記録しない）
+     */
+    void setDescriptorCache(DescriptorCache* descriptorCache) {
+        descriptorCache_ = descriptorCache;
+    }
+
+    /**
+     * 特徴抽出のパラメータを表す文字列（投票のキャッシュのキー）
+     */
+    std::string getParameterKey() const;
+
+    /**
+     * 記述子の内容を表す文字列（getParameterKeyに計算する要素の指定を加えたもの）
+     * 記述子のキャッシュのキーに使う
+     */
+    std::string getDescriptorKey() const;
+
     void visualizeDenseFeature(const std::vector<cv::Vec3i>& points,
                                const std::vector<Descriptor>& features, int width, int height,
                                int duration) const;
@@ -116,40 +327,60 @@ class LocalFeatureExtractor {
 
    private:
     void makeLocalSizeOdd(int& size) const;
+    void allocateBuffers();
+    void registerChannelGroup(const std::string& name, int nChannels, int volumeType,
+                              double cost, ChannelFunction compute);
+    bool readFrame(cv::Mat1b& frame);
     void readOriginalScaleVideo();
     void inputNewScaleVideo(const ColorVideo& video);
-    void extraction(std::vector<std::vector<cv::Vec3i>>& scalePoints,
-                    std::vector<std::vector<Descriptor>>& scaleDescriptors);
+    void extraction(std::vector<DescriptorBatch>& scaleBatches);
     void generateScaledVideos();
-    void denseSampling(int scaleIndex, std::vector<cv::Vec3i>& points,
-                       std::vector<Descriptor>& descriptors) const;
+    void getSamplingGridSize(int scaleIndex, int& nXPoints, int& nYPoints) const;
+
+    /**
+     * サンプリング格子の点のうち，動きの大きいものの番号をscaleSampleIndices_に求める
+     */
+    void selectSamples(int scaleIndex);
+    void prepareBlockSumMaps(int scaleIndex, int& nXOrigins);
+
+    /**
+     * ブロック和のマップ（チャネル，tブロックごと）のうち，
+     * blockYOriginsのoriginBegin番目からoriginEnd番目までの行を求める
+     * map(y, x)は左上が(tブロックの先頭, y, x)のブロックの平均
+     */
+    void computeBlockSums(int scaleIndex, int originBegin, int originEnd, int nXOrigins);
+
+    /**
+     * 選んだ点のsampleBegin番目からsampleEnd番目までの特徴をブロック和のマップから集め，
+     * 確保済みのbatchの対応する位置に書き込む（遅延評価ではNaNで埋める）
+     */
+    void denseSampling(int scaleIndex, int sampleBegin, int sampleEnd,
+                       DescriptorBatch& batch) const;
+
+    /**
+     * 左上が(y, x)の局所領域の記述子のうち，channelIndexチャネルのelementIndex番目の要素
+     */
+    float computePooledElement(int scaleIndex, int channelIndex, int elementIndex, int y,
+                               int x) const;
     void deleteOldData();
 
-    void extractFeatures(int scaleIndex, int beginFrame, int endFrame);
-    void extractIntensityFeature(Feature& features, Feature& integrals, int scaleIndex,
-                                 int beginFrame, int endFrame);
-    void extractXDerivativeFeature(Feature& features, Feature& integrals, int scaleIndex,
-                                   int beginFrame, int endFrame);
-    void extractYDerivativeFeature(Feature& features, Feature& integrals, int scaleIndex,
-                                   int beginFrame, int endFrame);
-    void extractTDerivativeFeature(Feature& features, Feature& integrals, int scaleIndex,
-                                   int beginFrame, int endFrame);
-    void extractFlowFeature(Feature& xFeatures, Feature& yFeatures, Feature& xIntegrals,
-                            Feature& yIntegrals, int scaleIndex, int beginFrame, int endFrame);
-
-    void extractIntensityFeature(const cv::Mat1b& frame, cv::Mat1f& feature) const;
-    void extractXDerivativeFeature(const cv::Mat1b& frame, cv::Mat1f& feature) const;
-    void extractYDerivativeFeature(const cv::Mat1b& frame, cv::Mat1f& feature) const;
-    void extractTDerivativeFeature(const cv::Mat1b& prev, const cv::Mat1b& next,
-                                   cv::Mat1f& feature) const;
-    void extractFlowFeature(const cv::Mat1b& prev, const cv::Mat1b& next,
-                            std::vector<cv::Mat1f>& features) const;
-
-    void getDescriptor(int scaleIndex, const cv::Vec3i& topLeftPoint, int width, int height,
-                       Descriptor& descriptor) const;
-    void pooling(int scaleIndex, int blockIndex, int nPooledElements, int nBlockElements,
-                 int xBegin, int xEnd, int yBegin, int yEnd, int tBegin, int tEnd,
-                 Descriptor& pooledDescriptor) const;
+    void extractFeatures(int scaleIndex, int groupIndex, int beginFrame, int endFrame);
+    void computeGradientChannels(int scaleIndex, const cv::Mat1b& prev, const cv::Mat1b& next,
+                                 const std::vector<cv::Mat>& previousVolumes,
+                                 std::vector<cv::Mat>& volumes);
+    void computeFlowChannels(int scaleIndex, const cv::Mat1b& prev, const cv::Mat1b& next,
+                             const std::vector<cv::Mat>& previousVolumes,
+                             std::vector<cv::Mat>& volumes);
+
+    /**
+     * 輝度，x微分，y微分，t微分の4チャネルを1パスで計算し，
+     * 積分画像をpreviousVolumesに足したものをvolumesに書き込む
+     * volumesが1つ多ければ，最後にt微分の絶対値（動きの大きさ）の積分画像も書き込む
+     * 値はcv::Sobel（ksize 3，BORDER_REFLECT_101）と同じ整数で，積分画像はuint32の剰余で持つ
+     */
+    void extractChannelIntegrals(const cv::Mat1b& prev, const cv::Mat1b& next,
+                                 const std::vector<cv::Mat>& previousVolumes,
+                                 std::vector<cv::Mat>& volumes, ChannelBuffers& buffers) const;
 };
 }
 }
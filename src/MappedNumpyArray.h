@@ -0,0 +1,137 @@
+#ifndef MAPPED_NUMPY_ARRAY
+#define MAPPED_NUMPY_ARRAY
+
+#include <boost/iostreams/device/mapped_file.hpp>
+
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace nuisken {
+namespace io {
+
+template <typename T>
+struct NumpyDescriptor;
+
+template <>
+struct NumpyDescriptor<float> {
+    static std::string get() { return "<f4"; }
+};
+
+template <>
+struct NumpyDescriptor<int> {
+    static std::string get() { return "<i4"; }
+};
+
+template <>
+struct NumpyDescriptor<unsigned char> {
+    static std::string get() { return "|u1"; }
+};
+
+/**
+ * メモリマップした.npyファイル（C order）
+ * 配列の要素はコピーせずにファイルを直接参照する
+ */
+template <typename T>
+class MappedNumpyArray {
+   private:
+    std::shared_ptr<boost::iostreams::mapped_file_source> file_;
+    const T* data_;
+    std::vector<int> shape_;
+
+   public:
+    MappedNumpyArray() : data_(nullptr){};
+
+    explicit MappedNumpyArray(const std::string& filePath)
+            : file_(std::make_shared<boost::iostreams::mapped_file_source>(filePath)),
+              data_(nullptr) {
+        parseHeader(filePath);
+    }
+
+    const T* data() const { return data_; }
+
+    const std::vector<int>& getShape() const { return shape_; }
+
+    std::size_t size() const {
+        return std::accumulate(std::begin(shape_), std::end(shape_), std::size_t(1),
+                               std::multiplies<std::size_t>());
+    }
+
+    /**
+     * offset番目の要素を指し，ファイルの所有権を共有するポインタ
+     */
+    std::shared_ptr<const T> getSharedData(std::size_t offset) const {
+        return std::shared_ptr<const T>(file_, data_ + offset);
+    }
+
+   private:
+    void parseHeader(const std::string& filePath) {
+        const char* begin = file_->data();
+        std::size_t fileSize = file_->size();
+        if (fileSize < 10 || std::memcmp(begin, "\x93NUMPY", 6) != 0) {
+            throw std::runtime_error("invalid npy file: " + filePath);
+        }
+
+        int majorVersion = static_cast<unsigned char>(begin[6]);
+        std::size_t headerLength;
+        std::size_t headerBegin;
+        if (majorVersion == 1) {
+            headerLength = static_cast<unsigned char>(begin[8]) |
+                           (static_cast<unsigned char>(begin[9]) << 8);
+            headerBegin = 10;
+        } else {
+            if (fileSize < 12) {
+                throw std::runtime_error("invalid npy file: " + filePath);
+            }
+            std::uint32_t length;
+            std::memcpy(&length, begin + 8, sizeof(length));
+            headerLength = length;
+            headerBegin = 12;
+        }
+        if (headerBegin + headerLength > fileSize) {
+            throw std::runtime_error("invalid npy file: " + filePath);
+        }
+        std::string header(begin + headerBegin, headerLength);
+
+        if (header.find("'" + NumpyDescriptor<T>::get() + "'") == std::string::npos) {
+            throw std::runtime_error("unexpected npy dtype: " + filePath);
+        }
+        if (header.find("'fortran_order': True") != std::string::npos) {
+            throw std::runtime_error("fortran order npy is not supported: " + filePath);
+        }
+
+        auto shapeBegin = header.find('(', header.find("'shape'"));
+        auto shapeEnd = header.find(')', shapeBegin);
+        if (shapeBegin == std::string::npos || shapeEnd == std::string::npos) {
+            throw std::runtime_error("invalid npy shape: " + filePath);
+        }
+        std::string shapeString = header.substr(shapeBegin + 1, shapeEnd - shapeBegin - 1);
+        std::size_t position = 0;
+        while (position < shapeString.size()) {
+            auto next = shapeString.find(',', position);
+            if (next == std::string::npos) {
+                next = shapeString.size();
+            }
+            std::string dimension = shapeString.substr(position, next - position);
+            if (dimension.find_first_of("0123456789") != std::string::npos) {
+                shape_.push_back(std::stoi(dimension));
+            }
+            position = next + 1;
+        }
+
+        std::size_t dataBegin = headerBegin + headerLength;
+        if (dataBegin + size() * sizeof(T) > fileSize) {
+            throw std::runtime_error("truncated npy file: " + filePath);
+        }
+        data_ = reinterpret_cast<const T*>(begin + dataBegin);
+    }
+};
+}
+}
+
+#endif
@@ -21,6 +21,12 @@ namespace randomforests {
  */
 template <class Type>
 class RandomForests {
+   public:
+    /**
+     * 決定木の保存形式
+     */
+    enum TreeFileFormat { CSV, BINARY, COMPRESSED_BINARY };
+
    private:
     using FeaturePtr = std::shared_ptr<typename Type::FeatureType>;
     using FeatureRawPtr = typename Type::FeatureType*;
@@ -58,6 +64,8 @@ class RandomForests {
 
     int getNumberOfTrees() const { return forests.size(); }
 
+    const DecisionTree<Type>& getTree(int index) const { return forests.at(index); }
+
     void RandomForests::setParameters(const TreeParameters& parameters) {
         this->parameters = parameters;
 
@@ -70,8 +78,14 @@ class RandomForests {
 
     void train(const std::vector<FeaturePtr>& features, int maxNumberOfThreads = 1);
     void match(const FeaturePtr& feature, std::vector<LeafPtr>& leavesData) const;
-    void save(const std::string& directoryPath) const;
-    void load(const std::string& directoryPath);
+    void save(const std::string& directoryPath, TreeFileFormat format = CSV) const;
+
+    /**
+     * 決定木を並列に読み込む
+     * tree*.binがあればバイナリ形式，なければCSV形式の木を読み込む
+     * isLazyがtrueの場合，葉のデータは最初にマッチした時に解析する
+     */
+    void load(const std::string& directoryPath, int maxNumberOfThreads = 1, bool isLazy = false);
 
    private:
     void selectBootstrapData(const std::vector<FeaturePtr>& features,
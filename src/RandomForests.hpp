@@ -5,7 +5,11 @@
 #include "RandomGenerator.h"
 #include "ThreadProcess.h"
 
+#include <algorithm>
 #include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <stdexcept>
 
 namespace nuisken {
 namespace randomforests {
@@ -124,41 +128,106 @@ void RandomForests<Type>::match(const FeaturePtr& feature, std::vector<LeafPtr>&
 }
 
 template <class Type>
-void RandomForests<Type>::save(const std::string& directoryPath) const {
+void RandomForests<Type>::save(const std::string& directoryPath, TreeFileFormat format) const {
     std::string parametersFilePath = directoryPath + "TreeParameters.xml";
     parameters.save(parametersFilePath);
 
     for (int i = 0; i < forests.size(); ++i) {
-        std::string filePath = directoryPath + "tree" + std::to_string(i) + ".csv";
-        std::ofstream treeStream(filePath);
-        forests.at(i).save(treeStream);
+        if (format == CSV) {
+            std::string filePath = directoryPath + "tree" + std::to_string(i) + ".csv";
+            std::ofstream treeStream(filePath);
+            forests.at(i).save(treeStream);
+        } else {
+            std::string filePath = directoryPath + "tree" + std::to_string(i) + ".bin";
+            std::ofstream treeStream(filePath, std::ios::binary);
+            forests.at(i).saveBinary(treeStream, format == COMPRESSED_BINARY);
+        }
     }
 }
 
 template <class Type>
-void RandomForests<Type>::load(const std::string& directoryPath) {
+void RandomForests<Type>::load(const std::string& directoryPath, int maxNumberOfThreads,
+                               bool isLazy) {
     std::string parametersFilePath = directoryPath + "TreeParameters.xml";
     parameters.load(parametersFilePath);
 
-    std::vector<std::string> treeFilePaths;
+    std::vector<std::pair<int, std::string>> csvTreeFiles;
+    std::vector<std::pair<int, std::string>> binaryTreeFiles;
     std::tr2::sys::path directory(directoryPath);
     std::tr2::sys::directory_iterator end;
     for (std::tr2::sys::directory_iterator itr(directory); itr != end; ++itr) {
-        auto index = itr->path().filename().string().find("tree");
+        std::string fileName = itr->path().filename().string();
+        auto index = fileName.find("tree");
         if (index != std::string::npos) {
-            treeFilePaths.push_back(directory.string() + itr->path().filename().string());
+            int treeIndex = std::atoi(fileName.c_str() + index + 4);
+            if (itr->path().extension().string() == ".bin") {
+                binaryTreeFiles.emplace_back(treeIndex, directory.string() + fileName);
+            } else {
+                csvTreeFiles.emplace_back(treeIndex, directory.string() + fileName);
+            }
         }
     }
-
-    forests.resize(treeFilePaths.size());
+    //形式の違う木が混ざっていると古い木を読みかねないので読まない
+    if (!binaryTreeFiles.empty() && !csvTreeFiles.empty()) {
+        throw std::runtime_error("both csv and binary tree files exist in " + directoryPath);
+    }
+    bool isBinary = !binaryTreeFiles.empty();
+    auto& treeFiles = isBinary ? binaryTreeFiles : csvTreeFiles;
+    std::sort(std::begin(treeFiles), std::end(treeFiles));
+
+    forests.resize(treeFiles.size());
+    std::vector<long long> loadTimes(treeFiles.size());
+    using LoadTask = std::function<void()>;
+    std::queue<LoadTask> tasks;
     for (int i = 0; i < forests.size(); ++i) {
-        std::cout << "load tree " << i << std::endl;
-        forests.at(i).setParameters(parameters);
-        forests.at(i).setType(type);
+        tasks.push([this, i, isLazy, isBinary, &treeFiles, &loadTimes]() {
+            auto begin = std::chrono::system_clock::now();
+            forests.at(i).setParameters(parameters);
+            forests.at(i).setType(type);
+
+            if (isBinary) {
+                std::ifstream treeStream(treeFiles.at(i).second, std::ios::binary);
+                forests.at(i).loadBinary(treeStream);
+            } else {
+                std::ifstream treeStream(treeFiles.at(i).second);
+                forests.at(i).load(treeStream, isLazy);
+            }
+            auto end = std::chrono::system_clock::now();
+            loadTimes.at(i) =
+                    std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count();
+        });
+    }
+
+    auto begin = std::chrono::system_clock::now();
+    thread::threadProcess(tasks, maxNumberOfThreads);
 
-        std::ifstream treeSteram(treeFilePaths.at(i));
-        forests.at(i).load(treeSteram);
+    //バイナリ形式の葉は全ての木をまとめて並列に展開する
+    if (isBinary && !isLazy) {
+        std::vector<const TreeNode<Type>*> leaves;
+        for (const auto& tree : forests) {
+            tree.collectLeaves(leaves);
+        }
+
+        const std::size_t LEAVES_PER_TASK = 256;
+        for (std::size_t first = 0; first < leaves.size(); first += LEAVES_PER_TASK) {
+            std::size_t last = std::min(first + LEAVES_PER_TASK, leaves.size());
+            tasks.push([first, last, &leaves]() {
+                for (std::size_t i = first; i < last; ++i) {
+                    leaves.at(i)->loadLeafData();
+                }
+            });
+        }
+        thread::threadProcess(tasks, maxNumberOfThreads);
+    }
+    auto end = std::chrono::system_clock::now();
+
+    for (int i = 0; i < forests.size(); ++i) {
+        std::cout << "load tree " << i << ": " << loadTimes.at(i) << " ms" << std::endl;
     }
+    std::cout << "load forests: "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count()
+              << " ms (" << forests.size() << " trees, " << maxNumberOfThreads << " threads"
+              << (isBinary ? ", binary" : "") << (isLazy ? ", lazy" : "") << ")" << std::endl;
 }
 }
 }
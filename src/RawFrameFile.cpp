@@ -0,0 +1,125 @@
+#include "RawFrameFile.h"
+#include "AsyncFrameReader.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+namespace nuisken {
+namespace io {
+
+namespace {
+
+template <typename T>
+void writeValue(std::ofstream& outputStream, T value) {
+    outputStream.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template <typename T>
+T readValue(const char*& cursor) {
+    T value;
+    std::memcpy(&value, cursor, sizeof(T));
+    cursor += sizeof(T);
+    return value;
+}
+}
+
+const char RawFrameFile::MAGIC_[4] = {'H', 'F', 'G', 'R'};
+const std::uint32_t RawFrameFile::VERSION_ = 2;
+// magic, version, width, height, フレーム数(uint64), fps(double)
+const std::size_t RawFrameFile::HEADER_SIZE_ = 32;
+
+bool RawFrameFile::isRawFrameFile(const std::string& filePath) {
+    std::ifstream inputStream(filePath, std::ios::binary);
+    char magic[sizeof(MAGIC_)];
+    if (!inputStream.read(magic, sizeof(magic))) {
+        return false;
+    }
+    return std::memcmp(magic, MAGIC_, sizeof(MAGIC_)) == 0;
+}
+
+void RawFrameFile::write(const std::string& videoFilePath, const std::string& rawFilePath) {
+    AsyncFrameReader reader(videoFilePath);
+    std::string temporaryFilePath = rawFilePath + ".tmp";
+    std::ofstream outputStream(temporaryFilePath, std::ios::binary);
+
+    // 幅，高さ，フレーム数は最後に書き直す
+    outputStream.write(MAGIC_, sizeof(MAGIC_));
+    writeValue<std::uint32_t>(outputStream, VERSION_);
+    writeValue<std::uint32_t>(outputStream, 0);
+    writeValue<std::uint32_t>(outputStream, 0);
+    writeValue<std::uint64_t>(outputStream, 0);
+    writeValue<double>(outputStream, reader.getFps());
+
+    cv::Mat1b frame;
+    int width = 0;
+    int height = 0;
+    std::uint64_t nFrames = 0;
+    while (reader.read(frame)) {
+        if (nFrames == 0) {
+            width = frame.cols;
+            height = frame.rows;
+        } else if (frame.cols != width || frame.rows != height) {
+            outputStream.close();
+            std::remove(temporaryFilePath.c_str());
+            throw std::runtime_error("frame size changed in " + videoFilePath);
+        }
+        for (int y = 0; y < height; ++y) {
+            outputStream.write(reinterpret_cast<const char*>(frame.ptr<uchar>(y)), width);
+        }
+        ++nFrames;
+    }
+    if (nFrames == 0) {
+        outputStream.close();
+        std::remove(temporaryFilePath.c_str());
+        throw std::runtime_error("no frames in " + videoFilePath);
+    }
+
+    outputStream.seekp(sizeof(MAGIC_) + sizeof(std::uint32_t));
+    writeValue<std::uint32_t>(outputStream, width);
+    writeValue<std::uint32_t>(outputStream, height);
+    writeValue<std::uint64_t>(outputStream, nFrames);
+    bool isSucceeded = outputStream.good();
+    outputStream.close();
+    if (isSucceeded) {
+        std::remove(rawFilePath.c_str());
+        isSucceeded = std::rename(temporaryFilePath.c_str(), rawFilePath.c_str()) == 0;
+    }
+    if (!isSucceeded) {
+        std::remove(temporaryFilePath.c_str());
+        throw std::runtime_error("failed to write " + rawFilePath);
+    }
+}
+
+bool RawFrameFile::open(const std::string& filePath) {
+    if (!isRawFrameFile(filePath)) {
+        return false;
+    }
+
+    mappedFile_.open(filePath);
+    if (mappedFile_.size() < HEADER_SIZE_) {
+        mappedFile_.close();
+        return false;
+    }
+    const char* cursor = mappedFile_.data() + sizeof(MAGIC_);
+    std::uint32_t version = readValue<std::uint32_t>(cursor);
+    width_ = readValue<std::uint32_t>(cursor);
+    height_ = readValue<std::uint32_t>(cursor);
+    nFrames_ = readValue<std::uint64_t>(cursor);
+    fps_ = readValue<double>(cursor);
+    std::size_t frameSize = static_cast<std::size_t>(width_) * height_;
+    if (version != VERSION_ || mappedFile_.size() < HEADER_SIZE_ + frameSize * nFrames_) {
+        mappedFile_.close();
+        return false;
+    }
+    return true;
+}
+
+cv::Mat1b RawFrameFile::getFrame(int index) const {
+    std::size_t frameSize = static_cast<std::size_t>(width_) * height_;
+    const char* data = mappedFile_.data() + HEADER_SIZE_ + frameSize * index;
+    return cv::Mat1b(height_, width_, reinterpret_cast<uchar*>(const_cast<char*>(data)));
+}
+}
+}
@@ -0,0 +1,65 @@
+#ifndef RAW_FRAME_FILE
+#define RAW_FRAME_FILE
+
+#include <opencv2/core/core.hpp>
+
+#include <boost/iostreams/device/mapped_file.hpp>
+
+#include <cstdint>
+#include <string>
+
+namespace nuisken {
+namespace io {
+
+/**
+ * 復号済みのグレースケールのフレームを並べたファイル
+ * ヘッダ（幅，高さ，フレーム数，fps）の後に各フレームの画素を隙間なく並べる
+ * メモリマップして読むので，フレームはコピーせずにファイルを直接参照する
+ */
+class RawFrameFile {
+   private:
+    static const char MAGIC_[4];
+    static const std::uint32_t VERSION_;
+    static const std::size_t HEADER_SIZE_;
+
+    boost::iostreams::mapped_file_source mappedFile_;
+    int width_;
+    int height_;
+    int nFrames_;
+    double fps_;
+
+   public:
+    RawFrameFile() : width_(0), height_(0), nFrames_(0), fps_(0.0){};
+
+    /**
+     * filePathがこの形式のファイルならtrue
+     */
+    static bool isRawFrameFile(const std::string& filePath);
+
+    /**
+     * videoFilePathの動画を全て復号してrawFilePathに書き出す
+     * 書き出し中は一時ファイルに書くので，途中で終了したファイルは使われない
+     */
+    static void write(const std::string& videoFilePath, const std::string& rawFilePath);
+
+    /**
+     * 不正なファイルならfalse
+     */
+    bool open(const std::string& filePath);
+    void close() { mappedFile_.close(); }
+
+    int getWidth() const { return width_; }
+    int getHeight() const { return height_; }
+    int getNumberOfFrames() const { return nFrames_; }
+    double getFps() const { return fps_; }
+
+    /**
+     * index番目のフレーム（ファイルを直接参照するので書き込んではいけない）
+     * close()するまで有効
+     */
+    cv::Mat1b getFrame(int index) const;
+};
+}
+}
+
+#endif
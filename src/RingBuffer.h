@@ -0,0 +1,80 @@
+#ifndef RING_BUFFER
+#define RING_BUFFER
+
+#include <algorithm>
+#include <vector>
+
+namespace nuisken {
+namespace houghforests {
+
+/**
+ * 要素を使い回す循環バッファ
+ * 先頭から捨てた要素もそのまま残り，次のpushBackで再利用される
+ * （cv::Matならcreateやcopy先にすればメモリ確保が起きない）
+ * 添字は論理的な位置（0が先頭）
+ */
+template <typename T>
+class RingBuffer {
+   private:
+    std::vector<T> elements_;
+    int head_;
+    int size_;
+
+   public:
+    RingBuffer() : head_(0), size_(0){};
+    RingBuffer(int capacity) : elements_(capacity), head_(0), size_(0){};
+
+    /**
+     * 末尾に要素を1つ追加し，その要素（前回使われていた値が残っている）を返す
+     * 容量が足りないときだけ広げる
+     */
+    T& pushBack() {
+        if (size_ == capacity()) {
+            std::rotate(std::begin(elements_), std::begin(elements_) + head_, std::end(elements_));
+            head_ = 0;
+            elements_.emplace_back();
+        }
+        ++size_;
+        return back();
+    }
+
+    void popFront(int n = 1) {
+        if (n == 0) {
+            return;
+        }
+        head_ = (head_ + n) % elements_.size();
+        size_ -= n;
+    }
+
+    /**
+     * 末尾の要素を1つ捨てる（pushBackで追加した要素を使わなかったとき）
+     */
+    void popBack() { --size_; }
+
+    /**
+     * 末尾のn個以外を捨てる
+     */
+    void keepBack(int n) { popFront(size_ - n); }
+
+    void clear() {
+        head_ = 0;
+        size_ = 0;
+    }
+
+    T& operator[](int index) { return elements_[(head_ + index) % elements_.size()]; }
+    const T& operator[](int index) const {
+        return elements_[(head_ + index) % elements_.size()];
+    }
+    T& front() { return (*this)[0]; }
+    const T& front() const { return (*this)[0]; }
+    T& back() { return (*this)[size_ - 1]; }
+    const T& back() const { return (*this)[size_ - 1]; }
+
+    int size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    int capacity() const { return elements_.size(); }
+};
+}
+}
+
+#endif
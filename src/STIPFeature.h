@@ -4,12 +4,23 @@
 #include <Eigen/Core>
 #include <opencv2/core/core.hpp>
 
+#include <cmath>
 #include <memory>
 #include <vector>
 
 namespace nuisken {
 namespace storage {
 
+/**
+ * 特徴の値を必要になったときに計算する（遅延評価）
+ */
+class FeatureValueSource {
+   public:
+    virtual ~FeatureValueSource(){};
+
+    virtual float computeFeatureValue(int sourceIndex, int featureChannel, int index) const = 0;
+};
+
 /**
  * 時空間局所特徴のパッチ
  * Spatio temporal local feature
@@ -21,6 +32,27 @@ class STIPFeature {
      */
     std::vector<Eigen::MatrixXf> featureVectors;
 
+    /**
+     * 外部の連続した配列を参照する場合の特徴の先頭
+     * （配列の所有者と所有権を共有する）
+     */
+    std::shared_ptr<const float> featureValues;
+
+    /**
+     * featureValues内の各チャネルの開始位置（末尾に総次元数を持つ）
+     */
+    std::shared_ptr<const std::vector<int>> channelOffsets;
+
+    /**
+     * featureValuesのうちNaNの値をここから求めて書き込む（nullptrなら全て計算済み）
+     */
+    std::shared_ptr<const FeatureValueSource> valueSource;
+
+    /**
+     * valueSource内でのこの特徴の番号
+     */
+    int sourceIndex;
+
     /**
      * パッチの中心座標
      */
@@ -55,6 +87,24 @@ class STIPFeature {
                 const cv::Vec3i& displacementVector, const std::pair<double, double>& scales,
                 int classLabel, int viewLabel = 0)
             : featureVectors(featureVectors),
+              sourceIndex(0),
+              centerPoint(centerPoint),
+              displacementVector(displacementVector),
+              spatialScale(scales.first),
+              temporalScale(scales.second),
+              classLabel(classLabel),
+              viewLabel(viewLabel){};
+
+    /**
+     * 特徴をコピーせずに外部の配列を参照する
+     */
+    STIPFeature(const std::shared_ptr<const float>& featureValues,
+                const std::shared_ptr<const std::vector<int>>& channelOffsets,
+                const cv::Vec3i& centerPoint, const cv::Vec3i& displacementVector,
+                const std::pair<double, double>& scales, int classLabel, int viewLabel = 0)
+            : featureValues(featureValues),
+              channelOffsets(channelOffsets),
+              sourceIndex(0),
               centerPoint(centerPoint),
               displacementVector(displacementVector),
               spatialScale(scales.first),
@@ -63,10 +113,36 @@ class STIPFeature {
               viewLabel(viewLabel){};
 
     double getFeatureValue(int index, int featureChannel) const {
+        if (featureValues) {
+            int offset = (*channelOffsets)[featureChannel] + index;
+            float value = featureValues.get()[offset];
+            if (valueSource && std::isnan(value)) {
+                // 計算した値は次に参照されたときのために残しておく
+                value = valueSource->computeFeatureValue(sourceIndex, featureChannel, index);
+                const_cast<float*>(featureValues.get())[offset] = value;
+            }
+            return value;
+        }
         return featureVectors.at(featureChannel).coeff(0, index);
     }
 
     std::vector<Eigen::MatrixXf> getFeatureVectors() const {
+        if (featureValues) {
+            std::vector<Eigen::MatrixXf> tempFeatureVectors(getNumberOfFeatureChannels());
+            for (int channel = 0; channel < tempFeatureVectors.size(); ++channel) {
+                int nDimensions = getNumberOfFeatureDimensions(channel);
+                if (valueSource) {
+                    tempFeatureVectors.at(channel).resize(1, nDimensions);
+                    for (int index = 0; index < nDimensions; ++index) {
+                        tempFeatureVectors.at(channel)(0, index) = getFeatureValue(index, channel);
+                    }
+                    continue;
+                }
+                tempFeatureVectors.at(channel) = Eigen::Map<const Eigen::MatrixXf>(
+                        featureValues.get() + channelOffsets->at(channel), 1, nDimensions);
+            }
+            return tempFeatureVectors;
+        }
         auto tempFeatureVectors = this->featureVectors;
         return tempFeatureVectors;
     }
@@ -81,9 +157,17 @@ class STIPFeature {
 
     int getClassLabel() const { return classLabel; }
 
-    int getNumberOfFeatureChannels() const { return featureVectors.size(); }
+    int getNumberOfFeatureChannels() const {
+        if (featureValues) {
+            return channelOffsets->size() - 1;
+        }
+        return featureVectors.size();
+    }
 
     int getNumberOfFeatureDimensions(int featureChannel) const {
+        if (featureValues) {
+            return channelOffsets->at(featureChannel + 1) - channelOffsets->at(featureChannel);
+        }
         return featureVectors.at(featureChannel).cols();
     }
 
@@ -93,6 +177,19 @@ class STIPFeature {
 
     void setFeatureVectors(const std::vector<Eigen::MatrixXf>& featureVectors) {
         this->featureVectors = featureVectors;
+        featureValues.reset();
+        channelOffsets.reset();
+        valueSource.reset();
+    }
+
+    /**
+     * 参照している配列の未計算の値（NaN）をvalueSourceで求めるようにする
+     * 配列は書き換え可能でなければならない
+     */
+    void setValueSource(const std::shared_ptr<const FeatureValueSource>& valueSource,
+                        int sourceIndex) {
+        this->valueSource = valueSource;
+        this->sourceIndex = sourceIndex;
     }
 
     void setCenterPoint(const cv::Vec3i& centerPoint) { this->centerPoint = centerPoint; }
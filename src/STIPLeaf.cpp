@@ -1,9 +1,13 @@
 ﻿#include "STIPLeaf.h"
+#include "BinaryCoding.h"
 #include "Utils.h"
 
 #include <opencv2/core/core.hpp>
 #include <opencv2/highgui/highgui.hpp>
 
+#include <algorithm>
+#include <numeric>
+
 namespace nuisken {
 namespace randomforests {
 
@@ -46,5 +50,118 @@ void STIPLeaf::load(std::queue<std::string>& nodeElements) {
         featureInfo.at(i) = aFeatureInfo;
     }
 }
+
+void STIPLeaf::encode(std::string& buffer) const {
+    //スケールの組み合わせは葉ごとにほとんど同じなので表にまとめる
+    std::vector<std::pair<double, double>> scales;
+    std::vector<int> scaleIndices(featureInfo.size());
+    bool hasSameIndex = true;
+    for (int i = 0; i < featureInfo.size(); ++i) {
+        auto scale = std::make_pair(featureInfo.at(i).getSpatialScale(),
+                                    featureInfo.at(i).getTemporalScale());
+        auto it = std::find(std::begin(scales), std::end(scales), scale);
+        scaleIndices.at(i) = std::distance(std::begin(scales), it);
+        if (it == std::end(scales)) {
+            scales.push_back(scale);
+        }
+        if (featureInfo.at(i).getIndex() != featureInfo.front().getIndex()) {
+            hasSameIndex = false;
+        }
+    }
+
+    std::vector<int> order(featureInfo.size());
+    std::iota(std::begin(order), std::end(order), 0);
+    std::sort(std::begin(order), std::end(order), [this](int a, int b) {
+        const auto& infoA = featureInfo.at(a);
+        const auto& infoB = featureInfo.at(b);
+        if (infoA.getClassLabel() != infoB.getClassLabel()) {
+            return infoA.getClassLabel() < infoB.getClassLabel();
+        }
+        cv::Vec3i vectorA = infoA.getDisplacementVector();
+        cv::Vec3i vectorB = infoB.getDisplacementVector();
+        return std::lexicographical_compare(vectorA.val, vectorA.val + 3, vectorB.val,
+                                            vectorB.val + 3);
+    });
+
+    coding::writeVarint(buffer, featureInfo.size());
+    coding::writeVarint(buffer, scales.size());
+    for (const auto& scale : scales) {
+        coding::writeDouble(buffer, scale.first);
+        coding::writeDouble(buffer, scale.second);
+    }
+    coding::writeVarint(buffer, hasSameIndex);
+    if (hasSameIndex && !featureInfo.empty()) {
+        coding::writeSignedVarint(buffer, featureInfo.front().getIndex());
+    }
+
+    auto begin = std::begin(order);
+    while (begin != std::end(order)) {
+        int classLabel = featureInfo.at(*begin).getClassLabel();
+        auto end = std::find_if(begin, std::end(order), [this, classLabel](int i) {
+            return featureInfo.at(i).getClassLabel() != classLabel;
+        });
+        coding::writeSignedVarint(buffer, classLabel);
+        coding::writeVarint(buffer, std::distance(begin, end));
+
+        cv::Vec3i previous(0, 0, 0);
+        for (auto it = begin; it != end; ++it) {
+            cv::Vec3i displacementVector = featureInfo.at(*it).getDisplacementVector();
+            coding::writeSignedVarint(buffer, displacementVector[T] - previous[T]);
+            coding::writeSignedVarint(buffer, displacementVector[Y] - previous[Y]);
+            coding::writeSignedVarint(buffer, displacementVector[X] - previous[X]);
+            previous = displacementVector;
+
+            if (!hasSameIndex) {
+                coding::writeSignedVarint(buffer, featureInfo.at(*it).getIndex());
+            }
+            if (scales.size() > 1) {
+                coding::writeVarint(buffer, scaleIndices.at(*it));
+            }
+        }
+        begin = end;
+    }
+}
+
+void STIPLeaf::decode(const char* begin, const char* end) {
+    const char* cursor = begin;
+    auto numberOfFeatureInfo = coding::readVarint(cursor, end);
+    std::vector<std::pair<double, double>> scales(coding::readVarint(cursor, end));
+    for (auto& scale : scales) {
+        scale.first = coding::readDouble(cursor, end);
+        scale.second = coding::readDouble(cursor, end);
+    }
+    bool hasSameIndex = coding::readVarint(cursor, end) != 0;
+    int index = 0;
+    if (hasSameIndex && numberOfFeatureInfo > 0) {
+        index = coding::readSignedVarint(cursor, end);
+    }
+
+    featureInfo.clear();
+    featureInfo.reserve(numberOfFeatureInfo);
+    while (featureInfo.size() < numberOfFeatureInfo) {
+        int classLabel = coding::readSignedVarint(cursor, end);
+        auto numberOfClassFeatureInfo = coding::readVarint(cursor, end);
+        if (numberOfClassFeatureInfo == 0) {
+            throw std::runtime_error("invalid leaf data");
+        }
+
+        cv::Vec3i displacementVector(0, 0, 0);
+        for (std::uint64_t i = 0; i < numberOfClassFeatureInfo; ++i) {
+            displacementVector[T] += coding::readSignedVarint(cursor, end);
+            displacementVector[Y] += coding::readSignedVarint(cursor, end);
+            displacementVector[X] += coding::readSignedVarint(cursor, end);
+
+            if (!hasSameIndex) {
+                index = coding::readSignedVarint(cursor, end);
+            }
+            int scaleIndex = 0;
+            if (scales.size() > 1) {
+                scaleIndex = coding::readVarint(cursor, end);
+            }
+            featureInfo.emplace_back(index, classLabel, scales.at(scaleIndex).first,
+                                     scales.at(scaleIndex).second, displacementVector);
+        }
+    }
+}
+}
 }
-}
\ No newline at end of file
@@ -9,6 +9,7 @@
 #include <fstream>
 #include <memory>
 #include <queue>
+#include <string>
 #include <tuple>
 #include <vector>
 
@@ -32,7 +33,7 @@ class STIPLeaf {
     STIPLeaf(){};
     STIPLeaf(const std::vector<FeatureInfo>& featureInfo) : featureInfo(featureInfo) {}
 
-    std::vector<FeatureInfo> getFeatureInfo() const { return featureInfo; }
+    const std::vector<FeatureInfo>& getFeatureInfo() const { return featureInfo; }
 
     void setFeatureInfo(const std::vector<FeatureInfo>& featureInfo) {
         this->featureInfo = featureInfo;
@@ -40,6 +41,13 @@ class STIPLeaf {
 
     void save(std::ofstream& treeStream) const;
     void load(std::queue<std::string>& nodeElements);
+
+    /**
+     * バイナリ形式
+     * クラスごとにまとめ，変位ベクトルをソートして差分を可変長整数で保存する
+     */
+    void encode(std::string& buffer) const;
+    void decode(const char* begin, const char* end);
 };
 }
 }
@@ -142,5 +142,12 @@ std::shared_ptr<STIPLeaf> STIPNode::loadLeafData(std::queue<std::string>& nodeEl
 
     return leaf;
 }
+
+std::shared_ptr<STIPLeaf> STIPNode::decodeLeafData(const std::string& leafRecord) const {
+    auto leaf = std::make_shared<STIPLeaf>();
+    leaf->decode(leafRecord.data(), leafRecord.data() + leafRecord.size());
+
+    return leaf;
+}
+}
 }
-}
\ No newline at end of file
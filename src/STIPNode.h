@@ -95,6 +95,7 @@ class STIPNode {
     void setNumberOfClasses(int classes) { numberOfClasses = classes; }
 
     LeafPtr loadLeafData(std::queue<std::string>& nodeElements) const;
+    LeafPtr decodeLeafData(const std::string& leafRecord) const;
 
    private:
     MeasureType decideType();
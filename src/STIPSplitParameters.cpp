@@ -1,4 +1,5 @@
 ﻿#include "STIPSplitParameters.h"
+#include "BinaryCoding.h"
 #include "STIPFeature.h"
 
 #include <boost/spirit/include/qi.hpp>
@@ -29,5 +30,17 @@ void STIPSplitParameters::load(std::queue<std::string>& nodeElements) {
     setIndex2(index2);
     nodeElements.pop();
 }
+
+void STIPSplitParameters::encode(std::string& buffer) const {
+    coding::writeVarint(buffer, getFeatureChannel());
+    coding::writeVarint(buffer, getIndex1());
+    coding::writeVarint(buffer, getIndex2());
+}
+
+void STIPSplitParameters::decode(const char*& cursor, const char* end) {
+    setFeatureChannel(coding::readVarint(cursor, end));
+    setIndex1(coding::readVarint(cursor, end));
+    setIndex2(coding::readVarint(cursor, end));
+}
+}
 }
-}
\ No newline at end of file
@@ -5,6 +5,7 @@
 
 #include <fstream>
 #include <queue>
+#include <string>
 
 namespace nuisken {
 namespace randomforests {
@@ -14,6 +15,12 @@ namespace randomforests {
  * 特徴の2点間の差分で分割する
  */
 class STIPSplitParameters {
+   public:
+    /**
+     * 保存時の要素数
+     */
+    static const int NUMBER_OF_ELEMENTS = 3;
+
    private:
     int index1;
     int index2;
@@ -33,6 +40,8 @@ class STIPSplitParameters {
 
     void save(std::ofstream& treeStream) const;
     void load(std::queue<std::string>& nodeElements);
+    void encode(std::string& buffer) const;
+    void decode(const char*& cursor, const char* end);
 
    private:
     void setIndex1(int index1) { this->index1 = index1; }
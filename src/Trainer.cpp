@@ -1,6 +1,7 @@
 #include "Trainer.h"
 #include "HoughForests.h"
 #include "LocalFeatureExtractor.h"
+#include "ThreadProcess.h"
 
 #include <numpy.hpp>
 
@@ -8,9 +9,11 @@
 #include <boost/tokenizer.hpp>
 
 #include <algorithm>
+#include <chrono>
 #include <filesystem>
 #include <iostream>
 #include <numeric>
+#include <queue>
 #include <random>
 
 namespace nuisken {
@@ -32,6 +35,14 @@ void Trainer::extractTrainingFeatures(const std::string& positiveVideoDirectoryP
                             yStep, tStep, negativeScales, nNegativeSamplesPerStep);
 }
 
+int Trainer::getNumberOfChannels() const {
+    using houghforests::LocalFeatureExtractor;
+    if (isFlowEnabled_) {
+        return LocalFeatureExtractor::N_CHANNELS_ + LocalFeatureExtractor::N_FLOW_CHANNELS_;
+    }
+    return LocalFeatureExtractor::N_CHANNELS_;
+}
+
 void Trainer::extractPositiveFeatures(const std::string& videoDirectoryPath,
                                       const std::string& dstDirectoryPath, int localWidth,
                                       int localHeight, int localDuration, int xBlockSize,
@@ -50,18 +61,21 @@ void Trainer::extractPositiveFeatures(const std::string& videoDirectoryPath,
         houghforests::LocalFeatureExtractor extractor(filePath, scales, localWidth, localHeight,
                                                       localDuration, xBlockSize, yBlockSize,
                                                       tBlockSize, xStep, yStep, tStep);
+        if (isFlowEnabled_) {
+            extractor.setFlowEnabled(true);
+        }
         std::vector<cv::Vec3i> selectedPoints;
         std::vector<std::vector<float>> selectedDescriptors;
+        std::vector<houghforests::DescriptorBatch> batches;
         while (true) {
             std::cout << "frame: " << extractor.getStoredFeatureBeginT() << std::endl;
-            std::vector<std::vector<cv::Vec3i>> points;
-            std::vector<std::vector<std::vector<float>>> descriptors;
-            extractor.extractLocalFeatures(points, descriptors);
+            extractor.extractLocalFeatures(batches);
             if (extractor.isEnded()) {
                 break;
             }
 
-            std::vector<size_t> indices(points[0].size());
+            const auto& batch = batches[0];
+            std::vector<size_t> indices(batch.size());
             std::iota(std::begin(indices), std::end(indices), 0);
             std::shuffle(std::begin(indices), std::end(indices), randomEngine);
 
@@ -71,8 +85,10 @@ void Trainer::extractPositiveFeatures(const std::string& videoDirectoryPath,
                     break;
                 }
 
-                selectedPoints.push_back(points[0][index]);
-                selectedDescriptors.push_back(descriptors[0][index]);
+                selectedPoints.push_back(batch.getPoint(index));
+                const float* descriptor = batch.getDescriptor(index);
+                selectedDescriptors.emplace_back(descriptor,
+                                                 descriptor + batch.getNumberOfDimensions());
             }
         }
 
@@ -126,22 +142,25 @@ void Trainer::extractNegativeFeatures(const std::string& videoDirectoryPath,
         houghforests::LocalFeatureExtractor extractor(filePath, scales, localWidth, localHeight,
                                                       localDuration, xBlockSize, yBlockSize,
                                                       tBlockSize, xStep, yStep, tStep);
+        if (isFlowEnabled_) {
+            extractor.setFlowEnabled(true);
+        }
         std::vector<cv::Vec3i> selectedPoints;
         std::vector<std::vector<float>> selectedDescriptors;
+        std::vector<houghforests::DescriptorBatch> batches;
         while (true) {
             std::cout << "frame: " << extractor.getStoredFeatureBeginT() << std::endl;
-            std::vector<std::vector<cv::Vec3i>> points;
-            std::vector<std::vector<std::vector<float>>> descriptors;
-            extractor.extractLocalFeatures(points, descriptors);
+            extractor.extractLocalFeatures(batches);
             if (extractor.isEnded()) {
                 break;
             }
 
             std::cout << "select" << std::endl;
-            for (int scaleIndex = 0; scaleIndex < points.size(); ++scaleIndex) {
+            for (int scaleIndex = 0; scaleIndex < batches.size(); ++scaleIndex) {
+                const auto& batch = batches[scaleIndex];
                 std::vector<size_t> indices;
                 int index = 0;
-                for (const auto& point : points[scaleIndex]) {
+                for (const auto& point : batch.getPoints()) {
                     cv::Vec3i scaledPoint(point);
                     scaledPoint(1) /= scales[scaleIndex];
                     scaledPoint(2) /= scales[scaleIndex];
@@ -159,8 +178,10 @@ void Trainer::extractNegativeFeatures(const std::string& videoDirectoryPath,
                         break;
                     }
 
-                    selectedPoints.push_back(points[scaleIndex][index]);
-                    selectedDescriptors.push_back(descriptors[scaleIndex][index]);
+                    selectedPoints.push_back(batch.getPoint(index));
+                    const float* descriptor = batch.getDescriptor(index);
+                    selectedDescriptors.emplace_back(descriptor,
+                                                     descriptor + batch.getNumberOfDimensions());
                 }
             }
         }
@@ -217,6 +238,30 @@ void Trainer::readLabelsInfo(const std::string& labelFilePath, int dataIndex,
     }
 }
 
+void Trainer::readLabelsInfo(const std::string& labelFilePath,
+                             std::map<int, std::vector<cv::Rect>>& boxes,
+                             std::map<int, std::vector<std::pair<int, int>>>& temporalRanges) const {
+    std::ifstream inputStream(labelFilePath);
+    std::string line;
+    while (std::getline(inputStream, line)) {
+        boost::char_separator<char> commaSeparator(",");
+        boost::tokenizer<boost::char_separator<char>> commaTokenizer(line, commaSeparator);
+        std::vector<std::string> tokens;
+        std::copy(std::begin(commaTokenizer), std::end(commaTokenizer), std::back_inserter(tokens));
+
+        auto dataIndex = std::stoi(tokens.at(0));
+        auto beginFrame = std::stoi(tokens.at(2));
+        auto endFrame = std::stoi(tokens.at(3));
+        auto topLeftX = std::stoi(tokens.at(4));
+        auto topLeftY = std::stoi(tokens.at(5));
+        auto bottomRightX = std::stoi(tokens.at(6));
+        auto bottomRightY = std::stoi(tokens.at(7));
+        boxes[dataIndex].emplace_back(cv::Point(topLeftX, topLeftY),
+                                      cv::Point(bottomRightX, bottomRightY));
+        temporalRanges[dataIndex].emplace_back(beginFrame, endFrame);
+    }
+}
+
 bool Trainer::contains(const cv::Rect& box, const std::pair<int, int>& temporalRange,
                        const cv::Vec3i& point) const {
     bool space = box.contains(cv::Point(point(2), point(1)));
@@ -245,15 +290,36 @@ void Trainer::train(const std::string& featureDirectoryPath, const std::string&
     using namespace nuisken::randomforests;
     using namespace nuisken::storage;
 
-    const int N_CHANNELS = 4;
+    const int N_CHANNELS = getNumberOfChannels();
 
-    std::vector<std::shared_ptr<STIPFeature>> trainingData;
-    for (int dataIndex : trainingDataIndices) {
-        std::cout << "read " << dataIndex << std::endl;
+    auto readBegin = std::chrono::system_clock::now();
 
-        std::vector<cv::Rect> boxes;
-        std::vector<std::pair<int, int>> ranges;
-        readLabelsInfo(labelFilePath, dataIndex, std::vector<int>(), boxes, ranges);
+    std::map<int, std::vector<cv::Rect>> allBoxes;
+    std::map<int, std::vector<std::pair<int, int>>> allRanges;
+    readLabelsInfo(labelFilePath, allBoxes, allRanges);
+
+    // ディレクトリは1度だけ走査し，ファイル名の順に読み込み順序を決める
+    std::vector<std::string> fileNames;
+    std::tr2::sys::path directory(featureDirectoryPath);
+    std::tr2::sys::directory_iterator end;
+    for (std::tr2::sys::directory_iterator itr(directory); itr != end; ++itr) {
+        fileNames.push_back(itr->path().filename().string());
+    }
+    std::sort(std::begin(fileNames), std::end(fileNames));
+
+    std::map<int, std::vector<std::vector<std::string>>> dataFileNameTokens;
+    for (const auto& fileName : fileNames) {
+        boost::char_separator<char> separator("_");
+        boost::tokenizer<boost::char_separator<char>> tokenizer(fileName, separator);
+        std::vector<std::string> tokens;
+        std::copy(std::begin(tokenizer), std::end(tokenizer), std::back_inserter(tokens));
+        dataFileNameTokens[std::stoi(tokens.at(0))].push_back(tokens);
+    }
+
+    std::vector<DataReader> readers;
+    for (int dataIndex : trainingDataIndices) {
+        const auto& boxes = allBoxes[dataIndex];
+        const auto& ranges = allRanges[dataIndex];
 
         std::vector<cv::Vec3i> positiveActionPositions(boxes.size());
         for (int labelIndex = 0; labelIndex < boxes.size(); ++labelIndex) {
@@ -269,11 +335,36 @@ void Trainer::train(const std::string& featureDirectoryPath, const std::string&
 
         int negativeLabel = nClasses - 1;
 
-        auto tmpData = readData(featureDirectoryPath, dataIndex, positiveActionPositions,
-                                negativeLabel, isMaskUsed);
-        std::copy(std::begin(tmpData), std::end(tmpData), std::back_inserter(trainingData));
+        planData(featureDirectoryPath, dataFileNameTokens[dataIndex], dataIndex,
+                 positiveActionPositions, negativeLabel, isMaskUsed, readers);
+    }
+
+    // 並列に読み込んだ後，計画した順序で結合する
+    std::vector<std::vector<FeaturePtr>> readData(readers.size());
+    std::queue<std::function<void()>> tasks;
+    for (int readerIndex = 0; readerIndex < readers.size(); ++readerIndex) {
+        tasks.push([&readers, &readData, readerIndex]() {
+            readers.at(readerIndex)(readData.at(readerIndex));
+        });
+    }
+    thread::threadProcess(tasks, nThreads_);
+
+    std::size_t nTrainingData = 0;
+    for (const auto& data : readData) {
+        nTrainingData += data.size();
+    }
+    std::vector<std::shared_ptr<STIPFeature>> trainingData;
+    trainingData.reserve(nTrainingData);
+    for (auto& data : readData) {
+        std::move(std::begin(data), std::end(data), std::back_inserter(trainingData));
+        std::vector<FeaturePtr>().swap(data);
     }
 
+    auto readEnd = std::chrono::system_clock::now();
+    std::cout << "read " << readers.size() << " sets, " << trainingData.size() << " samples: "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(readEnd - readBegin).count()
+              << " ms" << std::endl;
+
     auto type = TreeParameters::ALL_RATIO;
     bool hasNegatieClass = true;
     TreeParameters treeParameters(nClasses, nTrees, bootstrapRatio, maxDepth, minData, nSplits,
@@ -285,8 +376,7 @@ void Trainer::train(const std::string& featureDirectoryPath, const std::string&
     STIPNode stipNode(nClasses, N_CHANNELS, numberOfFeatureDimensions);
     HoughForestsParameters houghParameters;
     houghParameters.setTreeParameters(treeParameters);
-    int nThreads = 6;
-    HoughForests houghForests(stipNode, houghParameters, nThreads);
+    HoughForests houghForests(stipNode, houghParameters, nThreads_);
     houghForests.train(trainingData);
 
     std::tr2::sys::path directory(forestsDirectoryPath);
@@ -294,37 +384,24 @@ void Trainer::train(const std::string& featureDirectoryPath, const std::string&
         std::tr2::sys::create_directory(directory);
     }
 
-    houghForests.save(forestsDirectoryPath);
+    houghForests.save(forestsDirectoryPath, treeFileFormat_);
 }
 
-std::vector<Trainer::FeaturePtr> Trainer::readData(
-        const std::string& directoryPath, int dataIndex,
-        const std::vector<cv::Vec3i>& positiveActionPositions, int negativeLabel,
-        bool isMaskUsed) const {
-    std::tr2::sys::path directory(directoryPath);
-    std::tr2::sys::directory_iterator end;
+void Trainer::planData(const std::string& directoryPath,
+                       const std::vector<std::vector<std::string>>& fileNameTokens, int dataIndex,
+                       const std::vector<cv::Vec3i>& positiveActionPositions, int negativeLabel,
+                       bool isMaskUsed, std::vector<DataReader>& readers) const {
     std::vector<int> usedLabelIndices;
     bool isNegativeRead = false;
-    std::vector<FeaturePtr> trainingData;
-    for (std::tr2::sys::directory_iterator itr(directory); itr != end; ++itr) {
-        std::string filePath = itr->path().string();
-        std::string fileName = itr->path().filename().string();
-
-        boost::char_separator<char> separator("_");
-        boost::tokenizer<boost::char_separator<char>> tokenizer(fileName, separator);
-        std::vector<std::string> tokens;
-        std::copy(std::begin(tokenizer), std::end(tokenizer), std::back_inserter(tokens));
-        int fileDataIndex = std::stoi(tokens.at(0));
-        if (fileDataIndex != dataIndex) {
-            continue;
-        }
-
+    for (const auto& tokens : fileNameTokens) {
         if (tokens.size() == 2) {
             if (isNegativeRead) {
                 continue;
             }
-            auto negatives = readNegativeData(directoryPath, dataIndex, negativeLabel);
-            std::copy(std::begin(negatives), std::end(negatives), std::back_inserter(trainingData));
+            readers.push_back([this, directoryPath, dataIndex,
+                               negativeLabel](std::vector<FeaturePtr>& trainingData) {
+                readNegativeData(directoryPath, dataIndex, negativeLabel, trainingData);
+            });
 
             isNegativeRead = true;
         } else if (tokens.size() == 4) {
@@ -335,22 +412,21 @@ std::vector<Trainer::FeaturePtr> Trainer::readData(
             }
 
             int classLabel = std::stoi(tokens.at(2));
-            auto positives = readPositiveData(directoryPath, dataIndex, labelIndex, classLabel,
-                                              positiveActionPositions.at(labelIndex), isMaskUsed);
-            std::copy(std::begin(positives), std::end(positives), std::back_inserter(trainingData));
+            cv::Vec3i actionPosition = positiveActionPositions.at(labelIndex);
+            readers.push_back([this, directoryPath, dataIndex, labelIndex, classLabel,
+                               actionPosition, isMaskUsed](std::vector<FeaturePtr>& trainingData) {
+                readPositiveData(directoryPath, dataIndex, labelIndex, classLabel, actionPosition,
+                                 isMaskUsed, trainingData);
+            });
 
             usedLabelIndices.push_back(labelIndex);
         }
     }
-
-    return trainingData;
 }
 
-std::vector<Trainer::FeaturePtr> Trainer::readPositiveData(const std::string& directoryPath,
-                                                           int dataIndex, int labelIndex,
-                                                           int classLabel,
-                                                           const cv::Vec3i& actionPosition,
-                                                           bool isMaskUsed) const {
+void Trainer::readPositiveData(const std::string& directoryPath, int dataIndex, int labelIndex,
+                               int classLabel, const cv::Vec3i& actionPosition, bool isMaskUsed,
+                               std::vector<FeaturePtr>& trainingData) const {
     std::string pointFilePath = (boost::format("%s%d_%d_%d_pt.npy") % directoryPath % dataIndex %
                                  labelIndex % classLabel)
                                         .str();
@@ -360,13 +436,12 @@ std::vector<Trainer::FeaturePtr> Trainer::readPositiveData(const std::string& di
     std::string foregroundFilePath = (boost::format("%s%d_%d_%d_fgd.npy") % directoryPath %
                                       dataIndex % labelIndex % classLabel)
                                              .str();
-    std::vector<Trainer::FeaturePtr> tmpFeatures;
     if (isMaskUsed) {
-        tmpFeatures = readLocalFeatures(pointFilePath, descriptorFilePath, foregroundFilePath,
-                                        classLabel, actionPosition);
+        readLocalFeatures(pointFilePath, descriptorFilePath, foregroundFilePath, classLabel,
+                          actionPosition, trainingData);
     } else {
-        tmpFeatures =
-                readLocalFeatures(pointFilePath, descriptorFilePath, classLabel, actionPosition);
+        readLocalFeatures(pointFilePath, descriptorFilePath, classLabel, actionPosition,
+                          trainingData);
     }
 
     std::string flippedPointFilePath = (boost::format("%s%d_%d_%d_flip_pt.npy") % directoryPath %
@@ -378,123 +453,92 @@ std::vector<Trainer::FeaturePtr> Trainer::readPositiveData(const std::string& di
     std::string flippedForegroundFilePath = (boost::format("%s%d_%d_%d_flip_fgd.npy") %
                                              directoryPath % dataIndex % labelIndex % classLabel)
                                                     .str();
-    std::vector<Trainer::FeaturePtr> tmpFlippedFeatures;
     if (isMaskUsed) {
-        tmpFlippedFeatures =
-                readLocalFeatures(flippedPointFilePath, flippedDescriptorFilePath,
-                                  flippedForegroundFilePath, classLabel, actionPosition);
+        readLocalFeatures(flippedPointFilePath, flippedDescriptorFilePath,
+                          flippedForegroundFilePath, classLabel, actionPosition, trainingData);
     } else {
-        tmpFlippedFeatures = readLocalFeatures(flippedPointFilePath, flippedDescriptorFilePath,
-                                               classLabel, actionPosition);
+        readLocalFeatures(flippedPointFilePath, flippedDescriptorFilePath, classLabel,
+                          actionPosition, trainingData);
     }
-
-    std::vector<FeaturePtr> trainingData;
-    std::copy(std::begin(tmpFeatures), std::end(tmpFeatures), std::back_inserter(trainingData));
-    std::copy(std::begin(tmpFlippedFeatures), std::end(tmpFlippedFeatures),
-              std::back_inserter(trainingData));
-    return trainingData;
 }
 
-std::vector<Trainer::FeaturePtr> Trainer::readNegativeData(const std::string& directoryPath,
-                                                           int dataIndex, int negativeLabel) const {
+void Trainer::readNegativeData(const std::string& directoryPath, int dataIndex, int negativeLabel,
+                               std::vector<FeaturePtr>& trainingData) const {
     std::string pointFilePath = (boost::format("%s%d_pt.npy") % directoryPath % dataIndex).str();
     std::string descriptorFilePath =
             (boost::format("%s%d_desc.npy") % directoryPath % dataIndex).str();
-    return readLocalFeatures(pointFilePath, descriptorFilePath, negativeLabel, cv::Vec3i());
+    readLocalFeatures(pointFilePath, descriptorFilePath, negativeLabel, cv::Vec3i(),
+                      trainingData);
 }
 
-std::vector<Trainer::FeaturePtr> Trainer::readLocalFeatures(const std::string& pointFilePath,
-                                                            const std::string& descriptorFilePath,
-                                                            int classLabel,
-                                                            const cv::Vec3i& actionPosition) const {
-    using namespace storage;
-    using namespace houghforests;
+void Trainer::readLocalFeatures(const std::string& pointFilePath,
+                                const std::string& descriptorFilePath, int classLabel,
+                                const cv::Vec3i& actionPosition,
+                                std::vector<FeaturePtr>& localFeatures) const {
+    io::MappedNumpyArray<int> points(pointFilePath);
+    io::MappedNumpyArray<float> descriptors(descriptorFilePath);
 
-    const int N_CHANNELS = LocalFeatureExtractor::N_CHANNELS_;
-
-    std::vector<int> pointShape;
-    std::vector<int> points;
-    aoba::LoadArrayFromNumpy<int>(pointFilePath, pointShape, points);
-
-    std::vector<int> descShape;
-    std::vector<float> descriptors;
-    aoba::LoadArrayFromNumpy<float>(descriptorFilePath, descShape, descriptors);
-
-    int nChannelFeatures = descShape[1] / N_CHANNELS;
-    std::vector<FeaturePtr> localFeatures;
-    for (int localIndex = 0; localIndex < pointShape[0]; ++localIndex) {
-        int pointIndex = localIndex * 3;
-        cv::Vec3i point(points[pointIndex], points[pointIndex + 1], points[pointIndex + 2]);
-        std::vector<Eigen::MatrixXf> features(N_CHANNELS);
-        for (int channelIndex = 0; channelIndex < N_CHANNELS; ++channelIndex) {
-            Eigen::MatrixXf feature(1, nChannelFeatures);
-            for (int featureIndex = 0; featureIndex < nChannelFeatures; ++featureIndex) {
-                int index =
-                        localIndex * descShape[1] + channelIndex * nChannelFeatures + featureIndex;
-                feature.coeffRef(0, featureIndex) = descriptors[index];
-            }
-            features.at(channelIndex) = feature;
-        }
+    std::vector<int> indices(points.getShape().at(0));
+    std::iota(std::begin(indices), std::end(indices), 0);
+    appendLocalFeatures(points, descriptors, indices, classLabel, actionPosition, localFeatures);
+}
 
-        cv::Vec3i offset = actionPosition - point;
-        auto data = std::make_shared<STIPFeature>(features, point, offset, std::make_pair(0.0, 0.0),
-                                                  classLabel);
-        data->setIndex(-1);
-        localFeatures.push_back(data);
+void Trainer::readLocalFeatures(const std::string& pointFilePath,
+                                const std::string& descriptorFilePath,
+                                const std::string& foregroundFilePath, int classLabel,
+                                const cv::Vec3i& actionPosition,
+                                std::vector<FeaturePtr>& localFeatures) const {
+    io::MappedNumpyArray<int> points(pointFilePath);
+    io::MappedNumpyArray<float> descriptors(descriptorFilePath);
+    io::MappedNumpyArray<unsigned char> foregrounds(foregroundFilePath);
+
+    // 前景マスクは(t, y, x)のC orderなのでインデックスの計算だけで参照する
+    const auto& fgdShape = foregrounds.getShape();
+    std::size_t yStep = fgdShape.at(2);
+    std::size_t tStep = fgdShape.at(1) * yStep;
+    const unsigned char* foregroundData = foregrounds.data();
+    const int* pointData = points.data();
+
+    std::vector<int> indices;
+    indices.reserve(points.getShape().at(0));
+    for (int localIndex = 0; localIndex < points.getShape().at(0); ++localIndex) {
+        const int* point = pointData + localIndex * 3;
+        if (foregroundData[point[0] * tStep + point[1] * yStep + point[2]] != 0) {
+            indices.push_back(localIndex);
+        }
     }
-    return localFeatures;
+    appendLocalFeatures(points, descriptors, indices, classLabel, actionPosition, localFeatures);
 }
 
-std::vector<Trainer::FeaturePtr> Trainer::readLocalFeatures(const std::string& pointFilePath,
-                                                            const std::string& descriptorFilePath,
-                                                            const std::string& foregroundFilePath,
-                                                            int classLabel,
-                                                            const cv::Vec3i& actionPosition) const {
+void Trainer::appendLocalFeatures(const io::MappedNumpyArray<int>& points,
+                                  const io::MappedNumpyArray<float>& descriptors,
+                                  const std::vector<int>& indices, int classLabel,
+                                  const cv::Vec3i& actionPosition,
+                                  std::vector<FeaturePtr>& localFeatures) const {
     using namespace storage;
     using namespace houghforests;
 
-    const int N_CHANNELS = LocalFeatureExtractor::N_CHANNELS_;
-
-    std::vector<int> pointShape;
-    std::vector<int> points;
-    aoba::LoadArrayFromNumpy<int>(pointFilePath, pointShape, points);
-
-    std::vector<int> descShape;
-    std::vector<float> descriptors;
-    aoba::LoadArrayFromNumpy<float>(descriptorFilePath, descShape, descriptors);
-
-    std::vector<int> fgdShape;
-    std::vector<unsigned char> foregrounds;
-    aoba::LoadArrayFromNumpy<unsigned char>(foregroundFilePath, fgdShape, foregrounds);
-    cv::Mat1b foregroundMat(fgdShape.size(), fgdShape.data());
-    foregroundMat.data = foregrounds.data();
-
-    int nChannelFeatures = descShape[1] / N_CHANNELS;
-    std::vector<FeaturePtr> localFeatures;
-    for (int localIndex = 0; localIndex < pointShape[0]; ++localIndex) {
-        int pointIndex = localIndex * 3;
-        cv::Vec3i point(points[pointIndex], points[pointIndex + 1], points[pointIndex + 2]);
-        if (foregroundMat(point) == 0) {
-            continue;
-        }
+    const int N_CHANNELS = getNumberOfChannels();
 
-        std::vector<Eigen::MatrixXf> features(N_CHANNELS);
-        for (int channelIndex = 0; channelIndex < N_CHANNELS; ++channelIndex) {
-            Eigen::MatrixXf feature(1, nChannelFeatures);
-            for (int featureIndex = 0; featureIndex < nChannelFeatures; ++featureIndex) {
-                int index =
-                        localIndex * descShape[1] + channelIndex * nChannelFeatures + featureIndex;
-                feature.coeffRef(0, featureIndex) = descriptors[index];
-            }
-            features.at(channelIndex) = feature;
-        }
+    int nDimensions = descriptors.getShape().at(1);
+    int nChannelFeatures = nDimensions / N_CHANNELS;
+    auto channelOffsets = std::make_shared<std::vector<int>>(N_CHANNELS + 1);
+    for (int channelIndex = 0; channelIndex <= N_CHANNELS; ++channelIndex) {
+        channelOffsets->at(channelIndex) = channelIndex * nChannelFeatures;
+    }
+    std::shared_ptr<const std::vector<int>> sharedChannelOffsets = channelOffsets;
 
+    const int* pointData = points.data();
+    localFeatures.reserve(localFeatures.size() + indices.size());
+    for (int localIndex : indices) {
+        const int* pointValues = pointData + localIndex * 3;
+        cv::Vec3i point(pointValues[0], pointValues[1], pointValues[2]);
         cv::Vec3i offset = actionPosition - point;
-        auto data = std::make_shared<STIPFeature>(features, point, offset, std::make_pair(0.0, 0.0),
-                                                  classLabel);
+        auto data = std::make_shared<STIPFeature>(
+                descriptors.getSharedData(static_cast<std::size_t>(localIndex) * nDimensions),
+                sharedChannelOffsets, point, offset, std::make_pair(0.0, 0.0), classLabel);
         data->setIndex(-1);
         localFeatures.push_back(data);
     }
-    return localFeatures;
 }
 }
\ No newline at end of file
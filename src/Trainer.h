@@ -1,10 +1,14 @@
 #ifndef TRAINER
 #define TRAINER
 
+#include "HoughForests.h"
+#include "MappedNumpyArray.h"
 #include "STIPFeature.h"
 
 #include <opencv2/core.hpp>
 
+#include <functional>
+#include <map>
 #include <memory>
 #include <string>
 #include <vector>
@@ -14,11 +18,32 @@ namespace nuisken {
 class Trainer {
    private:
     using FeaturePtr = std::shared_ptr<storage::STIPFeature>;
+    using DataReader = std::function<void(std::vector<FeaturePtr>&)>;
+
+    int nThreads_;
+    houghforests::HoughForests::TreeFileFormat treeFileFormat_;
+    bool isFlowEnabled_;
 
    public:
-    Trainer(){};
+    Trainer(int nThreads = 6)
+            : nThreads_(nThreads),
+              treeFileFormat_(houghforests::HoughForests::TreeFileFormat::CSV),
+              isFlowEnabled_(false){};
     ~Trainer(){};
 
+    /**
+     * 学習した木を保存する形式（既定はCSV）
+     */
+    void setTreeFileFormat(houghforests::HoughForests::TreeFileFormat format) {
+        treeFileFormat_ = format;
+    }
+
+    /**
+     * オプティカルフローのチャネルを加えた特徴を抽出し，学習する
+     * 抽出と学習で同じ設定にする
+     */
+    void setFlowEnabled(bool isFlowEnabled) { isFlowEnabled_ = isFlowEnabled; }
+
     void extractTrainingFeatures(const std::string& positiveVideoDirectoryPath,
                                  const std::string& negativeVideoDirectoryPath,
                                  const std::string& labelFilePath,
@@ -34,6 +59,8 @@ class Trainer {
                int minData, int nSplits, int nThresholds, bool isMaskUsed = true);
 
    private:
+    int getNumberOfChannels() const;
+
     void extractPositiveFeatures(const std::string& videoDirectoryPath,
                                  const std::string& dstDirectoryPath, int localWidth,
                                  int localHeight, int localDuration, int xBlockSize, int yBlockSize,
@@ -49,6 +76,9 @@ class Trainer {
     void readLabelsInfo(const std::string& labelFilePath, int dataIndex,
                         std::vector<int>& classLabels, std::vector<cv::Rect>& boxes,
                         std::vector<std::pair<int, int>>& temporalRanges) const;
+    void readLabelsInfo(const std::string& labelFilePath,
+                        std::map<int, std::vector<cv::Rect>>& boxes,
+                        std::map<int, std::vector<std::pair<int, int>>>& temporalRanges) const;
 
     bool contains(const cv::Rect& box, const std::pair<int, int>& temporalRange,
                   const cv::Vec3i& point) const;
@@ -56,22 +86,29 @@ class Trainer {
                   const std::vector<std::pair<int, int>>& temporalRanges,
                   const cv::Vec3i& point) const;
 
-    std::vector<FeaturePtr> readData(const std::string& directoryPath, int dataIndex,
-                                     const std::vector<cv::Vec3i>& positiveActionPositions,
-                                     int negativeLabel, bool isMaskUsed) const;
-    std::vector<FeaturePtr> readPositiveData(const std::string& directoryPath, int dataIndex,
-                                             int labelIndex, int classLabel,
-                                             const cv::Vec3i& actionPosition,
-                                             bool isMaskUsed) const;
-    std::vector<FeaturePtr> readNegativeData(const std::string& directoryPath, int dataIndex,
-                                             int negativeLabel) const;
-    std::vector<FeaturePtr> readLocalFeatures(const std::string& pointFilePath,
-                                              const std::string& descriptorFilePath, int classLabel,
-                                              const cv::Vec3i& actionPosition) const;
-    std::vector<FeaturePtr> readLocalFeatures(const std::string& pointFilePath,
-                                              const std::string& descriptorFilePath,
-                                              const std::string& foregroundFilePath, int classLabel,
-                                              const cv::Vec3i& actionPosition) const;
+    void planData(const std::string& directoryPath,
+                  const std::vector<std::vector<std::string>>& fileNameTokens, int dataIndex,
+                  const std::vector<cv::Vec3i>& positiveActionPositions, int negativeLabel,
+                  bool isMaskUsed, std::vector<DataReader>& readers) const;
+    void readPositiveData(const std::string& directoryPath, int dataIndex, int labelIndex,
+                          int classLabel, const cv::Vec3i& actionPosition, bool isMaskUsed,
+                          std::vector<FeaturePtr>& trainingData) const;
+    void readNegativeData(const std::string& directoryPath, int dataIndex, int negativeLabel,
+                          std::vector<FeaturePtr>& trainingData) const;
+    void readLocalFeatures(const std::string& pointFilePath,
+                           const std::string& descriptorFilePath, int classLabel,
+                           const cv::Vec3i& actionPosition,
+                           std::vector<FeaturePtr>& localFeatures) const;
+    void readLocalFeatures(const std::string& pointFilePath,
+                           const std::string& descriptorFilePath,
+                           const std::string& foregroundFilePath, int classLabel,
+                           const cv::Vec3i& actionPosition,
+                           std::vector<FeaturePtr>& localFeatures) const;
+    void appendLocalFeatures(const io::MappedNumpyArray<int>& points,
+                             const io::MappedNumpyArray<float>& descriptors,
+                             const std::vector<int>& indices, int classLabel,
+                             const cv::Vec3i& actionPosition,
+                             std::vector<FeaturePtr>& localFeatures) const;
 };
 }
 
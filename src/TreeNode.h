@@ -9,8 +9,10 @@
 
 #include <algorithm>
 #include <memory>
+#include <mutex>
 #include <queue>
 #include <random>
+#include <string>
 
 namespace nuisken {
 namespace randomforests {
@@ -48,7 +50,17 @@ class TreeNode {
      * マッチした時に返す値
      * （葉ノードのみ）
      */
-    LeafPtr leafData;
+    mutable LeafPtr leafData;
+
+    /**
+     * 遅延読み込み時の未解析の葉のデータ
+     * 最初にマッチした時にleafDataに変換する
+     * （isEncodedLeafがtrueならバイナリ形式）
+     */
+    mutable std::string leafRecord;
+    bool isLazyLeaf;
+    bool isEncodedLeaf;
+    mutable std::once_flag leafLoadFlag;
 
     /**
      * 分岐のパラメータ
@@ -67,12 +79,14 @@ class TreeNode {
     std::unique_ptr<TreeNode<Type>> rightChild;
 
    public:
-    TreeNode(){};
+    TreeNode() : isLazyLeaf(false), isEncodedLeaf(false){};
     TreeNode(const Type& type, int depth, int nodeIndex, bool leaf = false)
             : type(type),
               depth(depth),
               nodeIndex(nodeIndex),
               leaf(leaf),
+              isLazyLeaf(false),
+              isEncodedLeaf(false),
               tau(0.0),
               rightChild(nullptr),
               leftChild(nullptr){};
@@ -81,9 +95,14 @@ class TreeNode {
 
     int getDepth() const { return depth; }
 
-    std::unique_ptr<TreeNode<Type>> getLeftChild() const { return leftChild; }
+    const std::unique_ptr<TreeNode<Type>>& getLeftChild() const { return leftChild; }
 
-    std::unique_ptr<TreeNode<Type>> getRightChild() const { return rightChild; }
+    const std::unique_ptr<TreeNode<Type>>& getRightChild() const { return rightChild; }
+
+    LeafPtr getLeafData() const {
+        loadLeafData();
+        return leafData;
+    }
 
     int getNodeIndex() const { return nodeIndex; }
 
@@ -119,7 +138,31 @@ class TreeNode {
      * 現在のノード番号を返す
      */
     void save(std::ofstream& treeStream) const;
-    void load(std::ifstream& treeStream);
+
+    /**
+     * isLazyがtrueの場合，分岐ノードのみ解析し，
+     * 葉のデータは最初にマッチした時に解析する
+     */
+    void load(std::ifstream& treeStream, bool isLazy = false);
+
+    /**
+     * バイナリ形式で保存・読み込みする
+     * 読み込んだ葉のデータはloadLeafDataを呼ぶまで解析しない
+     */
+    void encode(std::string& buffer) const;
+    void decode(const char*& cursor, const char* end);
+
+    /**
+     * 未解析の葉のデータを解析する
+     */
+    void loadLeafData() const;
+
+    void collectLeaves(std::vector<const TreeNode<Type>*>& leaves) const;
+
+    /**
+     * 部分木の分岐ノードのパラメータを集める
+     */
+    void collectSplitParameters(std::vector<SplitParameters>& splitParameters) const;
 
    private:
     /**
@@ -131,6 +174,7 @@ class TreeNode {
 
     void saveNode(std::ofstream& treeStream) const;
     void loadNode(std::queue<std::string>& nodeElements);
+    void loadLazyLeafData() const;
 };
 }
 }
@@ -3,9 +3,12 @@
 
 #include "TreeNode.h"
 
+#include "BinaryCoding.h"
+
 #include <boost/spirit/include/qi.hpp>
 
 #include <limits>
+#include <stdexcept>
 
 namespace nuisken {
 namespace randomforests {
@@ -99,7 +102,7 @@ void TreeNode<Type>::split(const std::vector<Container>& splitValues, double tau
 template <class Type>
 typename TreeNode<Type>::LeafPtr TreeNode<Type>::match(const FeatureRawPtr& feature) const {
     if (isLeaf()) {
-        return leafData;
+        return getLeafData();
     } else {
         if (type.decision(feature, splitParameter, tau)) {
             return leftChild->match(feature);
@@ -127,16 +130,35 @@ void TreeNode<Type>::saveNode(std::ofstream& treeStream) const {
     treeStream << depth << "," << leaf << "," << tau << ",";
     splitParameter.save(treeStream);
 
+    // 遅延読み込みで一度も参照されなかった葉もここで解析してから書き出す
     if (leaf) {
-        leafData->save(treeStream);
+        getLeafData()->save(treeStream);
     }
 }
 
 template <class Type>
-void TreeNode<Type>::load(std::ifstream& treeStream) {
+void TreeNode<Type>::load(std::ifstream& treeStream, bool isLazy) {
     std::string line;
     std::getline(treeStream, line);
-    boost::tokenizer<boost::escaped_list_separator<char>> tokenizer(line);
+
+    //遅延読み込みでは分岐のパラメータまでを解析し，残りは葉のデータとして保持する
+    std::string nodeLine = line;
+    std::string::size_type recordBegin = std::string::npos;
+    if (isLazy) {
+        const int numberOfNodeElements = 3 + SplitParameters::NUMBER_OF_ELEMENTS;
+        recordBegin = 0;
+        for (int i = 0; i < numberOfNodeElements && recordBegin != std::string::npos; ++i) {
+            recordBegin = line.find(',', recordBegin);
+            if (recordBegin != std::string::npos) {
+                ++recordBegin;
+            }
+        }
+        if (recordBegin != std::string::npos) {
+            nodeLine = line.substr(0, recordBegin);
+        }
+    }
+
+    boost::tokenizer<boost::escaped_list_separator<char>> tokenizer(nodeLine);
     std::queue<std::string> nodeElements;
     for (auto it = std::begin(tokenizer); it != std::end(tokenizer); ++it) {
         nodeElements.push(*it);
@@ -145,15 +167,111 @@ void TreeNode<Type>::load(std::ifstream& treeStream) {
     loadNode(nodeElements);
 
     if (leaf) {
-        leafData = type.loadLeafData(nodeElements);
+        if (recordBegin != std::string::npos) {
+            leafRecord = line.substr(recordBegin);
+            isLazyLeaf = true;
+        } else {
+            leafData = type.loadLeafData(nodeElements);
+        }
+    } else {
+        leftChild = std::make_unique<TreeNode<Type>>();
+        leftChild->setType(type);
+        leftChild->load(treeStream, isLazy);
+
+        rightChild = std::make_unique<TreeNode<Type>>();
+        rightChild->setType(type);
+        rightChild->load(treeStream, isLazy);
+    }
+}
+
+template <class Type>
+void TreeNode<Type>::loadLeafData() const {
+    if (isLazyLeaf) {
+        std::call_once(leafLoadFlag, [this]() { loadLazyLeafData(); });
+    }
+}
+
+template <class Type>
+void TreeNode<Type>::loadLazyLeafData() const {
+    if (isEncodedLeaf) {
+        leafData = type.decodeLeafData(leafRecord);
+    } else {
+        boost::tokenizer<boost::escaped_list_separator<char>> tokenizer(leafRecord);
+        std::queue<std::string> leafElements;
+        for (auto it = std::begin(tokenizer); it != std::end(tokenizer); ++it) {
+            leafElements.push(*it);
+        }
+
+        leafData = type.loadLeafData(leafElements);
+    }
+
+    std::string().swap(leafRecord);
+}
+
+template <class Type>
+void TreeNode<Type>::encode(std::string& buffer) const {
+    buffer.push_back(static_cast<char>(leaf));
+    coding::writeVarint(buffer, depth);
+    coding::writeDouble(buffer, tau);
+    splitParameter.encode(buffer);
+
+    if (leaf) {
+        std::string leafBuffer;
+        getLeafData()->encode(leafBuffer);
+        coding::writeVarint(buffer, leafBuffer.size());
+        buffer.append(leafBuffer);
+    } else {
+        leftChild->encode(buffer);
+        rightChild->encode(buffer);
+    }
+}
+
+template <class Type>
+void TreeNode<Type>::decode(const char*& cursor, const char* end) {
+    if (cursor == end) {
+        throw std::runtime_error("truncated tree data");
+    }
+    leaf = (*cursor++ != 0);
+    depth = coding::readVarint(cursor, end);
+    tau = coding::readDouble(cursor, end);
+    splitParameter.decode(cursor, end);
+
+    if (leaf) {
+        auto leafSize = coding::readVarint(cursor, end);
+        if (static_cast<std::uint64_t>(end - cursor) < leafSize) {
+            throw std::runtime_error("truncated leaf data");
+        }
+        leafRecord.assign(cursor, leafSize);
+        cursor += leafSize;
+        isLazyLeaf = true;
+        isEncodedLeaf = true;
     } else {
         leftChild = std::make_unique<TreeNode<Type>>();
         leftChild->setType(type);
-        leftChild->load(treeStream);
+        leftChild->decode(cursor, end);
 
         rightChild = std::make_unique<TreeNode<Type>>();
         rightChild->setType(type);
-        rightChild->load(treeStream);
+        rightChild->decode(cursor, end);
+    }
+}
+
+template <class Type>
+void TreeNode<Type>::collectLeaves(std::vector<const TreeNode<Type>*>& leaves) const {
+    if (leaf) {
+        leaves.push_back(this);
+    } else {
+        leftChild->collectLeaves(leaves);
+        rightChild->collectLeaves(leaves);
+    }
+}
+
+template <class Type>
+void TreeNode<Type>::collectSplitParameters(std::vector<SplitParameters>& splitParameters) const {
+    if (!leaf) {
+        splitParameters.push_back(splitParameter);
+        leftChild->collectSplitParameters(splitParameters);
+        rightChild->collectSplitParameters(splitParameters);
     }
 }
 
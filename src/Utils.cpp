@@ -1,15 +1,20 @@
 ﻿#include "Utils.h"
+#include "ThreadProcess.h"
 
 #include <opencv2/imgproc/imgproc.hpp>
 
 #include <Eigen/Core>
 
+#include <boost/iostreams/device/mapped_file.hpp>
 #include <boost/spirit/include/qi.hpp>
 #include <boost/tokenizer.hpp>
 
+#include <algorithm>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <memory>
+#include <queue>
 
 namespace nuisken {
 
@@ -60,62 +65,127 @@ std::string readFile(const std::string& filePath) {
     return std::string(file.get(), size);
 }
 
-void readSTIPFeatures(const std::string& filePath,
-                      std::vector<std::vector<Eigen::MatrixXf>>& features,
-                      std::vector<cv::Vec3i>& points) {
-    std::string file = readFile(filePath);
-    std::vector<std::string> lines = string::split(file, '\n');
-    for (const auto& line : lines) {
-        if (line.find('#') != std::string::npos) {
-            continue;
-        }
+namespace {
 
-        std::vector<std::string> splitResults = string::split(line, ' ');
+/**
+ * 1行分の特徴を解析する
+ * 要素数が不正な行ではfalseを返す
+ */
+bool parseSTIPLine(const char* begin, const char* end, cv::Vec3i& point, float* descriptor) {
+    namespace qi = boost::spirit::qi;
 
-        if (splitResults.size() == 1) {
-            break;
-        } else if (splitResults.size() != 172) {
-            break;
-        }
+    const int N_TOKENS = 172;
+    const int Y_INDEX = 4;
+    const int X_INDEX = 5;
+    const int T_INDEX = 6;
+    const int HOG_BEGIN_INDEX = 9;
+    const int HOF_END_INDEX = HOG_BEGIN_INDEX + N_STIP_DIMENSIONS;
+
+    if (std::count(begin, end, ' ') != N_TOKENS - 1) {
+        return false;
+    }
 
-        int xIndex = 5;
-        int yIndex = 4;
-        int tIndex = 6;
-        cv::Vec3i centerPoint;
-        boost::spirit::qi::parse(std::begin(splitResults.at(tIndex)),
-                                 std::end(splitResults.at(tIndex)), boost::spirit::qi::int_,
-                                 centerPoint(T));
-        boost::spirit::qi::parse(std::begin(splitResults.at(yIndex)),
-                                 std::end(splitResults.at(yIndex)), boost::spirit::qi::int_,
-                                 centerPoint(Y));
-        boost::spirit::qi::parse(std::begin(splitResults.at(xIndex)),
-                                 std::end(splitResults.at(xIndex)), boost::spirit::qi::int_,
-                                 centerPoint(X));
-
-        int hogBeginIndex = 9;
-        int numberOfHogDimension = 72;
-        Eigen::MatrixXf hog(1, numberOfHogDimension);
-        for (int i = 0; i < numberOfHogDimension; ++i) {
-            boost::spirit::qi::parse(std::begin(splitResults.at(i + hogBeginIndex)),
-                                     std::end(splitResults.at(i + hogBeginIndex)),
-                                     boost::spirit::qi::double_, hog.coeffRef(0, i));
+    const char* tokenBegin = begin;
+    for (int tokenIndex = 0; tokenIndex < HOF_END_INDEX; ++tokenIndex) {
+        const char* tokenEnd = std::find(tokenBegin, end, ' ');
+        const char* first = tokenBegin;
+        if (tokenIndex == T_INDEX) {
+            qi::parse(first, tokenEnd, qi::int_, point(T));
+        } else if (tokenIndex == Y_INDEX) {
+            qi::parse(first, tokenEnd, qi::int_, point(Y));
+        } else if (tokenIndex == X_INDEX) {
+            qi::parse(first, tokenEnd, qi::int_, point(X));
+        } else if (tokenIndex >= HOG_BEGIN_INDEX) {
+            double value = 0.0;
+            qi::parse(first, tokenEnd, qi::double_, value);
+            descriptor[tokenIndex - HOG_BEGIN_INDEX] = static_cast<float>(value);
         }
+        tokenBegin = tokenEnd + 1;
+    }
+    return true;
+}
+}
 
-        int hofBeginIndex = 81;
-        int numberOfHofDimension = 90;
-        Eigen::MatrixXf hof(1, numberOfHofDimension);
-        for (int i = 0; i < numberOfHofDimension; ++i) {
-            boost::spirit::qi::parse(std::begin(splitResults.at(i + hofBeginIndex)),
-                                     std::end(splitResults.at(i + hofBeginIndex)),
-                                     boost::spirit::qi::double_, hof.coeffRef(0, i));
+void readSTIPFeatures(const std::string& filePath, std::vector<cv::Vec3i>& points,
+                      std::vector<float>& descriptors, int maxNumberOfThreads) {
+    {
+        std::ifstream inputStream(filePath, std::ios::binary | std::ios::ate);
+        if (!inputStream.is_open() || inputStream.tellg() <= 0) {
+            return;
         }
+    }
+
+    boost::iostreams::mapped_file_source file(filePath);
+    const char* fileBegin = file.data();
+    const char* fileEnd = fileBegin + file.size();
+
+    // 行の途中で分割しないように各ブロックの境界を次の改行の直後に合わせる
+    const std::size_t MIN_BLOCK_SIZE = 1 << 20;
+    std::size_t nBlocks = std::max<std::size_t>(
+            1, std::min<std::size_t>(maxNumberOfThreads * 4, file.size() / MIN_BLOCK_SIZE));
+    std::vector<const char*> blockBegins(nBlocks + 1, fileEnd);
+    blockBegins.front() = fileBegin;
+    for (std::size_t blockIndex = 1; blockIndex < nBlocks; ++blockIndex) {
+        const char* position = fileBegin + file.size() * blockIndex / nBlocks;
+        position = std::max(position, blockBegins.at(blockIndex - 1));
+        position = std::find(position, fileEnd, '\n');
+        blockBegins.at(blockIndex) = (position == fileEnd) ? fileEnd : position + 1;
+    }
+
+    std::vector<std::vector<cv::Vec3i>> blockPoints(nBlocks);
+    std::vector<std::vector<float>> blockDescriptors(nBlocks);
+    std::vector<char> isTerminated(nBlocks, false);
+    std::queue<std::function<void()>> tasks;
+    for (std::size_t blockIndex = 0; blockIndex < nBlocks; ++blockIndex) {
+        tasks.push([&, blockIndex]() {
+            auto& points = blockPoints.at(blockIndex);
+            auto& descriptors = blockDescriptors.at(blockIndex);
+            const char* lineBegin = blockBegins.at(blockIndex);
+            const char* blockEnd = blockBegins.at(blockIndex + 1);
+            while (lineBegin != blockEnd) {
+                const char* lineEnd = std::find(lineBegin, blockEnd, '\n');
+                const char* nextLineBegin = (lineEnd == blockEnd) ? blockEnd : lineEnd + 1;
+                if (lineEnd != lineBegin && *(lineEnd - 1) == '\r') {
+                    --lineEnd;
+                }
 
-        std::vector<Eigen::MatrixXf> featureVectors;
-        featureVectors.push_back(hog);
-        featureVectors.push_back(hof);
+                if (std::find(lineBegin, lineEnd, '#') != lineEnd) {
+                    lineBegin = nextLineBegin;
+                    continue;
+                }
+
+                cv::Vec3i point;
+                std::size_t descriptorIndex = descriptors.size();
+                descriptors.resize(descriptorIndex + N_STIP_DIMENSIONS);
+                if (!parseSTIPLine(lineBegin, lineEnd, point, descriptors.data() + descriptorIndex)) {
+                    descriptors.resize(descriptorIndex);
+                    isTerminated.at(blockIndex) = true;
+                    break;
+                }
+                points.push_back(point);
+                lineBegin = nextLineBegin;
+            }
+        });
+    }
+    thread::threadProcess(tasks, maxNumberOfThreads);
+
+    // 不正な行以降は読み込まない
+    std::size_t nPoints = 0;
+    std::size_t nUsedBlocks = 0;
+    while (nUsedBlocks < nBlocks) {
+        nPoints += blockPoints.at(nUsedBlocks).size();
+        if (isTerminated.at(nUsedBlocks++)) {
+            break;
+        }
+    }
 
-        features.push_back(featureVectors);
-        points.push_back(centerPoint);
+    points.reserve(points.size() + nPoints);
+    descriptors.reserve(descriptors.size() + nPoints * N_STIP_DIMENSIONS);
+    for (std::size_t blockIndex = 0; blockIndex < nUsedBlocks; ++blockIndex) {
+        points.insert(std::end(points), std::begin(blockPoints.at(blockIndex)),
+                      std::end(blockPoints.at(blockIndex)));
+        descriptors.insert(std::end(descriptors), std::begin(blockDescriptors.at(blockIndex)),
+                           std::end(blockDescriptors.at(blockIndex)));
     }
 }
 }
@@ -44,9 +44,16 @@ std::vector<std::string> split(const std::string& str, char delimiter);
 namespace io {
 std::string readFile(const std::string& filePath);
 
-void readSTIPFeatures(const std::string& filePath,
-                      std::vector<std::vector<Eigen::MatrixXf>>& features,
-                      std::vector<cv::Vec3i>& points);
+const int N_STIP_HOG_DIMENSIONS = 72;
+const int N_STIP_HOF_DIMENSIONS = 90;
+const int N_STIP_DIMENSIONS = N_STIP_HOG_DIMENSIONS + N_STIP_HOF_DIMENSIONS;
+
+/**
+ * STIPの特徴ファイルを読み込む
+ * descriptorsには1点につきHOG, HOFの順にN_STIP_DIMENSIONS個の値を連続して格納する
+ */
+void readSTIPFeatures(const std::string& filePath, std::vector<cv::Vec3i>& points,
+                      std::vector<float>& descriptors, int maxNumberOfThreads = 1);
 
 void saveXYTPoint(cv::FileStorage& fileStorage, const std::string& name, const cv::Vec3f& vec);
 void saveXYTPoint(cv::FileStorage& fileStorage, const std::string& name, const cv::Vec3f& vec,
@@ -0,0 +1,160 @@
+#include "VoteCache.h"
+
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+namespace nuisken {
+namespace houghforests {
+
+namespace {
+
+/**
+ * 投票1つ分の記録
+ */
+struct VoteRecord {
+    std::int32_t t;
+    std::int32_t y;
+    std::int32_t x;
+    float weight;
+    std::int32_t classLabel;
+    std::int32_t scaleIndex;
+};
+
+template <typename T>
+void writeValue(std::ofstream& outputStream, T value) {
+    outputStream.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template <typename T>
+T readValue(const char*& cursor, const char* end) {
+    if (end - cursor < static_cast<std::ptrdiff_t>(sizeof(T))) {
+        throw std::runtime_error("truncated vote cache");
+    }
+    T value;
+    std::memcpy(&value, cursor, sizeof(T));
+    cursor += sizeof(T);
+    return value;
+}
+}
+
+const char VoteCache::MAGIC_[4] = {'H', 'F', 'V', 'C'};
+const std::uint32_t VoteCache::VERSION_ = 1;
+
+VoteCache::~VoteCache() {
+    if (isWriting()) {
+        outputStream_.close();
+        std::remove(temporaryFilePath_.c_str());
+    }
+}
+
+bool VoteCache::open(const std::string& filePath, const std::string& key) {
+    {
+        std::ifstream inputStream(filePath, std::ios::binary | std::ios::ate);
+        if (!inputStream.is_open() || inputStream.tellg() <= 0) {
+            return false;
+        }
+    }
+
+    mappedFile_.open(filePath);
+    cursor_ = mappedFile_.data();
+    end_ = cursor_ + mappedFile_.size();
+    if (end_ - cursor_ < 12 || std::memcmp(cursor_, MAGIC_, sizeof(MAGIC_)) != 0) {
+        close();
+        return false;
+    }
+    cursor_ += sizeof(MAGIC_);
+    if (readValue<std::uint32_t>(cursor_, end_) != VERSION_) {
+        close();
+        return false;
+    }
+    std::uint32_t keySize = readValue<std::uint32_t>(cursor_, end_);
+    if (static_cast<std::size_t>(end_ - cursor_) < keySize ||
+        std::string(cursor_, keySize) != key) {
+        close();
+        return false;
+    }
+    cursor_ += keySize;
+    return true;
+}
+
+bool VoteCache::readCycle(std::size_t& storedFeatureBeginT, std::vector<VoteInfo>& votesInfo) {
+    if (cursor_ == end_) {
+        return false;
+    }
+
+    storedFeatureBeginT = readValue<std::uint64_t>(cursor_, end_);
+    std::uint64_t nVotes = readValue<std::uint64_t>(cursor_, end_);
+    if (static_cast<std::size_t>(end_ - cursor_) / sizeof(VoteRecord) < nVotes) {
+        throw std::runtime_error("truncated vote cache");
+    }
+
+    votesInfo.clear();
+    votesInfo.reserve(nVotes);
+    for (std::uint64_t i = 0; i < nVotes; ++i) {
+        VoteRecord record;
+        std::memcpy(&record, cursor_, sizeof(VoteRecord));
+        cursor_ += sizeof(VoteRecord);
+        votesInfo.emplace_back(cv::Vec3i(record.t, record.y, record.x), record.weight,
+                               record.classLabel, record.scaleIndex);
+    }
+    return true;
+}
+
+void VoteCache::create(const std::string& filePath, const std::string& key) {
+    filePath_ = filePath;
+    temporaryFilePath_ = filePath + ".tmp";
+    outputStream_.open(temporaryFilePath_, std::ios::binary);
+    outputStream_.write(MAGIC_, sizeof(MAGIC_));
+    writeValue<std::uint32_t>(outputStream_, VERSION_);
+    writeValue<std::uint32_t>(outputStream_, key.size());
+    outputStream_.write(key.data(), key.size());
+    cycleBuffer_.clear();
+    nCycleVotes_ = 0;
+}
+
+void VoteCache::writeVotes(const std::vector<std::vector<VoteInfo>>& votesInfo) {
+    for (const auto& oneFeatureVotesInfo : votesInfo) {
+        for (const auto& voteInfo : oneFeatureVotesInfo) {
+            cv::Vec3i votingPoint = voteInfo.getVotingPoint();
+            // 投票空間にはfloatで加算されるので重みはfloatで保存すれば十分
+            VoteRecord record = {votingPoint(0),
+                                 votingPoint(1),
+                                 votingPoint(2),
+                                 static_cast<float>(voteInfo.getWeight()),
+                                 voteInfo.getClassLabel(),
+                                 voteInfo.getIndex()};
+            cycleBuffer_.append(reinterpret_cast<const char*>(&record), sizeof(VoteRecord));
+            ++nCycleVotes_;
+        }
+    }
+}
+
+void VoteCache::endCycle(std::size_t storedFeatureBeginT) {
+    writeValue<std::uint64_t>(outputStream_, storedFeatureBeginT);
+    writeValue<std::uint64_t>(outputStream_, nCycleVotes_);
+    outputStream_.write(cycleBuffer_.data(), cycleBuffer_.size());
+    cycleBuffer_.clear();
+    nCycleVotes_ = 0;
+}
+
+void VoteCache::close() {
+    if (isReading()) {
+        mappedFile_.close();
+        cursor_ = nullptr;
+        end_ = nullptr;
+    }
+    if (isWriting()) {
+        bool isSucceeded = outputStream_.good();
+        outputStream_.close();
+        if (isSucceeded) {
+            std::remove(filePath_.c_str());
+            isSucceeded = std::rename(temporaryFilePath_.c_str(), filePath_.c_str()) == 0;
+        }
+        if (!isSucceeded) {
+            std::remove(temporaryFilePath_.c_str());
+        }
+    }
+}
+}
+}
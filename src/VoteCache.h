@@ -0,0 +1,59 @@
+#ifndef VOTE_CACHE
+#define VOTE_CACHE
+
+#include "Storage.h"
+
+#include <boost/iostreams/device/mapped_file.hpp>
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace nuisken {
+namespace houghforests {
+
+/**
+ * 検出1周期ごとの投票（投票先，重み，クラス，スケール）のキャッシュ
+ * 後処理のパラメータだけを変えて検出をやり直すときに使う
+ */
+class VoteCache {
+   private:
+    using VoteInfo = storage::VoteInfo<3>;
+
+    static const char MAGIC_[4];
+    static const std::uint32_t VERSION_;
+
+    boost::iostreams::mapped_file_source mappedFile_;
+    const char* cursor_;
+    const char* end_;
+
+    std::ofstream outputStream_;
+    std::string filePath_;
+    std::string temporaryFilePath_;
+    std::string cycleBuffer_;
+    std::uint64_t nCycleVotes_;
+
+   public:
+    VoteCache() : cursor_(nullptr), end_(nullptr), nCycleVotes_(0){};
+    ~VoteCache();
+
+    /**
+     * 完成したキャッシュを開く
+     * 存在しないか，keyが記録時と異なる場合はfalse
+     */
+    bool open(const std::string& filePath, const std::string& key);
+    bool readCycle(std::size_t& storedFeatureBeginT, std::vector<VoteInfo>& votesInfo);
+
+    void create(const std::string& filePath, const std::string& key);
+    void writeVotes(const std::vector<std::vector<VoteInfo>>& votesInfo);
+    void endCycle(std::size_t storedFeatureBeginT);
+    void close();
+
+    bool isReading() const { return mappedFile_.is_open(); }
+    bool isWriting() const { return outputStream_.is_open(); }
+};
+}
+}
+
+#endif
@@ -1,38 +1,60 @@
 #include "VotingSpace.h"
 #include "Utils.h"
 
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 
 namespace nuisken {
 namespace houghforests {
 
 void VotingSpace::inputVote(const cv::Vec3i& point, std::size_t scaleIndex, float weight) {
-    cv::Vec4i originalPoint(point.val);
-    originalPoint(S) = scaleIndex;
-    cv::Vec4i binnedPoint = binPoint(originalPoint);
-    binnedPoint(T) -= minT_;
-    if (binnedPoint(T) < 0 || binnedPoint(T) >= votingSpace_.size[T] || binnedPoint(X) < 0 ||
-        binnedPoint(X) >= votingSpace_.size[X] || binnedPoint(Y) < 0 ||
-        binnedPoint(Y) >= votingSpace_.size[Y] || scaleIndex < 0 ||
-        scaleIndex >= votingSpace_.size[S]) {
-        return;
+    cv::Vec4i binnedPoint;
+    if (binVote(point, scaleIndex, binnedPoint)) {
+        addVote(binnedPoint, weight);
     }
-    votingSpace_(binnedPoint) += weight;
+}
+
+bool VotingSpace::binVote(const cv::Vec3i& point, std::size_t scaleIndex,
+                          cv::Vec4i& binnedPoint) const {
+    cv::Vec4i originalPoint(point(T), point(Y), point(X), scaleIndex);
+    binnedPoint = binPoint(originalPoint);
+    binnedPoint(T) -= minT_;
+    return isInside(binnedPoint);
 }
 
 void VotingSpace::deleteOldVotes() {
-    std::vector<cv::Range> srcRanges = {
-            cv::Range(deleteStep_, votingSpace_.size[T]), cv::Range(0, votingSpace_.size[Y]),
-            cv::Range(0, votingSpace_.size[X]), cv::Range(0, votingSpace_.size[S])};
-    std::vector<cv::Range> dstRanges = srcRanges;
-    dstRanges.at(T) = cv::Range(0, votingSpace_.size[T] - deleteStep_);
-    votingSpace_(srcRanges.data()).copyTo(votingSpace_(dstRanges.data()));
-    std::vector<cv::Range> deleteRanges = srcRanges;
-    deleteRanges.at(T) = cv::Range(votingSpace_.size[T] - deleteStep_, votingSpace_.size[T]);
-    votingSpace_(deleteRanges.data()) = 0.0;
+    // 期限切れのtの面だけを消し，そこを新しいtとして使う
+    std::size_t nDeletedTBins = std::min<std::size_t>(deleteStep_, sizes_.at(T));
+    for (int binnedT = 0; binnedT < nDeletedTBins; ++binnedT) {
+        clearTBin(toStorageT(binnedT));
+    }
+    originT_ = (originT_ + deleteStep_) % sizes_.at(T);
 
     minT_ += deleteStep_;
     maxT_ += deleteStep_;
+
+    if (smoothedScores_.empty()) {
+        return;
+    }
+    int shift = deleteStep_;
+    if (shift >= sizes_.at(T) || shift % steps_.at(T) != 0) {
+        markDirty(0, sizes_.at(T));
+        return;
+    }
+    // 平滑化したスコアも格子点のtをずらし，末尾の空いた所と削除した投票が影響する先頭を求め直す
+    std::size_t nGridPlanePoints = static_cast<std::size_t>(nGridYs_) * nGridXs_ * sizes_.at(S);
+    int nShiftedGridTs = shift / steps_.at(T);
+    std::rotate(std::begin(smoothedScores_),
+                std::begin(smoothedScores_) + nShiftedGridTs * nGridPlanePoints,
+                std::end(smoothedScores_));
+    if (dirtyBeginT_ < dirtyEndT_) {
+        dirtyBeginT_ = std::max(dirtyBeginT_ - shift, 0);
+        dirtyEndT_ = std::max(dirtyEndT_ - shift, 0);
+    }
+    int tRadius = calculateGaussianKernel(tau_).size() / 2;
+    markDirty(0, tRadius);
+    markDirty((nGridTs_ - nShiftedGridTs) * steps_.at(T), sizes_.at(T));
 }
 
 std::vector<cv::Vec4f> VotingSpace::getOriginalGridPoints() const {
@@ -52,11 +74,251 @@ std::vector<float> VotingSpace::getGridVotingScores() const {
     std::vector<float> scores;
     scores.reserve(gridPoints_.size());
     for (const auto& point : gridPoints_) {
-        scores.push_back(votingSpace_(point));
+        scores.push_back(getScore(point));
     }
     return scores;
 }
 
+std::vector<float> VotingSpace::getSmoothedGridVotingScores(std::size_t beginT,
+                                                            std::size_t endT) const {
+    if (smoothedScores_.empty()) {
+        smoothedScores_.assign(gridPoints_.size(), 0.0f);
+        markDirty(0, sizes_.at(T));
+    }
+    if (beginT <= endT) {
+        // 投票したtのビンから平滑化の半径までの格子点が変わる
+        int tRadius = calculateGaussianKernel(tau_).size() / 2;
+        markDirty(binT(beginT) - static_cast<int>(minT_) - tRadius,
+                  binT(endT) - static_cast<int>(minT_) + 1 + tRadius);
+    }
+    if (dirtyBeginT_ < dirtyEndT_) {
+        int beginGridT = (dirtyBeginT_ + steps_.at(T) - 1) / steps_.at(T);
+        int endGridT = std::min((dirtyEndT_ + steps_.at(T) - 1) / steps_.at(T), nGridTs_);
+        smoothGridTs(beginGridT, endGridT);
+        dirtyBeginT_ = 0;
+        dirtyEndT_ = 0;
+    }
+    return smoothedScores_;
+}
+
+void VotingSpace::markDirty(int beginT, int endT) const {
+    beginT = std::max(beginT, 0);
+    endT = std::min(endT, sizes_.at(T));
+    if (beginT >= endT) {
+        return;
+    }
+    if (dirtyBeginT_ >= dirtyEndT_) {
+        dirtyBeginT_ = beginT;
+        dirtyEndT_ = endT;
+    } else {
+        dirtyBeginT_ = std::min(dirtyBeginT_, beginT);
+        dirtyEndT_ = std::max(dirtyEndT_, endT);
+    }
+}
+
+void VotingSpace::smoothGridTs(int beginGridT, int endGridT) const {
+    std::vector<float> tKernel = calculateGaussianKernel(tau_);
+    std::vector<float> yxKernel = calculateGaussianKernel(sigma_);
+    int tRadius = tKernel.size() / 2;
+    int yxRadius = yxKernel.size() / 2;
+    int nScales = sizes_.at(S);
+    std::vector<float> scaleKernel(nScales * nScales);
+    for (int s = 0; s < nScales; ++s) {
+        for (int ks = 0; ks < nScales; ++ks) {
+            double diff = scales_.at(s) - scales_.at(ks);
+            scaleKernel.at(s * nScales + ks) =
+                    std::exp(-diff * diff / (2.0 * scaleBandwidth_ * scaleBandwidth_));
+        }
+    }
+
+    int height = sizes_.at(Y);
+    int width = sizes_.at(X);
+    std::vector<float> plane(static_cast<std::size_t>(height) * width * nScales);
+    std::vector<float> yPlane(static_cast<std::size_t>(nGridYs_) * width * nScales);
+    std::vector<float> xPlane(static_cast<std::size_t>(nGridYs_) * nGridXs_ * nScales);
+    std::size_t nGridPlanePoints = xPlane.size();
+    for (int gridT = beginGridT; gridT < endGridT; ++gridT) {
+        // t方向は格子点のtの周りの面を重み付けして足す
+        std::fill(std::begin(plane), std::end(plane), 0.0f);
+        int t = gridT * steps_.at(T);
+        for (int dt = -tRadius; dt <= tRadius; ++dt) {
+            if (t + dt >= 0 && t + dt < sizes_.at(T)) {
+                addTBin(t + dt, tKernel.at(dt + tRadius), plane);
+            }
+        }
+
+        // y, xは格子点の位置だけ求める
+        for (int gridY = 0; gridY < nGridYs_; ++gridY) {
+            int y = gridY * steps_.at(Y);
+            float* yRow = yPlane.data() + static_cast<std::size_t>(gridY) * width * nScales;
+            std::fill(yRow, yRow + width * nScales, 0.0f);
+            for (int dy = std::max(-yxRadius, -y); dy <= std::min(yxRadius, height - 1 - y);
+                 ++dy) {
+                float weight = yxKernel.at(dy + yxRadius);
+                const float* row =
+                        plane.data() + static_cast<std::size_t>(y + dy) * width * nScales;
+                for (int i = 0; i < width * nScales; ++i) {
+                    yRow[i] += weight * row[i];
+                }
+            }
+        }
+        std::fill(std::begin(xPlane), std::end(xPlane), 0.0f);
+        for (int gridY = 0; gridY < nGridYs_; ++gridY) {
+            const float* yRow = yPlane.data() + static_cast<std::size_t>(gridY) * width * nScales;
+            for (int gridX = 0; gridX < nGridXs_; ++gridX) {
+                int x = gridX * steps_.at(X);
+                float* output = xPlane.data() +
+                                (static_cast<std::size_t>(gridY) * nGridXs_ + gridX) * nScales;
+                for (int dx = std::max(-yxRadius, -x); dx <= std::min(yxRadius, width - 1 - x);
+                     ++dx) {
+                    float weight = yxKernel.at(dx + yxRadius);
+                    const float* input = yRow + (x + dx) * nScales;
+                    for (int s = 0; s < nScales; ++s) {
+                        output[s] += weight * input[s];
+                    }
+                }
+            }
+        }
+
+        float* scores = smoothedScores_.data() + gridT * nGridPlanePoints;
+        for (std::size_t point = 0; point < nGridPlanePoints; point += nScales) {
+            for (int s = 0; s < nScales; ++s) {
+                float score = 0.0f;
+                for (int ks = 0; ks < nScales; ++ks) {
+                    score += scaleKernel.at(s * nScales + ks) * xPlane.at(point + ks);
+                }
+                scores[point + s] = score;
+            }
+        }
+    }
+}
+
+void VotingSpace::addTBin(int binnedT, float weight, std::vector<float>& plane) const {
+    int storageT = toStorageT(binnedT);
+    if (storage_ == Storage::DENSE) {
+        const float* slice = votingSpace_.ptr<float>(storageT);
+        for (std::size_t i = 0; i < plane.size(); ++i) {
+            plane[i] += weight * slice[i];
+        }
+        return;
+    }
+
+    // 確保していないブロックは飛ばす
+    int nScales = sizes_.at(S);
+    for (int yBrick = 0; yBrick < nYBricks_; ++yBrick) {
+        for (int xBrick = 0; xBrick < nXBricks_; ++xBrick) {
+            cv::Vec4i storagePoint(storageT, yBrick * BRICK_SIZE_, xBrick * BRICK_SIZE_, 0);
+            const auto& brick = bricks_[getBrickIndex(storagePoint)];
+            if (brick.empty()) {
+                continue;
+            }
+            int endY = std::min((yBrick + 1) * BRICK_SIZE_, sizes_.at(Y));
+            int endX = std::min((xBrick + 1) * BRICK_SIZE_, sizes_.at(X));
+            for (int y = storagePoint(Y); y < endY; ++y) {
+                for (int x = storagePoint(X); x < endX; ++x) {
+                    const float* input = brick.data() +
+                                         getBrickOffset(cv::Vec4i(storageT, y, x, 0));
+                    float* output = plane.data() +
+                                    (static_cast<std::size_t>(y) * sizes_.at(X) + x) * nScales;
+                    for (int s = 0; s < nScales; ++s) {
+                        output[s] += weight * input[s];
+                    }
+                }
+            }
+        }
+    }
+}
+
+std::vector<float> VotingSpace::calculateGaussianKernel(double bandwidth) const {
+    if (bandwidth <= 0.0) {
+        return std::vector<float>(1, 1.0f);
+    }
+    int radius = std::ceil(3.0 * bandwidth);
+    std::vector<float> kernel(2 * radius + 1);
+    for (int d = -radius; d <= radius; ++d) {
+        kernel.at(d + radius) = std::exp(-d * d / (2.0 * bandwidth * bandwidth));
+    }
+    return kernel;
+}
+
+std::size_t VotingSpace::getAllocatedBytes() const {
+    if (storage_ == Storage::DENSE) {
+        return votingSpace_.total() * sizeof(float);
+    }
+
+    std::size_t nBytes = 0;
+    for (const auto& brick : bricks_) {
+        nBytes += brick.size() * sizeof(float);
+    }
+    return nBytes;
+}
+
+bool VotingSpace::isInside(const cv::Vec4i& binnedPoint) const {
+    for (int axis = 0; axis < DIMENSION_SIZE_; ++axis) {
+        if (binnedPoint(axis) < 0 || binnedPoint(axis) >= sizes_.at(axis)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+float VotingSpace::getScore(const cv::Vec4i& binnedPoint) const {
+    cv::Vec4i storagePoint = toStoragePoint(binnedPoint);
+    if (storage_ == Storage::DENSE) {
+        return votingSpace_(storagePoint);
+    }
+
+    // 確保していないブロックには投票がない
+    const auto& brick = bricks_[getBrickIndex(storagePoint)];
+    return brick.empty() ? 0.0f : brick[getBrickOffset(storagePoint)];
+}
+
+float& VotingSpace::getOrAllocateScore(const cv::Vec4i& binnedPoint) {
+    cv::Vec4i storagePoint = toStoragePoint(binnedPoint);
+    if (storage_ == Storage::DENSE) {
+        return votingSpace_(storagePoint);
+    }
+
+    auto& brick = bricks_[getBrickIndex(storagePoint)];
+    if (brick.empty()) {
+        brick.assign(BRICK_SIZE_ * BRICK_SIZE_ * sizes_.at(S), 0.0f);
+    }
+    return brick[getBrickOffset(storagePoint)];
+}
+
+cv::Vec4i VotingSpace::toStoragePoint(const cv::Vec4i& binnedPoint) const {
+    cv::Vec4i storagePoint = binnedPoint;
+    storagePoint(T) = toStorageT(binnedPoint(T));
+    return storagePoint;
+}
+
+void VotingSpace::clearTBin(int storageT) {
+    if (storage_ == Storage::DENSE) {
+        std::vector<cv::Range> ranges = {
+                cv::Range(storageT, storageT + 1), cv::Range(0, sizes_.at(Y)),
+                cv::Range(0, sizes_.at(X)), cv::Range(0, sizes_.at(S))};
+        votingSpace_(ranges.data()) = 0.0;
+        return;
+    }
+
+    std::size_t nPlaneBricks = static_cast<std::size_t>(nYBricks_) * nXBricks_;
+    for (std::size_t i = storageT * nPlaneBricks; i < (storageT + 1) * nPlaneBricks; ++i) {
+        std::vector<float>().swap(bricks_[i]);
+    }
+}
+
+std::size_t VotingSpace::getBrickIndex(const cv::Vec4i& storagePoint) const {
+    std::size_t yBrickIndex = storagePoint(Y) / BRICK_SIZE_;
+    std::size_t xBrickIndex = storagePoint(X) / BRICK_SIZE_;
+    return (storagePoint(T) * nYBricks_ + yBrickIndex) * nXBricks_ + xBrickIndex;
+}
+
+int VotingSpace::getBrickOffset(const cv::Vec4i& storagePoint) const {
+    int y = storagePoint(Y) % BRICK_SIZE_;
+    int x = storagePoint(X) % BRICK_SIZE_;
+    return (y * BRICK_SIZE_ + x) * sizes_.at(S) + storagePoint(S);
+}
+
 cv::Vec4i VotingSpace::binPoint(const cv::Vec4i& originalPoint) const {
     cv::Vec4i binnedPoint = originalPoint;
     binnedPoint(T) /= binSizes_.at(T);
@@ -78,10 +340,13 @@ cv::Vec4i VotingSpace::calculateOriginalPoint(const cv::Vec4i& binnedPoint) cons
 int VotingSpace::calculateOriginalT(int binnedT) const { return binnedT * binSizes_.at(T); }
 
 void VotingSpace::initializeGridPoints() {
-    for (std::size_t t = 0; t < votingSpace_.size[T]; t += steps_.at(T)) {
-        for (std::size_t y = 0; y < votingSpace_.size[Y]; y += steps_.at(Y)) {
-            for (std::size_t x = 0; x < votingSpace_.size[X]; x += steps_.at(X)) {
-                for (std::size_t s = 0; s < votingSpace_.size[S]; ++s) {
+    nGridTs_ = (sizes_.at(T) + steps_.at(T) - 1) / steps_.at(T);
+    nGridYs_ = (sizes_.at(Y) + steps_.at(Y) - 1) / steps_.at(Y);
+    nGridXs_ = (sizes_.at(X) + steps_.at(X) - 1) / steps_.at(X);
+    for (std::size_t t = 0; t < sizes_.at(T); t += steps_.at(T)) {
+        for (std::size_t y = 0; y < sizes_.at(Y); y += steps_.at(Y)) {
+            for (std::size_t x = 0; x < sizes_.at(X); x += steps_.at(X)) {
+                for (std::size_t s = 0; s < sizes_.at(S); ++s) {
                     gridPoints_.emplace_back(t, y, x, s);
                 }
             }
@@ -90,8 +355,23 @@ void VotingSpace::initializeGridPoints() {
 }
 
 cv::Mat1f VotingSpace::getVotingSpace(int t) const {
-    int binnedT = binT(t) - minT_;
-    std::vector<cv::Range> ranges = {cv::Range(binnedT, binnedT + 1),
+    int binnedT = binT(t) - static_cast<int>(minT_);
+    // 保持している範囲の外のフレームには投票がない
+    if (binnedT < 0 || binnedT >= sizes_.at(T)) {
+        return cv::Mat1f::zeros(sizes_.at(Y), sizes_.at(X));
+    }
+    if (storage_ == Storage::SPARSE) {
+        cv::Mat1f output = cv::Mat1f::zeros(sizes_.at(Y), sizes_.at(X));
+        for (int y = 0; y < sizes_.at(Y); ++y) {
+            for (int x = 0; x < sizes_.at(X); ++x) {
+                output(y, x) = getScore(cv::Vec4i(binnedT, y, x, 0));
+            }
+        }
+        return output;
+    }
+
+    int storageT = toStorageT(binnedT);
+    std::vector<cv::Range> ranges = {cv::Range(storageT, storageT + 1),
                                      cv::Range(0, votingSpace_.size[Y]),
                                      cv::Range(0, votingSpace_.size[X]), cv::Range(0, 1)};
     cv::Mat1f output(votingSpace_.size[Y], votingSpace_.size[X]);
@@ -6,14 +6,23 @@
 #include <opencv2/core/core.hpp>
 
 #include <array>
-#include <unordered_map>
 #include <vector>
 
 namespace nuisken {
 namespace houghforests {
 
+/**
+ * 1クラス分の投票空間（t, y, x, スケール）
+ * DENSEは全体を1つの配列で確保し，SPARSEは投票があった所だけをブロック単位で確保する
+ * SPARSEのブロックは1つのtのBRICK_SIZE_ x BRICK_SIZE_ x スケールの範囲
+ * tの軸は原点が動く環状の配列で持ち，古い投票の削除は期限切れのtの面を消して原点を進めるだけで済む
+ */
 class VotingSpace {
+   public:
+    enum class Storage { DENSE, SPARSE };
+
    private:
+    static const int BRICK_SIZE_ = 16;
     static const int DIMENSION_SIZE_ = 4;
     static const int SPATIAL_DIMENSION_SIZE_ = 2;
     static const int TEMPORAL_DIMENSION_SIZE_ = 1;
@@ -21,9 +30,12 @@ class VotingSpace {
     static const int S = 3;
     using Point = std::array<float, DIMENSION_SIZE_>;
 
+    Storage storage_;
+    std::array<int, DIMENSION_SIZE_> sizes_;
     cv::Mat1f votingSpace_;
-    std::unordered_map<std::size_t, float> allVotes_;
-    std::unordered_map<std::size_t, float> newVotes_;
+    int nYBricks_;
+    int nXBricks_;
+    std::vector<std::vector<float>> bricks_;
     std::vector<double> scales_;
     std::vector<int> steps_;
     std::vector<int> binSizes_;
@@ -33,15 +45,28 @@ class VotingSpace {
     std::size_t maxT_;
     std::size_t minT_;
     std::size_t deleteStep_;
+    int originT_;
 
     std::vector<cv::Vec4i> gridPoints_;
+    int nGridTs_;
+    int nGridYs_;
+    int nGridXs_;
+
+    /**
+     * 格子点での平滑化したスコア（gridPoints_と同じ並び，初めて求める時に確保する）
+     * [dirtyBeginT_, dirtyEndT_)のtの格子点は求め直す必要がある（tはgetMinTからの相対値）
+     */
+    mutable std::vector<float> smoothedScores_;
+    mutable int dirtyBeginT_;
+    mutable int dirtyEndT_;
 
    public:
     VotingSpace(std::size_t width, std::size_t height, std::size_t nScales,
                 const std::vector<double>& scales, const std::vector<int>& steps,
                 const std::vector<int>& binSizes, double sigma, double tau, double scaleBandwidth,
-                std::size_t deleteStep, std::size_t bufferLength)
-            : scales_(scales),
+                std::size_t deleteStep, std::size_t bufferLength, Storage storage = Storage::DENSE)
+            : storage_(storage),
+              scales_(scales),
               steps_(steps),
               binSizes_(binSizes),
               sigma_(sigma),
@@ -49,7 +74,10 @@ class VotingSpace {
               scaleBandwidth_(scaleBandwidth),
               maxT_(bufferLength),
               minT_(0),
-              deleteStep_(deleteStep) {
+              deleteStep_(deleteStep),
+              originT_(0),
+              dirtyBeginT_(0),
+              dirtyEndT_(0) {
         for (int axis = 0; axis < steps_.size(); ++axis) {
             steps_.at(axis) /= binSizes_.at(axis);
         }
@@ -58,23 +86,54 @@ class VotingSpace {
         maxT_ /= binSizes.at(T);
         deleteStep_ /= binSizes.at(T);
 
-        std::vector<int> sizes = {static_cast<int>(bufferLength / binSizes_.at(T)),
-                                  static_cast<int>(height / binSizes_.at(Y)),
-                                  static_cast<int>(width / binSizes_.at(X)),
-                                  static_cast<int>(nScales)};
-        votingSpace_.create(sizes.size(), sizes.data());
-        votingSpace_ = 0.0;
+        sizes_ = {static_cast<int>(bufferLength / binSizes_.at(T)),
+                  static_cast<int>(height / binSizes_.at(Y)),
+                  static_cast<int>(width / binSizes_.at(X)), static_cast<int>(nScales)};
+        nYBricks_ = (sizes_.at(Y) + BRICK_SIZE_ - 1) / BRICK_SIZE_;
+        nXBricks_ = (sizes_.at(X) + BRICK_SIZE_ - 1) / BRICK_SIZE_;
+        if (storage_ == Storage::DENSE) {
+            votingSpace_.create(sizes_.size(), sizes_.data());
+            votingSpace_ = 0.0;
+        } else {
+            bricks_.resize(static_cast<std::size_t>(sizes_.at(T)) * nYBricks_ * nXBricks_);
+        }
 
         initializeGridPoints();
     };
     ~VotingSpace(){};
 
+    /**
+     * tのビンが異なる投票は別のスレッドから同時に入れてよい
+     */
     void inputVote(const cv::Vec3i& point, std::size_t scaleIndex, float weight);
+
+    /**
+     * 投票先のビン（tはgetMinTからの相対値）を求める
+     * 投票空間の外ならfalse
+     */
+    bool binVote(const cv::Vec3i& point, std::size_t scaleIndex, cv::Vec4i& binnedPoint) const;
+
+    /**
+     * binVoteで求めたビンに加算する
+     * inputVoteと同じく，tのビンが異なれば別のスレッドから同時に呼んでよい
+     */
+    void addVote(const cv::Vec4i& binnedPoint, float weight) {
+        getOrAllocateScore(binnedPoint) += weight;
+    }
     void deleteOldVotes();
 
     std::vector<cv::Vec4f> getOriginalGridPoints() const;
     std::vector<float> getGridVotingScores() const;
 
+    /**
+     * 格子点での平滑化したスコア
+     * t, y, xはtau, sigmaのガウシアン（3倍で打ち切り），スケールはscaleBandwidthのガウシアンで
+     * 重み付けして足し合わせる（分離して1軸ずつ求める）
+     * 求め直すのは[beginT, endT]（元のt）に入った投票と古い投票の削除で変わる範囲だけなので，
+     * 投票を入れるたびにその範囲を渡して呼ぶ
+     */
+    std::vector<float> getSmoothedGridVotingScores(std::size_t beginT, std::size_t endT) const;
+
     cv::Vec4i binPoint(const cv::Vec4i& originalPoint) const;
     int binT(int t) const;
     cv::Vec4i calculateOriginalPoint(const cv::Vec4i& discretizedPoint) const;
@@ -84,9 +143,36 @@ class VotingSpace {
 
     std::size_t getMaxT() const { return maxT_; }
     std::size_t getMinT() const { return minT_; }
+    int getNumberOfTBins() const { return sizes_.at(T); }
+    Storage getStorage() const { return storage_; }
+
+    /**
+     * 投票の値に確保している領域のバイト数
+     */
+    std::size_t getAllocatedBytes() const;
 
    private:
     void initializeGridPoints();
+    void markDirty(int beginT, int endT) const;
+    void smoothGridTs(int beginGridT, int endGridT) const;
+    void addTBin(int binnedT, float weight, std::vector<float>& plane) const;
+    std::vector<float> calculateGaussianKernel(double bandwidth) const;
+    bool isInside(const cv::Vec4i& binnedPoint) const;
+    float getScore(const cv::Vec4i& binnedPoint) const;
+    float& getOrAllocateScore(const cv::Vec4i& binnedPoint);
+
+    /**
+     * getMinTからの相対的なtのビンを環状の配列での位置に変換する
+     */
+    int toStorageT(int binnedT) const { return (binnedT + originT_) % sizes_.at(T); }
+    cv::Vec4i toStoragePoint(const cv::Vec4i& binnedPoint) const;
+    void clearTBin(int storageT);
+
+    /**
+     * storagePointは環状の配列での位置
+     */
+    std::size_t getBrickIndex(const cv::Vec4i& storagePoint) const;
+    int getBrickOffset(const cv::Vec4i& storagePoint) const;
 };
 }
 }
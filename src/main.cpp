@@ -1,5 +1,6 @@
 #include "HoughForests.h"
 #include "LocalFeatureExtractor.h"
+#include "RawFrameFile.h"
 #include "STIPFeature.h"
 #include "Trainer.h"
 #include "Utils.h"
@@ -14,6 +15,7 @@
 
 #include <filesystem>
 #include <numeric>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
@@ -37,16 +39,16 @@ void extractPositiveFeatures(const std::string& videoDirectoryPath,
                                         xBlockSize, yBlockSize, tBlockSize, xStep, yStep, tStep);
         std::vector<cv::Vec3i> selectedPoints;
         std::vector<std::vector<float>> selectedDescriptors;
+        std::vector<DescriptorBatch> batches;
         while (true) {
             std::cout << "frame: " << extractor.getStoredFeatureBeginT() << std::endl;
-            std::vector<std::vector<cv::Vec3i>> points;
-            std::vector<std::vector<std::vector<float>>> descriptors;
-            extractor.extractLocalFeatures(points, descriptors);
+            extractor.extractLocalFeatures(batches);
             if (extractor.isEnded()) {
                 break;
             }
 
-            std::vector<size_t> indices(points[0].size());
+            const auto& batch = batches[0];
+            std::vector<size_t> indices(batch.size());
             std::iota(std::begin(indices), std::end(indices), 0);
             std::shuffle(std::begin(indices), std::end(indices), randomEngine);
 
@@ -56,8 +58,10 @@ void extractPositiveFeatures(const std::string& videoDirectoryPath,
                     break;
                 }
 
-                selectedPoints.push_back(points[0][index]);
-                selectedDescriptors.push_back(descriptors[0][index]);
+                selectedPoints.push_back(batch.getPoint(index));
+                const float* descriptor = batch.getDescriptor(index);
+                selectedDescriptors.emplace_back(descriptor,
+                                                 descriptor + batch.getNumberOfDimensions());
             }
         }
 
@@ -182,20 +186,20 @@ void extractNegativeFeatures(const std::string& videoDirectoryPath,
                                         xBlockSize, yBlockSize, tBlockSize, xStep, yStep, tStep);
         std::vector<cv::Vec3i> selectedPoints;
         std::vector<std::vector<float>> selectedDescriptors;
+        std::vector<DescriptorBatch> batches;
         while (true) {
             std::cout << "frame: " << extractor.getStoredFeatureBeginT() << std::endl;
-            std::vector<std::vector<cv::Vec3i>> points;
-            std::vector<std::vector<std::vector<float>>> descriptors;
-            extractor.extractLocalFeatures(points, descriptors);
+            extractor.extractLocalFeatures(batches);
             if (extractor.isEnded()) {
                 break;
             }
 
             std::cout << "select" << std::endl;
-            for (int scaleIndex = 0; scaleIndex < points.size(); ++scaleIndex) {
+            for (int scaleIndex = 0; scaleIndex < batches.size(); ++scaleIndex) {
+                const auto& batch = batches[scaleIndex];
                 std::vector<size_t> indices;
                 int index = 0;
-                for (const auto& point : points[scaleIndex]) {
+                for (const auto& point : batch.getPoints()) {
                     cv::Vec3i scaledPoint(point);
                     scaledPoint(1) /= scales[scaleIndex];
                     scaledPoint(2) /= scales[scaleIndex];
@@ -213,8 +217,10 @@ void extractNegativeFeatures(const std::string& videoDirectoryPath,
                         break;
                     }
 
-                    selectedPoints.push_back(points[scaleIndex][index]);
-                    selectedDescriptors.push_back(descriptors[scaleIndex][index]);
+                    selectedPoints.push_back(batch.getPoint(index));
+                    const float* descriptor = batch.getDescriptor(index);
+                    selectedDescriptors.emplace_back(descriptor,
+                                                     descriptor + batch.getNumberOfDimensions());
                 }
             }
         }
@@ -246,7 +252,9 @@ void extractNegativeFeatures(const std::string& videoDirectoryPath,
 void train(const std::string& featureDirectoryPath, const std::string& labelFilePath,
            const std::string& forestsDirectoryPath, int baseScale, int nTrees,
            double bootstrapRatio, int maxDepth, int minData, int nSplits, int nThresholds,
-           int beginValidationIndex, int endValidationIndex) {
+           int beginValidationIndex, int endValidationIndex,
+           nuisken::houghforests::HoughForests::TreeFileFormat treeFileFormat =
+                   nuisken::houghforests::HoughForests::TreeFileFormat::CSV) {
     using namespace nuisken::storage;
     using namespace nuisken::houghforests;
     using namespace nuisken::randomforests;
@@ -380,7 +388,7 @@ void train(const std::string& featureDirectoryPath, const std::string& labelFile
             std::tr2::sys::create_directory(directory);
         }
 
-        houghForests.save(outputDirectoryPath);
+        houghForests.save(outputDirectoryPath, treeFileFormat);
     }
 }
 
@@ -389,7 +397,7 @@ void detect(const std::string& forestsDirectoryPath, const std::string& videoFil
             int tBlockSize, int xStep, int yStep, int tStep, const std::vector<double>& scales,
             int nThreads, int width, int height, int baseScale, const std::vector<int>& binSizes,
             int votesDeleteStep, int votesBufferLength, const std::vector<double>& scoreThresholds,
-            double iouThreshold) {
+            double iouThreshold, bool isLazyLoading = false) {
     using namespace nuisken;
     using namespace nuisken::houghforests;
     using namespace nuisken::randomforests;
@@ -397,6 +405,7 @@ void detect(const std::string& forestsDirectoryPath, const std::string& videoFil
 
     LocalFeatureExtractor extractor(scales, localWidth, localHeight, localDuration, xBlockSize,
                                     yBlockSize, tBlockSize, xStep, yStep, tStep);
+    extractor.setNumberOfThreads(nThreads);
     cv::VideoCapture capture(videoFilePath);
 
     int nClasses = 7;
@@ -417,7 +426,9 @@ void detect(const std::string& forestsDirectoryPath, const std::string& videoFil
             iouThreshold, hasNegativeClass, isBackprojection, treeParameters);
     HoughForests houghForests(nThreads);
     houghForests.setHoughForestsParameters(parameters);
-    houghForests.load(forestsDirectoryPath);
+    houghForests.load(forestsDirectoryPath, isLazyLoading);
+    extractor.setUsedFeatureIndices(houghForests.getUsedFeatureIndices());
+    extractor.setLazyEvaluationEnabled(true);
 
     int fps = 30;
     std::vector<std::vector<DetectionResult<4>>> detectionResults;
@@ -457,6 +468,93 @@ std::vector<double> readAspectRatios(const std::string& filePath) {
     return aspectRatios;
 }
 
+void outputDetectionResults(
+        const std::string& outputDirectoryPath, int sequenceIndex,
+        const std::vector<std::vector<nuisken::storage::DetectionResult<4>>>& detectionResults) {
+    using namespace nuisken;
+    using namespace nuisken::houghforests;
+
+    for (auto classLabel = 0; classLabel < detectionResults.size(); ++classLabel) {
+        std::string outputFilePath = (boost::format("%s%d_%d_detection.txt") %
+                                      outputDirectoryPath % sequenceIndex % classLabel)
+                                             .str();
+        std::ofstream outputStream(outputFilePath);
+        for (const auto& detectionResult : detectionResults.at(classLabel)) {
+            LocalMaximum localMaximum = detectionResult.getLocalMaximum();
+            outputStream << "LocalMaximum," << localMaximum.getPoint()(T) << ","
+                         << localMaximum.getPoint()(Y) << "," << localMaximum.getPoint()(X) << ","
+                         << localMaximum.getValue() << "," << localMaximum.getPoint()(3)
+                         << std::endl;
+
+            auto contributionPoints = detectionResult.getContributionPoints();
+            for (const auto& contributionPoint : contributionPoints) {
+                outputStream << contributionPoint.getPoint()(T) << ","
+                             << contributionPoint.getPoint()(Y) << ","
+                             << contributionPoint.getPoint()(X) << ","
+                             << contributionPoint.getValue() << std::endl;
+            }
+            outputStream << std::endl;
+        }
+    }
+}
+
+std::string getVoteCacheKey(const std::string& forestsDirectoryPath,
+                            const nuisken::houghforests::LocalFeatureExtractor& extractor,
+                            int invalidLeafSizeThreshold) {
+    return forestsDirectoryPath + "," + extractor.getParameterKey() + "," +
+           std::to_string(invalidLeafSizeThreshold);
+}
+
+void detectSequence(
+        nuisken::houghforests::HoughForests& houghForests,
+        nuisken::houghforests::LocalFeatureExtractor& extractor, const std::string& videoFilePath,
+        const std::string& cacheDirectoryPath, const std::string& voteCacheFilePath,
+        const std::string& voteCacheKey,
+        std::vector<std::vector<nuisken::storage::DetectionResult<4>>>& detectionResults) {
+    using namespace nuisken::houghforests;
+
+    VoteCache voteCache;
+    if (!voteCacheFilePath.empty()) {
+        voteCache.create(voteCacheFilePath, voteCacheKey);
+        houghForests.setVoteCache(&voteCache);
+    }
+
+    std::string cacheFilePath;
+    if (!cacheDirectoryPath.empty()) {
+        cacheFilePath = DescriptorCache::getFilePath(cacheDirectoryPath, videoFilePath,
+                                                     extractor.getDescriptorKey());
+    }
+
+    DescriptorCache descriptorCache;
+    if (!cacheFilePath.empty() && descriptorCache.open(cacheFilePath)) {
+        std::cout << "replay descriptor cache: " << cacheFilePath << std::endl;
+        houghForests.detect(descriptorCache, detectionResults);
+        descriptorCache.close();
+        houghForests.setVoteCache(nullptr);
+        voteCache.close();
+        return;
+    }
+
+    if (!cacheFilePath.empty()) {
+        descriptorCache.create(cacheFilePath);
+        extractor.setDescriptorCache(&descriptorCache);
+    }
+    // 復号済みのフレーム（decode_grayで書き出したもの）があればそれを読む
+    std::string rawFilePath = videoFilePath + ".gray";
+    if (nuisken::io::RawFrameFile::isRawFrameFile(rawFilePath)) {
+        std::cout << "read decoded frames: " << rawFilePath << std::endl;
+        extractor.openVideo(rawFilePath);
+        houghForests.detect(extractor, detectionResults);
+    } else {
+        cv::VideoCapture capture(videoFilePath);
+        houghForests.detect(extractor, capture, 40, detectionResults);
+    }
+    extractor.setDescriptorCache(nullptr);
+    descriptorCache.close();
+    houghForests.setVoteCache(nullptr);
+    voteCache.close();
+}
+
 void detectAll(const std::string& forestsDirectoryPath, const std::string& outputDirectoryPath,
                const std::string& videoDirectoryPath, const std::string& durationDirectoryPath,
                const std::string& aspectDirectoryPath, int localWidth, int localHeight,
@@ -464,7 +562,8 @@ void detectAll(const std::string& forestsDirectoryPath, const std::string& outpu
                int yStep, int tStep, const std::vector<double>& scales, int nThreads, int width,
                int height, int baseScale, const std::vector<int>& binSizes, int votesDeleteStep,
                int votesBufferLength, const std::vector<double>& scoreThresholds,
-               double iouThreshold, int beginValidationIndex, int endValidationIndex) {
+               double iouThreshold, int beginValidationIndex, int endValidationIndex,
+               const std::string& cacheDirectoryPath = "", bool isLazyLoading = false) {
     using namespace nuisken;
     using namespace nuisken::houghforests;
     using namespace nuisken::randomforests;
@@ -500,42 +599,24 @@ void detectAll(const std::string& forestsDirectoryPath, const std::string& outpu
         HoughForests houghForests(nThreads);
         houghForests.setHoughForestsParameters(parameters);
         std::string forestsDir = forestsDirectoryPath + std::to_string(validationIndex) + "/";
-        houghForests.load(forestsDir);
+        houghForests.load(forestsDir, isLazyLoading);
+        std::vector<std::vector<int>> usedFeatureIndices = houghForests.getUsedFeatureIndices();
         for (int sequenceIndex : validationCombinations.at(validationIndex)) {
             std::string videoFilePath =
                     (boost::format("%sseq%d.avi") % videoDirectoryPath % sequenceIndex).str();
             LocalFeatureExtractor extractor(scales, localWidth, localHeight, localDuration,
                                             xBlockSize, yBlockSize, tBlockSize, xStep, yStep,
                                             tStep);
-            cv::VideoCapture capture(videoFilePath);
+            extractor.setNumberOfThreads(nThreads);
+            extractor.setUsedFeatureIndices(usedFeatureIndices);
+            extractor.setLazyEvaluationEnabled(true);
 
             std::vector<std::vector<DetectionResult<4>>> detectionResults;
-            houghForests.detect(extractor, capture, 40, detectionResults);
+            detectSequence(houghForests, extractor, videoFilePath, cacheDirectoryPath, "", "",
+                           detectionResults);
 
             std::cout << "output" << std::endl;
-            for (auto classLabel = 0; classLabel < detectionResults.size(); ++classLabel) {
-                std::string outputFilePath = (boost::format("%s%d_%d_detection.txt") %
-                                              outputDirectoryPath % sequenceIndex % classLabel)
-                                                     .str();
-
-                std::ofstream outputStream(outputFilePath);
-                for (const auto& detectionResult : detectionResults.at(classLabel)) {
-                    LocalMaximum localMaximum = detectionResult.getLocalMaximum();
-                    outputStream << "LocalMaximum," << localMaximum.getPoint()(T) << ","
-                                 << localMaximum.getPoint()(Y) << "," << localMaximum.getPoint()(X)
-                                 << "," << localMaximum.getValue() << ","
-                                 << localMaximum.getPoint()(3) << std::endl;
-
-                    auto contributionPoints = detectionResult.getContributionPoints();
-                    for (const auto& contributionPoint : contributionPoints) {
-                        outputStream << contributionPoint.getPoint()(T) << ","
-                                     << contributionPoint.getPoint()(Y) << ","
-                                     << contributionPoint.getPoint()(X) << ","
-                                     << contributionPoint.getValue() << std::endl;
-                    }
-                    outputStream << std::endl;
-                }
-            }
+            outputDetectionResults(outputDirectoryPath, sequenceIndex, detectionResults);
         }
     }
 }
@@ -549,7 +630,8 @@ void detectWebCamera(const std::string& forestsDirectoryPath,
                      const std::vector<int>& binSizes, int votesDeleteStep, int votesBufferLength,
                      int invalidLeafSizeThreshold, const std::vector<double>& scoreThresholds,
                      double iouThreshold, int fps,
-                     const std::vector<cv::Vec3i>& visualizationColors) {
+                     const std::vector<cv::Vec3i>& visualizationColors,
+                     bool isLazyLoading = false) {
     using namespace nuisken;
     using namespace nuisken::houghforests;
     using namespace nuisken::randomforests;
@@ -557,6 +639,7 @@ void detectWebCamera(const std::string& forestsDirectoryPath,
 
     LocalFeatureExtractor extractor(scales, localWidth, localHeight, localDuration, xBlockSize,
                                     yBlockSize, tBlockSize, xStep, yStep, tStep);
+    extractor.setNumberOfThreads(nThreads);
     cv::VideoCapture capture(0);
     capture.set(cv::CAP_PROP_FRAME_WIDTH, width);
     capture.set(cv::CAP_PROP_FRAME_HEIGHT, height);
@@ -574,7 +657,9 @@ void detectWebCamera(const std::string& forestsDirectoryPath,
             iouThreshold, hasNegativeClass, isBackprojection, treeParameters);
     HoughForests houghForests(nThreads);
     houghForests.setHoughForestsParameters(parameters);
-    houghForests.load(forestsDirectoryPath);
+    houghForests.load(forestsDirectoryPath, isLazyLoading);
+    extractor.setUsedFeatureIndices(houghForests.getUsedFeatureIndices());
+    extractor.setLazyEvaluationEnabled(true);
 
     std::vector<std::vector<DetectionResult<4>>> detectionResults;
     houghForests.detect(extractor, capture, fps, detectionResults, true,
@@ -587,9 +672,10 @@ void extractMIRU2016(const std::string& positiveVideoDirectoryPath,
                      int localWidth, int localHeight, int localDuration, int xBlockSize,
                      int yBlockSize, int tBlockSize, int xStep, int yStep, int tStep,
                      const std::vector<double>& negativeScales, int nPositiveSamplesPerStep,
-                     int nNegativeSamplesPerStep) {
+                     int nNegativeSamplesPerStep, bool isFlowEnabled = false) {
     using namespace nuisken;
     Trainer trainer;
+    trainer.setFlowEnabled(isFlowEnabled);
     trainer.extractTrainingFeatures(
             positiveVideoDirectoryPath, negativeVideoDirectoryPath, labelFilePath, dstDirectoryPath,
             localWidth, localHeight, localDuration, xBlockSize, yBlockSize, tBlockSize, xStep,
@@ -600,9 +686,14 @@ void trainMIRU2016(const std::string& featureDirectoryPath, const std::string& l
                    const std::string& forestsDirectoryPath,
                    const std::vector<std::vector<int>> trainingDataIndices, int nClasses,
                    int baseScale, int nTrees, double bootstrapRatio, int maxDepth, int minData,
-                   int nSplits, int nThresholds, bool isMaskUsed) {
+                   int nSplits, int nThresholds, bool isMaskUsed,
+                   nuisken::houghforests::HoughForests::TreeFileFormat treeFileFormat =
+                           nuisken::houghforests::HoughForests::TreeFileFormat::CSV,
+                   bool isFlowEnabled = false) {
     using namespace nuisken;
     Trainer trainer;
+    trainer.setTreeFileFormat(treeFileFormat);
+    trainer.setFlowEnabled(isFlowEnabled);
     for (int i = 0; i < trainingDataIndices.size(); ++i) {
         std::string currentForestsDirectoryPath =
                 (boost::format("%s%d/") % forestsDirectoryPath % i).str();
@@ -621,7 +712,12 @@ void detectMIRU2016CV(const std::string& forestsDirectoryPath,
                       int width, int height, int baseScale, const std::vector<int>& binSizes,
                       int votesDeleteStep, int votesBufferLength,
                       const std::vector<double>& scoreThresholds, double iouThreshold,
-                      int beginValidationIndex, int endValidationIndex) {
+                      int beginValidationIndex, int endValidationIndex,
+                      const std::string& cacheDirectoryPath = "",
+                      const std::string& voteCacheDirectoryPath = "",
+                      double motionThreshold = 0.0, bool isSparseVotingSpace = false,
+                      bool isVotingSpaceSmoothed = false, bool isLazyLoading = false,
+                      bool isFlowEnabled = false, bool isPyramidEnabled = false) {
     using namespace nuisken;
     using namespace nuisken::houghforests;
     using namespace nuisken::randomforests;
@@ -659,41 +755,147 @@ void detectMIRU2016CV(const std::string& forestsDirectoryPath,
         std::cout << "validation: " << validationIndex << std::endl;
         HoughForests houghForests(nThreads);
         houghForests.setHoughForestsParameters(parameters);
+        if (isSparseVotingSpace) {
+            houghForests.setVotingSpaceStorage(VotingSpace::Storage::SPARSE);
+        }
+        houghForests.setVotingSpaceSmoothingEnabled(isVotingSpaceSmoothed);
         std::string forestsDir = forestsDirectoryPath + std::to_string(validationIndex) + "/";
-        houghForests.load(forestsDir);
+        houghForests.load(forestsDir, isLazyLoading);
+        std::vector<std::vector<int>> usedFeatureIndices = houghForests.getUsedFeatureIndices();
         for (int sequenceIndex : validationCombinations.at(validationIndex)) {
             std::string videoFilePath =
                     (boost::format("%s%d.avi") % videoDirectoryPath % sequenceIndex).str();
             LocalFeatureExtractor extractor(scales, localWidth, localHeight, localDuration,
                                             xBlockSize, yBlockSize, tBlockSize, xStep, yStep,
                                             tStep);
-            cv::VideoCapture capture(videoFilePath);
+            extractor.setNumberOfThreads(nThreads);
+            if (isFlowEnabled) {
+                extractor.setFlowEnabled(true);
+            }
+            extractor.setPyramidEnabled(isPyramidEnabled);
+            extractor.setUsedFeatureIndices(usedFeatureIndices);
+            extractor.setLazyEvaluationEnabled(true);
+            extractor.setMotionThreshold(motionThreshold);
 
             std::vector<std::vector<DetectionResult<4>>> detectionResults;
-            houghForests.detect(extractor, capture, 40, detectionResults);
+            std::string voteCacheFilePath;
+            if (!voteCacheDirectoryPath.empty()) {
+                voteCacheFilePath = (boost::format("%s%d_%d.votes") % voteCacheDirectoryPath %
+                                     validationIndex % sequenceIndex)
+                                            .str();
+            }
+            detectSequence(houghForests, extractor, videoFilePath, cacheDirectoryPath,
+                           voteCacheFilePath,
+                           getVoteCacheKey(forestsDir, extractor, invalidLeafSizeThreshold),
+                           detectionResults);
 
             std::cout << "output" << std::endl;
-            for (auto classLabel = 0; classLabel < detectionResults.size(); ++classLabel) {
-                std::string outputFilePath = (boost::format("%s%d_%d_detection.txt") %
-                                              outputDirectoryPath % sequenceIndex % classLabel)
-                                                     .str();
-                std::ofstream outputStream(outputFilePath);
-                for (const auto& detectionResult : detectionResults.at(classLabel)) {
-                    LocalMaximum localMaximum = detectionResult.getLocalMaximum();
-                    outputStream << "LocalMaximum," << localMaximum.getPoint()(T) << ","
-                                 << localMaximum.getPoint()(Y) << "," << localMaximum.getPoint()(X)
-                                 << "," << localMaximum.getValue() << ","
-                                 << localMaximum.getPoint()(3) << std::endl;
-
-                    auto contributionPoints = detectionResult.getContributionPoints();
-                    for (const auto& contributionPoint : contributionPoints) {
-                        outputStream << contributionPoint.getPoint()(T) << ","
-                                     << contributionPoint.getPoint()(Y) << ","
-                                     << contributionPoint.getPoint()(X) << ","
-                                     << contributionPoint.getValue() << std::endl;
-                    }
-                    outputStream << std::endl;
+            outputDetectionResults(outputDirectoryPath, sequenceIndex, detectionResults);
+        }
+    }
+}
+
+void sweepMIRU2016CV(const std::string& forestsDirectoryPath,
+                     const std::string& outputDirectoryPath,
+                     const std::string& voteCacheDirectoryPath,
+                     const std::string& durationDirectoryPath,
+                     const std::string& aspectDirectoryPath, int localWidth, int localHeight,
+                     int localDuration, int xBlockSize, int yBlockSize, int tBlockSize, int xStep,
+                     int yStep, int tStep, const std::vector<double>& scales, int nThreads,
+                     int width, int height, int baseScale, const std::vector<int>& binSizes,
+                     int votesDeleteStep, int votesBufferLength,
+                     const std::vector<double>& scoreThresholdCandidates,
+                     const std::vector<double>& iouThresholdCandidates, int beginValidationIndex,
+                     int endValidationIndex, double motionThreshold = 0.0,
+                     bool isSparseVotingSpace = false, bool isVotingSpaceSmoothed = false,
+                     bool isFlowEnabled = false, bool isPyramidEnabled = false) {
+    using namespace nuisken;
+    using namespace nuisken::houghforests;
+    using namespace nuisken::randomforests;
+    using namespace nuisken::storage;
+
+    int nClasses = 7;
+    std::vector<double> bandwidths = {10.0, 8.0, 0.5};
+    std::vector<int> steps = {binSizes.at(1), binSizes.at(0)};
+    int invalidLeafSizeThreshold = 200;
+    bool hasNegativeClass = true;
+    bool isBackprojection = false;
+    TreeParameters treeParameters(nClasses, 0, 0, 0, 0, 0, 0, TreeParameters::ALL_RATIO,
+                                  hasNegativeClass);
+
+    std::vector<std::vector<int>> validationCombinations(10);
+    for (int i = 0; i < validationCombinations.size(); ++i) {
+        for (int j = 0; j < 2; ++j) {
+            validationCombinations.at(i).push_back(i * 2 + j);
+        }
+    }
+
+    LocalFeatureExtractor extractor(scales, localWidth, localHeight, localDuration, xBlockSize,
+                                    yBlockSize, tBlockSize, xStep, yStep, tStep);
+    extractor.setMotionThreshold(motionThreshold);
+    if (isFlowEnabled) {
+        // キャッシュのキーのチャネル数を抽出時と揃える
+        extractor.setFlowEnabled(true);
+    }
+    extractor.setPyramidEnabled(isPyramidEnabled);
+    for (int validationIndex = beginValidationIndex; validationIndex < endValidationIndex;
+         ++validationIndex) {
+        std::vector<double> aspectRatios =
+                readAspectRatios(aspectDirectoryPath + std::to_string(validationIndex) + ".csv");
+        std::vector<std::size_t> durations =
+                readDurations(durationDirectoryPath + std::to_string(validationIndex) + ".csv");
+
+        std::vector<HoughForestsParameters> parameterSets;
+        std::vector<std::string> parameterSetDirectoryPaths;
+        for (double scoreThreshold : scoreThresholdCandidates) {
+            for (double iouThreshold : iouThresholdCandidates) {
+                std::vector<double> scoreThresholds(nClasses - 1, scoreThreshold);
+                parameterSets.emplace_back(
+                        width, height, scales, baseScale, nClasses, bandwidths.at(0),
+                        bandwidths.at(1), bandwidths.at(2), steps.at(0), steps.at(1), binSizes,
+                        votesDeleteStep, votesBufferLength, invalidLeafSizeThreshold,
+                        scoreThresholds, durations, aspectRatios, iouThreshold, hasNegativeClass,
+                        isBackprojection, treeParameters);
+
+                std::string directoryPath = (boost::format("%sscore%g_iou%g/") %
+                                             outputDirectoryPath % scoreThreshold % iouThreshold)
+                                                    .str();
+                std::tr2::sys::path directory(directoryPath);
+                if (!std::tr2::sys::exists(directory)) {
+                    std::tr2::sys::create_directory(directory);
                 }
+                parameterSetDirectoryPaths.push_back(directoryPath);
+            }
+        }
+
+        std::cout << "validation: " << validationIndex << std::endl;
+        HoughForests houghForests(nThreads);
+        houghForests.setHoughForestsParameters(parameterSets.front());
+        if (isSparseVotingSpace) {
+            houghForests.setVotingSpaceStorage(VotingSpace::Storage::SPARSE);
+        }
+        houghForests.setVotingSpaceSmoothingEnabled(isVotingSpaceSmoothed);
+        std::string forestsDir = forestsDirectoryPath + std::to_string(validationIndex) + "/";
+        std::string voteCacheKey = getVoteCacheKey(forestsDir, extractor, invalidLeafSizeThreshold);
+        for (int sequenceIndex : validationCombinations.at(validationIndex)) {
+            std::string voteCacheFilePath = (boost::format("%s%d_%d.votes") %
+                                             voteCacheDirectoryPath % validationIndex %
+                                             sequenceIndex)
+                                                    .str();
+            VoteCache voteCache;
+            if (!voteCache.open(voteCacheFilePath, voteCacheKey)) {
+                std::cout << "vote cache not found: " << voteCacheFilePath << std::endl;
+                continue;
+            }
+
+            std::vector<std::vector<std::vector<DetectionResult<4>>>> detectionResults;
+            houghForests.sweep(voteCache, parameterSets, detectionResults);
+            voteCache.close();
+
+            std::cout << "output" << std::endl;
+            for (int setIndex = 0; setIndex < parameterSets.size(); ++setIndex) {
+                outputDetectionResults(parameterSetDirectoryPaths.at(setIndex), sequenceIndex,
+                                       detectionResults.at(setIndex));
             }
         }
     }
@@ -758,7 +960,8 @@ int main(int argc, char* argv[]) {
                 "{t tb||t block size}"
                 "{a xs||x step size}"
                 "{c ts||y step size}"
-                "{s sb||base scale}";
+                "{s sb||base scale}"
+                "{y flow|false|optical flow channels}";
         cv::CommandLineParser parser(argc, argv, keys);
 
         // std::string rootDirectoryPath = "D:/miru2016/";
@@ -784,7 +987,8 @@ int main(int argc, char* argv[]) {
         extractMIRU2016(positiveVideoDirectoryPath, negativeVideoDirectoryPath, labelFilePath,
                         dstDirectoryPath, localWidth, localHeight, localDuration, xBlockSize,
                         yBlockSize, tBlockSize, xStep, yStep, tStep, negativeScales,
-                        nPositiveSamplesPerStep, nNegativeSamplesPerStep);
+                        nPositiveSamplesPerStep, nNegativeSamplesPerStep,
+                        parser.get<bool>("y"));
     }
 
     //  {
@@ -816,7 +1020,9 @@ int main(int argc, char* argv[]) {
                 "{d dst||dst forests dir}"
                 "{t nt||ntrees}"
                 "{s sb||base scale}"
-                "{b bm||bool mask used}";
+                "{b bm||bool mask used}"
+                "{o format|csv|tree file format (csv, binary, compressed)}"
+                "{y flow|false|optical flow channels}";
         cv::CommandLineParser parser(argc, argv, keys);
 
         // std::string rootDirectoryPath = "D:/miru2016/";
@@ -841,9 +1047,22 @@ int main(int argc, char* argv[]) {
         int nSplits = 30;
         int nThresholds = 10;
         bool isMaskUsed = parser.get<bool>("b");
+        using TreeFileFormat = nuisken::houghforests::HoughForests::TreeFileFormat;
+        std::string formatName = parser.get<std::string>("o");
+        TreeFileFormat treeFileFormat;
+        if (formatName == "csv") {
+            treeFileFormat = TreeFileFormat::CSV;
+        } else if (formatName == "binary") {
+            treeFileFormat = TreeFileFormat::BINARY;
+        } else if (formatName == "compressed") {
+            treeFileFormat = TreeFileFormat::COMPRESSED_BINARY;
+        } else {
+            throw std::runtime_error("unknown tree file format: " + formatName);
+        }
         trainMIRU2016(featureDirectoryPath, labelFilePath, forestsDirectoryPath,
                       trainingDataIndices, nClasses, baseScale, nTrees, bootstrapRatio, maxDepth,
-                      minData, nSplits, nThresholds, isMaskUsed);
+                      minData, nSplits, nThresholds, isMaskUsed, treeFileFormat,
+                      parser.get<bool>("y"));
     }
 
     {
@@ -930,7 +1149,15 @@ int main(int argc, char* argv[]) {
                 "{t tb||t block size}"
                 "{a xs||x step size}"
                 "{c ts||y step size}"
-                "{s sb||base scale}";
+                "{s sb||base scale}"
+                "{e cache||descriptor cache dir}"
+                "{r votes||vote cache dir}"
+                "{g motion|0|motion threshold}"
+                "{k sparse|false|sparse voting space}"
+                "{u smooth|false|smoothed voting density}"
+                "{z lazy|false|lazy leaf loading}"
+                "{y flow|false|optical flow channels}"
+                "{q pyramid|false|scale pyramid}";
         cv::CommandLineParser parser(argc, argv, keys);
 
         // std::string rootDirectoryPath = "D:/miru2016/";
@@ -952,6 +1179,14 @@ int main(int argc, char* argv[]) {
         std::string durationPath = rootDirectoryPath + "average_durations/";
         std::string outputPath = rootDirectoryPath + parser.get<std::string>("o");
         std::string videoPath = rootDirectoryPath + parser.get<std::string>("v");
+        std::string cachePath;
+        if (!parser.get<std::string>("e").empty()) {
+            cachePath = rootDirectoryPath + parser.get<std::string>("e");
+        }
+        std::string voteCachePath;
+        if (!parser.get<std::string>("r").empty()) {
+            voteCachePath = rootDirectoryPath + parser.get<std::string>("r");
+        }
         int nClasses = 7;
         int nThreads = 6;
         std::vector<int> binSizes = {10, 20, 20};
@@ -962,7 +1197,62 @@ int main(int argc, char* argv[]) {
         detectMIRU2016CV(forestPath, outputPath, videoPath, durationPath, aspectPath, localWidth,
                          localHeight, localDuration, xBlockSize, yBlockSize, tBlockSize, xStep,
                          yStep, tStep, scales, nThreads, 640, 360, baseScale, binSizes,
-                         votesDeleteStep, votesBufferLength, scores, iouThreshold, 0, 10);
+                         votesDeleteStep, votesBufferLength, scores, iouThreshold, 0, 10,
+                         cachePath, voteCachePath, parser.get<double>("g"),
+                         parser.get<bool>("k"), parser.get<bool>("u"), parser.get<bool>("z"),
+                         parser.get<bool>("y"), parser.get<bool>("q"));
+    }
+
+    if (mode == 4) {
+        const cv::String keys =
+                "{f forests||forests dir}"
+                "{o output||output dir}"
+                "{r votes||vote cache dir}"
+                "{w lw||local width}"
+                "{d ld||local duration}"
+                "{x xb||x block size}"
+                "{t tb||t block size}"
+                "{a xs||x step size}"
+                "{c ts||y step size}"
+                "{s sb||base scale}"
+                "{g motion|0|motion threshold}"
+                "{k sparse|false|sparse voting space}"
+                "{u smooth|false|smoothed voting density}"
+                "{y flow|false|optical flow channels}"
+                "{q pyramid|false|scale pyramid}";
+        cv::CommandLineParser parser(argc, argv, keys);
+
+        std::string rootDirectoryPath = "F:/Hara/miru2016/";
+        int localWidth = parser.get<int>("w");
+        int localHeight = localWidth;
+        int localDuration = parser.get<int>("d");
+        int xBlockSize = parser.get<int>("x");
+        int yBlockSize = xBlockSize;
+        int tBlockSize = parser.get<int>("t");
+        int xStep = parser.get<int>("a");
+        int yStep = xStep;
+        int tStep = parser.get<int>("c");
+        std::vector<double> scales = {1.0};
+        int baseScale = parser.get<int>("s");
+
+        std::string forestPath = rootDirectoryPath + parser.get<std::string>("f");
+        std::string aspectPath = rootDirectoryPath + "average_aspect_ratios/";
+        std::string durationPath = rootDirectoryPath + "average_durations/";
+        std::string outputPath = rootDirectoryPath + parser.get<std::string>("o");
+        std::string voteCachePath = rootDirectoryPath + parser.get<std::string>("r");
+        int nThreads = 6;
+        std::vector<int> binSizes = {10, 20, 20};
+        int votesDeleteStep = 50;
+        int votesBufferLength = 200;
+        std::vector<double> scoreThresholdCandidates = {0.05, 0.1, 0.15, 0.2, 0.3, 0.5};
+        std::vector<double> iouThresholdCandidates = {0.1, 0.2, 0.3, 0.5};
+        sweepMIRU2016CV(forestPath, outputPath, voteCachePath, durationPath, aspectPath,
+                        localWidth, localHeight, localDuration, xBlockSize, yBlockSize, tBlockSize,
+                        xStep, yStep, tStep, scales, nThreads, 640, 360, baseScale, binSizes,
+                        votesDeleteStep, votesBufferLength, scoreThresholdCandidates,
+                        iouThresholdCandidates, 0, 10, parser.get<double>("g"),
+                        parser.get<bool>("k"), parser.get<bool>("u"), parser.get<bool>("y"),
+                        parser.get<bool>("q"));
     }
 
     // std::string rootDirectoryPath = "D:/UT-Interaction/";
@@ -0,0 +1,45 @@
+#include "RawFrameFile.h"
+
+#include <opencv2/core/core.hpp>
+
+#include <boost/format.hpp>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+// decode-gray: 動画を復号してグレースケールの生フレームファイル（<動画>.gray）に書き出す
+//   decode_gray -v=<video dir>/ -b=<first sequence> -e=<last sequence> -p=%d.avi
+// -pは検出（mode 2）が動画を探すときと同じファイル名の書式にする
+// 書き出したファイルは検出時に元の動画の代わりに読まれる
+int main(int argc, char* argv[]) {
+    using namespace nuisken::io;
+
+    const cv::String keys =
+            "{v video||video dir}"
+            "{b begin|0|first sequence}"
+            "{e end|19|last sequence}"
+            "{p pattern|%d.avi|video file name pattern}";
+    cv::CommandLineParser parser(argc, argv, keys);
+    std::string videoDirectoryPath = parser.get<std::string>("v");
+    int beginSequence = parser.get<int>("b");
+    int endSequence = parser.get<int>("e");
+    std::string fileNamePattern = parser.get<std::string>("p");
+
+    for (int sequenceIndex = beginSequence; sequenceIndex <= endSequence; ++sequenceIndex) {
+        std::string videoFilePath =
+                videoDirectoryPath + (boost::format(fileNamePattern) % sequenceIndex).str();
+        std::string rawFilePath = videoFilePath + ".gray";
+        RawFrameFile::write(videoFilePath, rawFilePath);
+
+        RawFrameFile rawFrameFile;
+        if (!rawFrameFile.open(rawFilePath)) {
+            std::cerr << "failed: " << videoFilePath << std::endl;
+            return 1;
+        }
+        std::cout << rawFilePath << ": " << rawFrameFile.getWidth() << "x"
+                  << rawFrameFile.getHeight() << ", " << rawFrameFile.getNumberOfFrames()
+                  << " frames, " << rawFrameFile.getFps() << " fps" << std::endl;
+    }
+    return 0;
+}
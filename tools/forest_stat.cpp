@@ -0,0 +1,136 @@
+#include "RandomForests.hpp"
+#include "STIPNode.h"
+#include "TreeNode.hpp"
+
+#include <opencv2/core/core.hpp>
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// forest-stat: 学習済みのフォレストの統計を表示する
+//   forest_stat -f=<forests dir>/ -c=<number of classes> -l=<invalid leaf size threshold>
+//               [-z=true (葉を遅延読み込みする)]
+int main(int argc, char* argv[]) {
+    using namespace nuisken::randomforests;
+
+    const cv::String keys =
+            "{f forests||forests dir}"
+            "{c classes|7|number of classes}"
+            "{n negative|true|has negative class}"
+            "{l leaf|200|invalid leaf size threshold}"
+            "{t threads|6|number of threads}"
+            "{z lazy|false|lazy leaf loading}";
+    cv::CommandLineParser parser(argc, argv, keys);
+    std::string forestsDirectoryPath = parser.get<std::string>("f");
+    int nClasses = parser.get<int>("c");
+    bool hasNegativeClass = parser.get<bool>("n");
+    int invalidLeafSizeThreshold = parser.get<int>("l");
+    int nThreads = parser.get<int>("t");
+    bool isLazyLoading = parser.get<bool>("z");
+    int negativeLabel = hasNegativeClass ? nClasses - 1 : -1;
+
+    STIPNode stipNode;
+    stipNode.setNumberOfClasses(nClasses);
+    RandomForests<STIPNode> randomForests;
+    randomForests.setType(stipNode);
+    randomForests.load(forestsDirectoryPath, nThreads, isLazyLoading);
+
+    const int N_HISTOGRAM_BINS = 24;
+    std::vector<long long> leafSizeHistogram(N_HISTOGRAM_BINS, 0);
+    std::vector<long long> classRecords(nClasses, 0);
+    long long nLeaves = 0;
+    long long nNodes = 0;
+    long long nRecords = 0;
+    long long nInvalidLeaves = 0;
+    long long nInvalidRecords = 0;
+    double expectedVotes = 0.0;
+
+    std::cout << "tree, depth, leaves, records, expected votes" << std::endl;
+    for (int treeIndex = 0; treeIndex < randomForests.getNumberOfTrees(); ++treeIndex) {
+        const auto& tree = randomForests.getTree(treeIndex);
+        std::vector<const TreeNode<STIPNode>*> leaves;
+        tree.collectLeaves(leaves);
+
+        long long nTreeRecords = 0;
+        double treeVotes = 0.0;
+        for (const auto& leaf : leaves) {
+            const auto& featureInfo = leaf->getLeafData()->getFeatureInfo();
+            long long leafSize = featureInfo.size();
+
+            int bin = 0;
+            while (bin < N_HISTOGRAM_BINS - 1 && (1LL << bin) <= leafSize) {
+                ++bin;
+            }
+            ++leafSizeHistogram.at(bin);
+
+            long long nPositiveRecords = 0;
+            for (const auto& info : featureInfo) {
+                ++classRecords.at(info.getClassLabel());
+                if (info.getClassLabel() != negativeLabel) {
+                    ++nPositiveRecords;
+                }
+            }
+
+            if (leafSize > invalidLeafSizeThreshold) {
+                ++nInvalidLeaves;
+                nInvalidRecords += leafSize;
+            } else {
+                // 学習データの分布でこの葉に到達する確率はleafSizeに比例する
+                treeVotes += static_cast<double>(leafSize) * nPositiveRecords;
+            }
+            nTreeRecords += leafSize;
+        }
+        if (nTreeRecords > 0) {
+            treeVotes /= nTreeRecords;
+        }
+
+        std::cout << treeIndex << ", " << tree.getDepth() << ", " << leaves.size() << ", "
+                  << nTreeRecords << ", " << treeVotes << std::endl;
+
+        nLeaves += leaves.size();
+        nNodes += 2 * leaves.size() - 1;
+        nRecords += nTreeRecords;
+        expectedVotes += treeVotes;
+    }
+
+    std::cout << std::endl << "leaf size histogram" << std::endl;
+    for (int bin = 0; bin < N_HISTOGRAM_BINS; ++bin) {
+        if (leafSizeHistogram.at(bin) == 0) {
+            continue;
+        }
+        // 最後のビンはそれ以上の大きさの葉を全て含む
+        long long lower = (bin == 0) ? 0 : (1LL << (bin - 1));
+        if (bin == N_HISTOGRAM_BINS - 1) {
+            std::cout << "[" << lower << ", inf): " << leafSizeHistogram.at(bin) << std::endl;
+        } else {
+            long long upper = (1LL << bin) - 1;
+            std::cout << "[" << lower << ", " << upper << "]: " << leafSizeHistogram.at(bin)
+                      << std::endl;
+        }
+    }
+
+    std::cout << std::endl << "class records" << std::endl;
+    for (int classLabel = 0; classLabel < nClasses; ++classLabel) {
+        std::cout << classLabel << ": " << classRecords.at(classLabel) << std::endl;
+    }
+
+    long long nodeBytes = nNodes * sizeof(TreeNode<STIPNode>);
+    // make_sharedの制御ブロック（参照カウント2つと仮想関数テーブル）を含める
+    long long leafBytes = nLeaves * (sizeof(STIPLeaf) + sizeof(void*) + 2 * sizeof(long));
+    long long recordBytes = nRecords * sizeof(STIPLeaf::FeatureInfo);
+
+    std::cout << std::endl;
+    std::cout << "trees: " << randomForests.getNumberOfTrees() << std::endl;
+    std::cout << "leaves: " << nLeaves << std::endl;
+    std::cout << "vote records: " << nRecords << std::endl;
+    std::cout << "leaves over threshold (" << invalidLeafSizeThreshold
+              << "): " << static_cast<double>(nInvalidLeaves) / std::max(nLeaves, 1LL) << " ("
+              << static_cast<double>(nInvalidRecords) / std::max(nRecords, 1LL) << " of records)"
+              << std::endl;
+    std::cout << "estimated memory: " << (nodeBytes + leafBytes + recordBytes) / (1024 * 1024)
+              << " MB (nodes " << nodeBytes / 1024 << " KB, leaves " << leafBytes / 1024
+              << " KB, records " << recordBytes / 1024 << " KB)" << std::endl;
+    std::cout << "expected votes per sample: " << expectedVotes << std::endl;
+}